@@ -0,0 +1,155 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "AdapterSnapshot.h"
+#include "Fnv.h"
+
+// Microsoft recommends starting at 15K to avoid calling twice on most systems
+#define INITIAL_BUFFER_SIZE 15000
+
+// Adapters can show up between the size check and the real call
+#define MAX_TRIES 3
+
+AdapterSnapshot::AdapterSnapshot()
+{
+	bufferSize = INITIAL_BUFFER_SIZE;
+	buffer = new BYTE[bufferSize];
+
+	hash = 0;
+}
+
+AdapterSnapshot::~AdapterSnapshot()
+{
+	delete[] buffer;
+}
+
+bool AdapterSnapshot::load()
+{
+	ULONG flags =
+		GAA_FLAG_INCLUDE_GATEWAYS |
+		GAA_FLAG_SKIP_ANYCAST |
+		GAA_FLAG_SKIP_MULTICAST |
+		GAA_FLAG_SKIP_DNS_SERVER |
+		GAA_FLAG_SKIP_FRIENDLY_NAME;
+
+	ULONG infoRval = ERROR_BUFFER_OVERFLOW;
+	for (int tries = 0; (tries < MAX_TRIES) && (infoRval == ERROR_BUFFER_OVERFLOW); tries++) {
+		ULONG neededSize = bufferSize;
+		infoRval = GetAdaptersAddresses(AF_UNSPEC, flags, NULL,
+			(PIP_ADAPTER_ADDRESSES)buffer, &neededSize);
+
+		if (infoRval == ERROR_BUFFER_OVERFLOW) {
+			// Leave some room so one more adapter doesn't put us back here
+			delete[] buffer;
+			bufferSize = neededSize + (neededSize / 4);
+			buffer = new BYTE[bufferSize];
+		}
+	}
+
+	if (infoRval == ERROR_NO_DATA) {
+		// No adapters at all, which isn't really an error
+	} else if (infoRval != NO_ERROR) {
+		Log::log(LOG_ERROR, _T("Error from GetAdaptersAddresses: %d"), infoRval);
+		return false;
+	}
+
+	adapters.clear();
+	ip4Networks.clear();
+	ip6Prefixes.clear();
+	gateways.clear();
+
+	uint64_t newHash = FNV_OFFSET_BASIS;
+
+	if (infoRval == NO_ERROR) {
+		for (PIP_ADAPTER_ADDRESSES curr = (PIP_ADAPTER_ADDRESSES)buffer; curr != NULL; curr = curr->Next) {
+			Adapter adapter;
+			adapter.luid = curr->Luid;
+			adapter.type = curr->IfType;
+			adapter.operStatus = curr->OperStatus;
+			adapter.name = curr->AdapterName;
+
+			adapter.firstIp4 = ip4Networks.size();
+			adapter.firstIp6 = ip6Prefixes.size();
+			adapter.firstGateway = gateways.size();
+
+			for (PIP_ADAPTER_UNICAST_ADDRESS unicast = curr->FirstUnicastAddress; unicast != NULL; unicast = unicast->Next) {
+				LPSOCKADDR address = unicast->Address.lpSockaddr;
+
+				if (address->sa_family == AF_INET) {
+					uint32_t value = ntohl(((PSOCKADDR_IN)address)->sin_addr.s_addr);
+					if (value != 0) {
+						ip4Networks.push_back(Ip4Network::fromPrefix(value, unicast->OnLinkPrefixLength));
+					}
+				} else if (address->sa_family == AF_INET6) {
+					Ip6Prefix prefix;
+					prefix.address = ((PSOCKADDR_IN6)address)->sin6_addr;
+					prefix.prefixLength = unicast->OnLinkPrefixLength;
+					ip6Prefixes.push_back(prefix);
+				}
+			}
+
+			for (PIP_ADAPTER_GATEWAY_ADDRESS gateway = curr->FirstGatewayAddress; gateway != NULL; gateway = gateway->Next) {
+				LPSOCKADDR address = gateway->Address.lpSockaddr;
+
+				SOCKADDR_INET value;
+				ZeroMemory(&value, sizeof(value));
+
+				if (address->sa_family == AF_INET) {
+					value.Ipv4 = *(PSOCKADDR_IN)address;
+					gateways.push_back(value);
+				} else if (address->sa_family == AF_INET6) {
+					value.Ipv6 = *(PSOCKADDR_IN6)address;
+					gateways.push_back(value);
+				}
+			}
+
+			adapter.ip4Count = ip4Networks.size() - adapter.firstIp4;
+			adapter.ip6Count = ip6Prefixes.size() - adapter.firstIp6;
+			adapter.gatewayCount = gateways.size() - adapter.firstGateway;
+
+			adapters.push_back(adapter);
+
+			// Hash only the things we record, not the positions or the name pointer
+			fnvAdd(newHash, &adapter.luid, sizeof(adapter.luid));
+			fnvAdd(newHash, &adapter.type, sizeof(adapter.type));
+			fnvAdd(newHash, &adapter.operStatus, sizeof(adapter.operStatus));
+			fnvAdd(newHash, &adapter.ip4Count, sizeof(adapter.ip4Count));
+			fnvAdd(newHash, &adapter.ip6Count, sizeof(adapter.ip6Count));
+			fnvAdd(newHash, &adapter.gatewayCount, sizeof(adapter.gatewayCount));
+		}
+	}
+
+	// The lists are plain values, so they can be hashed in one go
+	if (!ip4Networks.empty()) {
+		fnvAdd(newHash, ip4Networks.data(), ip4Networks.size() * sizeof(Ip4Network));
+	}
+	for (const Ip6Prefix& prefix : ip6Prefixes) {
+		// Field by field, since the struct has padding
+		fnvAdd(newHash, &prefix.address, sizeof(prefix.address));
+		fnvAdd(newHash, &prefix.prefixLength, sizeof(prefix.prefixLength));
+	}
+	if (!gateways.empty()) {
+		fnvAdd(newHash, gateways.data(), gateways.size() * sizeof(SOCKADDR_INET));
+	}
+
+	hash = newHash;
+	return true;
+}
+
+bool AdapterSnapshot::hasIp4Gateway(const Adapter& adapter) const
+{
+	for (size_t i = 0; i < adapter.gatewayCount; i++) {
+		const SOCKADDR_INET& gateway = getGateway(adapter, i);
+		if ((gateway.si_family == AF_INET) && (gateway.Ipv4.sin_addr.s_addr != 0)) {
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,78 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include "Ip4Network.h"
+
+/*
+ * Binary picture of the network adapters, built from GetAdaptersAddresses.
+ *
+ * The raw buffer and the address lists are kept between loads and only grow,
+ * so a steady-state reload doesn't allocate.  Each load also computes a hash
+ * over everything we record, so the caller can tell at a glance whether
+ * anything it cares about actually changed.
+ */
+class AdapterSnapshot
+{
+public:
+	struct Ip6Prefix {
+		IN6_ADDR address;
+		UINT8 prefixLength;
+	};
+
+	struct Adapter {
+		NET_LUID luid;
+		IFTYPE type;
+		IF_OPER_STATUS operStatus;
+
+		// Ranges in the shared lists below
+		size_t firstIp4;
+		size_t ip4Count;
+		size_t firstIp6;
+		size_t ip6Count;
+		size_t firstGateway;
+		size_t gatewayCount;
+
+		// Not kept past the next load - only for logging
+		PCHAR name;
+	};
+
+	AdapterSnapshot();
+	virtual ~AdapterSnapshot();
+
+	// Re-read the adapters.  On failure the previous contents are left alone.
+	bool load();
+
+	uint64_t getHash() const { return hash; }
+
+	const vector<Adapter>& getAdapters() const { return adapters; }
+
+	const Ip4Network& getIp4(const Adapter& adapter, size_t i) const {
+		return ip4Networks[adapter.firstIp4 + i];
+	}
+	const Ip6Prefix& getIp6(const Adapter& adapter, size_t i) const {
+		return ip6Prefixes[adapter.firstIp6 + i];
+	}
+	const SOCKADDR_INET& getGateway(const Adapter& adapter, size_t i) const {
+		return gateways[adapter.firstGateway + i];
+	}
+
+	// True if the adapter has a non-zero IPv4 default gateway
+	bool hasIp4Gateway(const Adapter& adapter) const;
+
+private:
+	BYTE *buffer;
+	ULONG bufferSize;
+
+	uint64_t hash;
+
+	vector<Adapter> adapters;
+	vector<Ip4Network> ip4Networks;
+	vector<Ip6Prefix> ip6Prefixes;
+	vector<SOCKADDR_INET> gateways;
+};
@@ -0,0 +1,76 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "Cancellation.h"
+
+Cancellation::Cancellation(DWORD timeoutMs)
+{
+	cancelled = false;
+	deadline = GetTickCount64() + timeoutMs;
+	cancelEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	// The deadline has to be enforced from outside the thread doing the work,
+	// since that thread is the one stuck in a blocking call.
+	timer = CreateThreadpoolTimer(timerCallback, this, NULL);
+	if (timer == NULL) {
+		Log::log(LOG_ERROR, _T("Unable to create deadline timer: {w32err}"));
+	} else {
+		// Negative means relative, in 100ns units
+		ULARGE_INTEGER due;
+		due.QuadPart = (ULONGLONG)(-((LONGLONG)timeoutMs * 10000));
+
+		FILETIME dueTime;
+		dueTime.dwLowDateTime = due.LowPart;
+		dueTime.dwHighDateTime = due.HighPart;
+
+		SetThreadpoolTimer(timer, &dueTime, 0, 0);
+	}
+}
+
+Cancellation::~Cancellation()
+{
+	if (timer != NULL) {
+		SetThreadpoolTimer(timer, NULL, 0, 0);
+		WaitForThreadpoolTimerCallbacks(timer, TRUE);
+		CloseThreadpoolTimer(timer);
+	}
+
+	CloseHandle(cancelEvent);
+}
+
+VOID CALLBACK Cancellation::timerCallback(PTP_CALLBACK_INSTANCE, PVOID context, PTP_TIMER)
+{
+	((Cancellation *)context)->cancel();
+}
+
+void Cancellation::cancel()
+{
+	unique_lock<mutex> permit(lock);
+	if (!cancelled) {
+		cancelled = true;
+		SetEvent(cancelEvent);
+	}
+}
+
+bool Cancellation::isCancelled()
+{
+	unique_lock<mutex> permit(lock);
+	return cancelled || (GetTickCount64() >= deadline);
+}
+
+DWORD Cancellation::getRemaining()
+{
+	unique_lock<mutex> permit(lock);
+
+	ULONGLONG now = GetTickCount64();
+	if (cancelled || (now >= deadline)) {
+		return 0;
+	}
+	return (DWORD)(deadline - now);
+}
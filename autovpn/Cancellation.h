@@ -0,0 +1,41 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+/*
+ * Cancellation token with a deadline, handed to anything that might block for
+ * a while.  Cancelling only sets the flag and the event - whatever is doing
+ * the work waits on the event alongside its own I/O and cleans up itself, so
+ * nothing is ever closed out from under the thread that owns it.
+ */
+class Cancellation
+{
+public:
+	Cancellation(DWORD timeoutMs);
+	virtual ~Cancellation();
+
+	void cancel();
+
+	// True if cancel() was called or the deadline passed
+	bool isCancelled();
+
+	// Time left before the deadline, or 0 if cancelled
+	DWORD getRemaining();
+
+	// Signaled when cancelled, for waiting alongside other handles
+	HANDLE getEvent() { return cancelEvent; }
+
+private:
+	mutex lock;
+	bool cancelled;
+	ULONGLONG deadline;
+	HANDLE cancelEvent;
+
+	PTP_TIMER timer;
+	static VOID CALLBACK timerCallback(PTP_CALLBACK_INSTANCE, PVOID context, PTP_TIMER);
+};
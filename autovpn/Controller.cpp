@@ -8,14 +8,39 @@
 #include "pch.h"
 #include "Controller.h"
 #include "Log.h"
-#include "Settings.h"
+#include "SettingsSnapshot.h"
+#include "SettingsMonitor.h"
 #include "Ip4Network.h"
 #include "SessionManager.h"
+#include "StatusPageWriter.h"
 #include "Log.h"
 #include "Diagnostics.h"
 #include "DiagnosticsV1.h"
-
+#include "DiagnosticsV2.h"
+#include "NetworkChangeSource.h"
+#include "EnableLookup.h"
+#include "VpnServiceController.h"
+#include "WifiMonitor.h"
+#include "AdapterSnapshot.h"
+#include "DiagnosticsWorker.h"
+#include "ProbeCache.h"
+#include "ProbeStats.h"
+#include "VerifyUrl.h"
+#include "Fnv.h"
+
+// While we want the VPN up and it isn't yet, keep polling at the short interval
+// since the service only tells us it's running, not whether the tunnel is up.  Otherwise network changes
+// wake us up directly, and the long timer is just a safety net.
 #define CYCLE_SECONDS 5
+#define IDLE_CYCLE_SECONDS 60
+
+// Changes come in bursts - an interface comes up, gets an address, then routes
+// get added.  Give things a moment to settle so we cycle once instead of once
+// per notification.
+#define SETTLE_MILLISECONDS 500
+
+// State changes kept for queries
+#define HISTORY_LIMIT 32
 
 // DEBUG_MEMORY makes the process shut down after a finite number
 // of main loop cycles - that way there's a normal shutdown and the normal
@@ -32,13 +57,63 @@
 Controller::Controller()
 {
 	ZeroMemory(&status, sizeof(status));
+	statusGeneration = 0;
+	statusListeners = make_shared<const vector<StatusListener*>>();
+
+	transitionCount = 0;
+	startTick = GetTickCount64();
+	cycleCount = 0;
+
+	shared_ptr<ServiceSnapshot> initial = make_shared<ServiceSnapshot>();
+	ZeroMemory(&initial->status, sizeof(initial->status));
+	initial->generation = 0;
+	initial->changedTick = startTick;
+	initial->transitions = 0;
+	snapshot = initial;
 	run = true;
-	diagnostics = new DiagnosticsV1();
+	cycleRequested = false;
+	cycleUrgent = false;
+	vpnPending = false;
+	diagnosticsForced = false;
+	probeCache = new ProbeCache();
+	probeStats = new ProbeStats();
+	verifier = new VerifyUrl();
+	diagnosticsV1 = new DiagnosticsV1(probeCache, probeStats, verifier);
+	diagnosticsV2 = new DiagnosticsV2(probeCache, probeStats, verifier);
+	diagnosticsWorker = new DiagnosticsWorker(this, diagnosticsV1, diagnosticsV2);
+	networkChanges = new NetworkChangeSource(this);
+	settingsMonitor = new SettingsMonitor(this);
+	enableLookup = new EnableLookup(this);
+	vpnService = new VpnServiceController(this);
+	wifiMonitor = new WifiMonitor(this);
+	adapterSnapshot = new AdapterSnapshot();
+
+	foundEthernet = false;
+	foundWifi = false;
+	foundVpn = false;
+	attachedValid = false;
+	attachedHash = 0;
+
+	internalMatchValid = false;
+	internalMatchHash = 0;
+	internalMatchGeneration = 0;
+	internalMatch = false;
 }
 
 Controller::~Controller()
 {
-	delete diagnostics;
+	delete adapterSnapshot;
+	delete wifiMonitor;
+	delete vpnService;
+	delete enableLookup;
+	delete settingsMonitor;
+	delete networkChanges;
+	delete diagnosticsWorker;
+	delete diagnosticsV2;
+	delete diagnosticsV1;
+	delete probeCache;
+	delete probeStats;
+	delete verifier;
 }
 
 void Controller::main()
@@ -46,6 +121,20 @@ void Controller::main()
 	SessionManager* sessionManager = new SessionManager(this);
 	sessionManager->start();
 
+	StatusPageWriter* statusPage = new StatusPageWriter(this);
+	statusPage->start();
+
+	settingsMonitor->start();
+	enableLookup->start();
+	vpnService->start(settingsMonitor->get()->getVpnServiceName());
+	wifiMonitor->start();
+	diagnosticsWorker->start();
+
+	if (!networkChanges->start()) {
+		Log::log(LOG_WARNING,
+			_T("Network change notification not available, relying on timer"));
+	}
+
 #ifdef DEBUG_MEMORY
 	bool localRun = true;
 	for (int cycleCnt= 0; localRun && (cycleCnt < 10); cycleCnt++) {
@@ -53,17 +142,41 @@ void Controller::main()
 	for (bool localRun = true; localRun; ) {
 #endif
 		cycle();
+		statusPage->refreshCounters();
 
 		{
 			unique_lock<mutex> permit(lock);
 			localRun = run;
 			if (localRun) {
-				wake.wait_for(permit, chrono::seconds(CYCLE_SECONDS));
+				int waitSeconds = vpnPending ? CYCLE_SECONDS : IDLE_CYCLE_SECONDS;
+
+				if (!cycleRequested) {
+					wake.wait_for(permit, chrono::seconds(waitSeconds),
+						[this] { return !run || cycleRequested; });
+				}
+
+				if (run && cycleRequested && !cycleUrgent) {
+					wake.wait_for(permit, chrono::milliseconds(SETTLE_MILLISECONDS),
+						[this] { return !run; });
+				}
+
+				cycleRequested = false;
+				cycleUrgent = false;
 				localRun = run;
 			}
 		}
 	}
 
+	networkChanges->stop();
+	settingsMonitor->stop();
+	enableLookup->stop();
+	diagnosticsWorker->stop();
+	vpnService->stop();
+	wifiMonitor->stop();
+
+	statusPage->stop();
+	delete statusPage;
+
 	sessionManager->stop();
 	delete sessionManager;
 }
@@ -75,121 +188,79 @@ void Controller::stop()
 	wake.notify_all();
 }
 
-bool Controller::checkEnabled(Settings& settings)
+void Controller::requestCycle()
 {
-	bool enabled = true;
+	unique_lock<mutex> permit(lock);
+	cycleRequested = true;
+	wake.notify_all();
+}
 
-	CString enableHostname;
-	settings.readString(_T("EnableHostname"), enableHostname);
+void Controller::recheckNow()
+{
+	unique_lock<mutex> permit(lock);
+	cycleRequested = true;
+	cycleUrgent = true;
+	wake.notify_all();
+}
 
-	if (!enableHostname.IsEmpty()) {
-		ADDRINFOEXW hints;
-
-		// Winsock is picky about several members being 0 or null, this isn't
-		// just cargo cult - it's in the docs
-		ZeroMemory(&hints, sizeof(ADDRINFOEXW));
-
-		// Only resolve if we have an actual address - this should save pointless
-		// queries if we're not on the network.
-		hints.ai_flags = AI_ADDRCONFIG;
-
-		// Our flags are A (IPv4) records, so that's all we care about
-		hints.ai_family = AF_INET;
-
-		// This doesn't really matter, but a VPN is more likely than not to be UDP
-		hints.ai_socktype = SOCK_DGRAM;
-		hints.ai_protocol = IPPROTO_UDP;
-
-		PADDRINFOEXW results= NULL;
-
-		INT status = GetAddrInfoEx(enableHostname,
-			NULL, NS_DNS, NULL, &hints, &results, NULL, NULL, NULL, NULL);
-
-		// I can't find it actually stated in the docs that if you get NO_RESULT the
-		// result has to be filled in.  I don't know why it wouldn't though.
-		if ((status == NO_ERROR) && (results != NULL)) {
-			if (results->ai_addrlen > 0) {
-				// Every version of sockaddr has family in the first member, so this
-				// is safe as long as we check the family first
-				struct sockaddr_in* found4 =
-					reinterpret_cast<struct sockaddr_in*>
-					(&results->ai_addr[0]);
-
-				// We only asked for IPV4, but be defensive
-				if (found4->sin_family == AF_INET) {
-					unsigned long rawIp = ntohl(found4->sin_addr.S_un.S_addr);
-
-					// Use 127.0.0.2 to mean enabled and 127.0.0.3 to mean disabled.
-					//
-					// 1) I wanted to use A records because it's the most widely-implemented
-					//    type - most web providers these days implement TXT at least, but
-					//    A records are a lowest common denominator.
-					//
-					// 2) We can't use existence or non-existence because some ISPs
-					//    (as well as OpenDNS) will return a server of theirs instead
-					//    of NXDOMAIN.  So we have to use something that can't normally
-					//    occur on the open internet.
-					//
-					// 3) It used to be common practice to put localhost in zone files, or
-					//    I used to see it done.  So I'm avoiding 127.0.0.1.
-					//
-					// 4) AFAIK the alternate loopback addresses aren't in common use.  I
-					//    think I've seen them used for proxies with some ASA web portal
-					//    stuff, but I can't think of anywhere else.
-					//
-					// 5) There's precident in how some DNSRBLs are implemented.
-					//
-					if (rawIp == 0x7F000002) {
-						enabled = true;
-					} else if (rawIp == 0x7F000003) {
-						enabled = false;
-					} else {
-						// This is DEBUG because we don't want to spam the log if we're
-						// behind something that won't return NXDOMAIN
+void Controller::runDiagnosticsNow()
+{
+	unique_lock<mutex> permit(lock);
+	diagnosticsForced = true;
+	cycleRequested = true;
+	cycleUrgent = true;
+	wake.notify_all();
+}
 
-						Log::log(LOG_DEBUG,
-							_T("Enable hostname value 0x08X not understood"),
-							rawIp);
-					}
-				}
-			}
+void Controller::getProbeStats(list<AutoVPNProbeStats>& stats)
+{
+	probeStats->getStats(stats);
+}
 
-			FreeAddrInfoEx(results);
-			results = NULL;
-		} else {
-			if (status != WSAHOST_NOT_FOUND) {
-				Log::log(LOG_WARNING,
-					_T("Unable to query for disabled hostname: %d"), status);
-			}
-		}
-	}
+void Controller::networkChanged()
+{
+	// With split DNS the enable answer can depend on where we are
+	enableLookup->invalidate();
 
-	return enabled;
+	// Anything diagnostics found out was about the network we were on
+	diagnosticsWorker->invalidate();
+	probeCache->clear();
+	verifier->reset();
+
+	requestCycle();
 }
 
-void Controller::cycle()
+bool Controller::checkEnabled(const SettingsSnapshot& settings)
 {
-	// I realize that this pulls the settings from the registry every cycle which isn't
-	// the most optimized thing in the world.  This is intentional so that if the registry
-	// is changed via GPO updates we pick it up right away.
+	bool enabled = true;
 
-	CString vpnServiceName(_T("OpenVPNService"));
+	// This only waits on DNS until the first answer for a hostname - after
+	// that we get whatever the last answer was, and the lookup wakes us up if
+	// a fresh answer changes anything.
+	const CString& enableHostname = settings.getEnableHostname();
+	if (!enableHostname.IsEmpty()) {
+		enabled = enableLookup->isEnabled(enableHostname, settings.getEnableHostnameTimeout());
+	}
 
-	int signalWarningLimit = 50;
-	int rxRateWarningLimit = 10000;
-	int txRateWarningLimit = 10000;
+	return enabled;
+}
 
-	Settings settings;
-	settings.readString(_T("VPNServiceName"), vpnServiceName);
+void Controller::cycle()
+{
+	// The monitor swaps in a new snapshot when GPO updates change the registry, so
+	// we pick changes up right away without reading the registry every cycle.  We
+	// hold onto this one for the whole cycle so it stays consistent.
+	shared_ptr<const SettingsSnapshot> settings = settingsMonitor->get();
 
-	settings.readInt(_T("WifiSignalWarningLimit"), signalWarningLimit);
-	settings.readInt(_T("WifiRxRateWarningLimit"), rxRateWarningLimit);
-	settings.readInt(_T("WifiTxRateWarningLimit"), txRateWarningLimit);
+	cycleCount++;
 
 	AutoVPNStatus oldStatus;
+	bool forceDiagnostics;
 	{
 		unique_lock<mutex> permit(lock);
 		oldStatus = status;
+		forceDiagnostics = diagnosticsForced;
+		diagnosticsForced = false;
 	}
 
 	AutoVPNStatus newStatus;
@@ -197,13 +268,9 @@ void Controller::cycle()
 
 	newStatus.state = AVS_DISCONNECTED;
 
-	list<shared_ptr<Ip4Network>> attachedList;
-	bool foundEthernet = false;
-	bool foundWifi = false;
-	bool foundVpn = false;
-	loadAttachedNetworks(attachedList, foundEthernet, foundWifi, foundVpn);
+	loadAttachedNetworks();
 
-	bool onAnyNetwork = !attachedList.empty();
+	bool onAnyNetwork = !attachedNetworks.empty();
 
 	bool vpnShouldBeRunning = false;
 	CString suggestion;
@@ -211,24 +278,33 @@ void Controller::cycle()
 	if (onAnyNetwork) {
 		newStatus.state = AVS_NETWORK;
 
-		list<shared_ptr<Ip4Network>> internalList;
-		loadInternalNetworks(settings, internalList);
-		bool onInternalNetwork = false;
+		// The answer only changes if the adapters or the settings do
+		if (!internalMatchValid ||
+			(internalMatchHash != attachedHash) ||
+			(internalMatchGeneration != settings->getGeneration())) {
+			internalMatch = false;
 
-		for (shared_ptr<Ip4Network> internal: internalList) {
-			for (shared_ptr<Ip4Network> attached : attachedList) {
-				if (internal->includes(attached.get())) {
-					onInternalNetwork = true;
+			const NetworkTrie& internalNetworks = settings->getInternalNetworks();
+			for (const Ip4Network& attached : attachedNetworks) {
+				if (internalNetworks.includes(attached)) {
+					internalMatch = true;
+					break;
 				}
 			}
+
+			internalMatchHash = attachedHash;
+			internalMatchGeneration = settings->getGeneration();
+			internalMatchValid = true;
 		}
 
+		bool onInternalNetwork = internalMatch;
+
 		if (!onInternalNetwork) {
 			// For now we assume we have internet connectivity.  Later on if the VPN isn't
 			// connected we run an HTTP check to make sure we can actually get to the -
 			// that way the user indication will make more sense.
 
-			if (!checkEnabled(settings)) {
+			if (!checkEnabled(*settings)) {
 				newStatus.state = AVS_VPN_DISABLED;
 			} else {
 				newStatus.state = AVS_INTERNET;
@@ -248,16 +324,16 @@ void Controller::cycle()
 			// to Wifi, and to look at the RX/TX speeds to warn on that.  The idea is we don't
 			// want people calling help lines about slowness when they have a 2Mb uplink
 			// because they're by the pool 300 feet from the hub.
-			getWifiInfo(newStatus);
+			wifiMonitor->getWifiInfo(newStatus);
 
 			if (newStatus.ssid[0] != '\0') {
-				if (newStatus.signalQuality < signalWarningLimit) {
+				if (newStatus.signalQuality < settings->getSignalWarningLimit()) {
 					newStatus.wifiProblem = 1;
 					suggestion = _T("WIFI_SIGNAL_LOW");
-				} else if (newStatus.rxRate < (unsigned long)rxRateWarningLimit) {
+				} else if (newStatus.rxRate < (unsigned long)settings->getRxRateWarningLimit()) {
 					newStatus.wifiProblem = 1;
 					suggestion = _T("WIFI_RATE_LOW");
-				} else if (newStatus.txRate < (unsigned long)txRateWarningLimit) {
+				} else if (newStatus.txRate < (unsigned long)settings->getTxRateWarningLimit()) {
 					newStatus.wifiProblem = 1;
 					suggestion = _T("WIFI_RATE_LOW");
 				}
@@ -267,61 +343,51 @@ void Controller::cycle()
 
 	bool vpnIsRunning = false;
 
-	SC_HANDLE serviceManager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT);
-	if (serviceManager == NULL) {
-		Log::log(LOG_ERROR, _T("can't open service control manager: {w32err}"));
-	} else {
-		SC_HANDLE vpnService = OpenService(serviceManager,
-			vpnServiceName, SERVICE_QUERY_STATUS | SERVICE_START | SERVICE_STOP);
+	vpnService->setServiceName(settings->getVpnServiceName());
 
-		if (vpnService == NULL) {
-			Log::log(LOG_ERROR, _T("Unable to open VPN service: {w32err}"));
-		} else {
-			SERVICE_STATUS vpnStatus;
-			ZeroMemory(&vpnStatus, sizeof(SERVICE_STATUS));
-			if (!QueryServiceStatus(vpnService, &vpnStatus)) {
-				Log::log(LOG_ERROR,
-					_T("Unable to query status of VPN service: {w32err}"));
+	DWORD vpnState = 0;
+	if (vpnService->getState(vpnState)) {
+		switch (vpnState) {
+		case SERVICE_RUNNING:
+			if (!vpnShouldBeRunning) {
+				Log::log(LOG_INFO, _T("Stopping VPN Service"));
+				if (!vpnService->stopService()) {
+					vpnIsRunning = true;
+				}
 			} else {
-				switch (vpnStatus.dwCurrentState) {
-				case SERVICE_RUNNING:
-					if (!vpnShouldBeRunning) {
-						Log::log(LOG_INFO, _T("Stopping VPN Service"));
-						if (!ControlService(vpnService, SERVICE_CONTROL_STOP, &vpnStatus)) {
-							Log::log(LOG_ERROR,
-								_T("Unable to stop VPN service: {w32err}"));
-
-							vpnIsRunning = true;
-						}
-					} else {
-						vpnIsRunning = true;
-					}
-					break;
-
-				case SERVICE_STOPPED:
-					if (vpnShouldBeRunning) {
-						Log::log(LOG_INFO, _T("Starting VPN Service"));
-						if (!StartService(vpnService, 0, NULL)) {
-							Log::log(LOG_ERROR,
-								_T("Failed to start VPN service: {w32err}"));
-						} else {
-							vpnIsRunning = true;
-						}
-					}
-					break;
+				vpnIsRunning = true;
+			}
+			break;
 
-				default:
-					Log::log(LOG_WARNING,
-						_T("Unexpected VPN status 0x%08X"), vpnStatus.dwCurrentState);
+		case SERVICE_STOPPED:
+			if (vpnShouldBeRunning) {
+				Log::log(LOG_INFO, _T("Starting VPN Service"));
+				if (vpnService->startService()) {
+					vpnIsRunning = true;
 				}
 			}
-
-			CloseServiceHandle(vpnService);
+			break;
+
+		case SERVICE_START_PENDING:
+			// Already on the way up.  A service can't be stopped until it's done
+			// starting, so if we don't want it we'll stop it once it gets to
+			// RUNNING - the notification will wake us up.
+			vpnIsRunning = true;
+			break;
+
+		case SERVICE_STOP_PENDING:
+			// On the way down.  If we want it back we'll start it once it gets
+			// to STOPPED.
+			break;
+
+		default:
+			Log::log(LOG_WARNING,
+				_T("Unexpected VPN status 0x%08X"), vpnState);
 		}
-
-		CloseServiceHandle(serviceManager);
 	}
 
+	vpnPending = vpnShouldBeRunning && !foundVpn;
+
 	if (vpnShouldBeRunning) {
 		if (vpnIsRunning) {
 			if (foundVpn) {
@@ -332,16 +398,38 @@ void Controller::cycle()
 		}
 	}
 
+	// The checks can take a long time on a bad network, so they run in the
+	// background.  We use whatever the last finished run found, and the
+	// worker wakes us up when a new one finishes.
+	//
+	// The fingerprint covers adapters, addresses and gateways through the
+	// snapshot hash, plus the SSID so two hotspots with the same addressing
+	// don't share results.
+	uint64_t fingerprint = FNV_OFFSET_BASIS;
+	fnvAdd(fingerprint, &attachedHash, sizeof(attachedHash));
+	fnvAdd(fingerprint, newStatus.ssid, strnlen(newStatus.ssid, sizeof(newStatus.ssid)));
+
+	if ((newStatus.state == AVS_VPN_ENABLED) || (forceDiagnostics && onAnyNetwork)) {
+		// A run the user asked for happens whatever the state, but the result
+		// only gets used below if the VPN is stuck.
+		diagnosticsWorker->request(Diagnostics::CallReason::VPN_NOT_CONNECTING, settings,
+			fingerprint, forceDiagnostics);
+	}
+
 	if (newStatus.state == AVS_VPN_ENABLED) {
-		diagnostics->diagnose(
-			DiagnosticsV1::CallReason::VPN_NOT_CONNECTING,
-			newStatus, suggestion);
+		DiagnosticsWorker::Result result;
+		if (diagnosticsWorker->getResult(result) &&
+			(result.settingsGeneration == settings->getGeneration()) &&
+			(result.networkFingerprint == fingerprint)) {
+			newStatus.state = result.state;
+			if (!result.suggestion.IsEmpty()) {
+				suggestion = result.suggestion;
+			}
+		}
 	}
 
 	if (!suggestion.IsEmpty()) {
-		Settings suggestions = settings.getSubKey(_T("Suggestions"));
-
-		if (suggestions.readString(suggestion, suggestion)) {
+		if (settings->lookupSuggestion(suggestion, suggestion)) {
 			// Handle any insertion variables
 			if (status.ssid[0] != '\0') {
 				CA2T wideSsid(status.ssid);
@@ -357,245 +445,213 @@ void Controller::cycle()
 		}
 	}
 
-	unique_lock<mutex> permit(lock);
-	status = newStatus;
+	// Held from before the list is copied until the last listener returns, so
+	// once unregistering has its turn at this lock no broadcast can still be
+	// holding the old list.  Nobody waiting on the controller lock has to wait
+	// on the sessions, since that one is only held long enough to copy.
+	unique_lock<mutex> broadcastPermit(broadcastLock);
+
+	shared_ptr<const vector<StatusListener*>> listeners;
+	unsigned long generation;
+	short previousState;
+	{
+		unique_lock<mutex> permit(lock);
+
+		// Most cycles find nothing new, and there's no point waking up every
+		// session to repaint the same thing.  An empty suggestion still counts as
+		// a change, because otherwise the UI keeps showing the last problem.
+		bool changed = !sameStatus(status, newStatus) || (publishedSuggestion.Compare(suggestion) != 0);
+
+		previousState = status.state;
+		status = newStatus;
 
-	for (StatusListener* listener : statusListeners) {
-		listener->onStatusChanged(&newStatus);
+		if (!changed) {
+			return;
+		}
 
-		// We have to send the "empty suggestion" if that's the case, because otherwise
-		// the UI will keep indicating the same problem forever.  The SessionConnection
-		// will take care of not sending the same thing over and over.
-		listener->onSuggestion(suggestion);
+		publishedSuggestion = suggestion;
+		generation = ++statusGeneration;
+		listeners = statusListeners;
+	}
+
+	// Only this thread touches the history, so it's built outside the lock
+	ULONGLONG now = GetTickCount64();
+	if (newStatus.state != previousState) {
+		ServiceSnapshot::Transition transition;
+		transition.tick = now;
+		transition.from = previousState;
+		transition.to = newStatus.state;
+
+		history.push_back(transition);
+		while (history.size() > HISTORY_LIMIT) {
+			history.pop_front();
+		}
+		transitionCount++;
+	}
+
+	shared_ptr<ServiceSnapshot> updated = make_shared<ServiceSnapshot>();
+	updated->status = newStatus;
+	updated->suggestion = suggestion;
+	updated->generation = generation;
+	updated->changedTick = now;
+	updated->history.assign(history.begin(), history.end());
+	updated->transitions = transitionCount;
+	atomic_store(&snapshot, shared_ptr<const ServiceSnapshot>(updated));
+
+	for (StatusListener* listener : *listeners) {
+		listener->onStatusChanged(&newStatus, suggestion, generation);
 	}
 }
 
 void Controller::registerStatusListener(StatusListener* listener)
 {
 	AutoVPNStatus localStatus;
+	CString localSuggestion;
+	unsigned long localGeneration;
 
 	{
 		unique_lock<mutex> permit(lock);
-		statusListeners.push_back(listener);
+
+		shared_ptr<vector<StatusListener*>> listeners =
+			make_shared<vector<StatusListener*>>(*statusListeners);
+		listeners->push_back(listener);
+		statusListeners = listeners;
+
 		localStatus = status;
+		localSuggestion = publishedSuggestion;
+		localGeneration = statusGeneration;
 	}
 
-	listener->onStatusChanged(&localStatus);
+	listener->onStatusChanged(&localStatus, localSuggestion, localGeneration);
 }
 
 void Controller::unregisterStatusListener(StatusListener* listener)
 {
-	unique_lock<mutex> permit(lock);
-	statusListeners.remove(listener);
-}
+	{
+		unique_lock<mutex> permit(lock);
 
-#define MAX_NETWORK_KEY_NAME 31
-#define MAX_NETWORK_KEY_VALUE 127
+		shared_ptr<vector<StatusListener*>> listeners =
+			make_shared<vector<StatusListener*>>(*statusListeners);
+		listeners->erase(remove(listeners->begin(), listeners->end(), listener), listeners->end());
+		statusListeners = listeners;
+	}
 
-void Controller::loadInternalNetworks(Settings &settings, list<shared_ptr<Ip4Network>>& trustedNetworks)
-{
-	for (int pass= 0; pass < 2; pass++) {
-		HKEY root = (pass > 0) ? settings.getPreferenceRoot() : settings.getPolicyRoot();
-		if (root != NULL) {
-			HKEY internalKey;
-			DWORD regStatus = RegOpenKeyEx(root,
-				_T("InternalNetworks"), 0, KEY_QUERY_VALUE, &internalKey);
-
-			if (regStatus == ERROR_SUCCESS) {
-				DWORD index = 0;
-				while (true) {
-					TCHAR name[MAX_NETWORK_KEY_NAME + 1];
-					DWORD nameLen = MAX_NETWORK_KEY_NAME;
-					TCHAR value[MAX_NETWORK_KEY_VALUE + 1];
-					DWORD valueLen = MAX_NETWORK_KEY_VALUE * sizeof(TCHAR);
-
-					DWORD regType = 0;
-
-					regStatus = RegEnumValue(internalKey, index,
-						name, &nameLen, NULL, &regType, (LPBYTE)value, &valueLen);
-
-					if (regStatus == ERROR_NO_MORE_ITEMS) {
-						break;
-					} else if (regStatus == ERROR_SUCCESS) {
-						value[valueLen / sizeof(TCHAR)] = '\0';
-
-						CString splitBuf(value);
-
-						LPCTSTR tokens = _T(" ,;");
-
-						int tokenPos = 0;
-						CString token = splitBuf.Tokenize(tokens, tokenPos);
-						while (!token.IsEmpty()) {
-							shared_ptr<Ip4Network> network = Ip4Network::Create(token);
-							if (network) {
-								trustedNetworks.push_back(network);
-							}
-							else {
-								Log::log(LOG_DEBUG,
-									_T("Unable to understand network %s"), (LPCTSTR)token);
-							}
-
-							token = splitBuf.Tokenize(tokens, tokenPos);
-						}
-
-						index++;
-					} else {
-						Log::log(LOG_ERROR,
-							_T("Error enumeriting trusted networks: 0x%08X"),
-							regStatus);
-						break;
-					}
-				}
+	// A broadcast that picked up the old list could still be calling this
+	// listener, and the caller is about to reuse or delete it.  Any broadcast
+	// that starts after this copies the new list.
+	unique_lock<mutex> permit(broadcastLock);
+}
 
-				RegCloseKey(internalKey);
-			} else if (regStatus != ERROR_FILE_NOT_FOUND) {
-				Log::log(LOG_ERROR,
-					_T("Error opening internal network registry key: 0x%08X"),
-					regStatus);
-			}
-		}
-	}
+shared_ptr<const ServiceSnapshot> Controller::getSnapshot()
+{
+	return atomic_load(&snapshot);
 }
 
-void Controller::loadAttachedNetworks(list<shared_ptr<Ip4Network>>& attachedList, bool &foundEthernet, bool &foundWifi, bool &foundVpn)
+shared_ptr<const DiagnosticsRun> Controller::getLastDiagnostics()
 {
-	foundEthernet = false;
-	foundWifi = false;
-	foundVpn = false;
+	return diagnosticsWorker->getLastRun();
+}
 
-	DWORD bufferSize = sizeof(IP_ADAPTER_INFO);
-	PIP_ADAPTER_INFO buffer = (PIP_ADAPTER_INFO)new BYTE[bufferSize];
+void Controller::getCounters(ServiceCounters& counters)
+{
+	counters.uptimeSeconds = (GetTickCount64() - startTick) / 1000;
+	counters.cycles = cycleCount;
+	counters.diagnosticRuns = diagnosticsWorker->getRunCount();
+	counters.diagnosticTimeouts = diagnosticsWorker->getTimeoutCount();
+
+	EnableLookup::Counters lookups = enableLookup->getCounters();
+	counters.enableLookups = lookups.lookups;
+	counters.enableFailures = lookups.failures;
+	counters.enableTimeouts = lookups.timeouts;
+	counters.enableLastLatency = lookups.lastLatency;
+	counters.enableMaxLatency = lookups.maxLatency;
+	counters.enableAverageLatency = (lookups.lookups > 0) ?
+		(unsigned long)(lookups.totalLatency / lookups.lookups) : 0;
+}
 
-	DWORD infoRval = GetAdaptersInfo(buffer, &bufferSize);
-	if (infoRval == ERROR_BUFFER_OVERFLOW) {
-		// Re-rez buffer with enough space
-		delete[] buffer;
-		buffer = (PIP_ADAPTER_INFO)new BYTE[bufferSize];
+bool Controller::sameStatus(const AutoVPNStatus& a, const AutoVPNStatus& b)
+{
+	return (a.state == b.state) &&
+		(strncmp(a.ssid, b.ssid, sizeof(a.ssid)) == 0) &&
+		(a.wifiProblem == b.wifiProblem) &&
+		(a.signalQuality == b.signalQuality) &&
+		(a.rxRate == b.rxRate) &&
+		(a.txRate == b.txRate);
+}
 
-		infoRval = GetAdaptersInfo(buffer, &bufferSize);
+void Controller::loadAttachedNetworks()
+{
+	if (!adapterSnapshot->load()) {
+		attachedNetworks.clear();
+		foundEthernet = false;
+		foundWifi = false;
+		foundVpn = false;
+		attachedValid = false;
+		return;
 	}
 
-	if (infoRval == NO_ERROR) {
-		for (PIP_ADAPTER_INFO curr = buffer; curr != NULL; curr = curr->Next) {
-			bool foundGateway = false;  // This is just up here to avoid case initialization warnings
-
-			switch (curr->Type) {
-			case MIB_IF_TYPE_ETHERNET:
-			case IF_TYPE_IEEE80211:
-				// FIXME We might need to add WWAN cards here too, but I don't have any of those to double-check
-				// what they show up as in practice.  -DAW
+	// Nothing we look at changed, so neither did the answer
+	if (attachedValid && (adapterSnapshot->getHash() == attachedHash)) {
+		return;
+	}
 
-				for (PIP_ADDR_STRING ipEntry = &curr->GatewayList; ipEntry != NULL; ipEntry = ipEntry->Next) {
-					if (strcmp(ipEntry->IpAddress.String, "0.0.0.0") != 0) {
-						foundGateway = true;
-					}
-				}
+	attachedNetworks.clear();
+	foundEthernet = false;
+	foundWifi = false;
+	foundVpn = false;
 
-				// We don't want to bother looking at anything without a gateway.  Weird stuff that's
-				// networked but not really can show up as NICs, like connections to management cards
-				// and bluetooth.  We also don't want psuedo-interfaces like VMware Workstation or
-				// whatever the MS equivalent is.  Those should be filtered out by type but this makes
-				// double-sure.
-				if (foundGateway) {
-					for (PIP_ADDR_STRING ipEntry = &curr->IpAddressList; ipEntry != NULL; ipEntry = ipEntry->Next) {
-						if (strcmp(ipEntry->IpAddress.String, "0.0.0.0") != 0) {
-							shared_ptr<Ip4Network> network = Ip4Network::Create(ipEntry->IpAddress.String, ipEntry->IpMask.String);
-							if (network) {
-								attachedList.push_back(network);
-
-								if (curr->Type == MIB_IF_TYPE_ETHERNET) {
-									foundEthernet = true;
-								} else if (curr->Type == IF_TYPE_IEEE80211) {
-									foundWifi = true;
-								}
-							}
-						}
-					}
-				}
-				break;
+	for (const AdapterSnapshot::Adapter& curr : adapterSnapshot->getAdapters()) {
+		if (curr.operStatus != IfOperStatusUp) {
+			continue;
+		}
 
-			case IF_TYPE_PROP_VIRTUAL:
-				// Some adapters are always there, so check it has a valid IP4 address
-				for (PIP_ADDR_STRING ipEntry = &curr->IpAddressList; ipEntry != NULL; ipEntry = ipEntry->Next) {
-					if (strcmp(ipEntry->IpAddress.String, "0.0.0.0") != 0) {
-						foundVpn = true;
+		switch (curr.type) {
+		case IF_TYPE_ETHERNET_CSMACD:
+		case IF_TYPE_IEEE80211:
+			// FIXME We might need to add WWAN cards here too, but I don't have any of those to double-check
+			// what they show up as in practice.  -DAW
+
+			// We don't want to bother looking at anything without a gateway.  Weird stuff that's
+			// networked but not really can show up as NICs, like connections to management cards
+			// and bluetooth.  We also don't want psuedo-interfaces like VMware Workstation or
+			// whatever the MS equivalent is.  Those should be filtered out by type but this makes
+			// double-sure.
+			if (adapterSnapshot->hasIp4Gateway(curr)) {
+				for (size_t i = 0; i < curr.ip4Count; i++) {
+					attachedNetworks.push_back(adapterSnapshot->getIp4(curr, i));
+
+					if (curr.type == IF_TYPE_ETHERNET_CSMACD) {
+						foundEthernet = true;
+					} else {
+						foundWifi = true;
 					}
 				}
-				break;
-
-			default:
-				static set<int> reportedTypes;
-
-				// Log these so we can see what's showing up in real life.  Just log it one time though,
-				// so we don't spam the log with this.
-				if (reportedTypes.find(curr->Type) == reportedTypes.end()) {
-					reportedTypes.insert(curr->Type);
-
-					CString name(curr->AdapterName);
-					Log::log(LOG_WARNING,
-						_T("Ignoring type %d adapter: %s - look up in ipifcons.h"),
-						curr->Type, (LPCTSTR)name);
-				}
 			}
-		}
-	}
-
-	delete[] buffer;
-}
-
-void Controller::getWifiInfo(AutoVPNStatus &status)
-{
-	DWORD negotiatedVersion = 0;
-	HANDLE wifiHandle = INVALID_HANDLE_VALUE;
-
-	DWORD errorStatus = WlanOpenHandle(2, NULL, &negotiatedVersion, &wifiHandle);
-	if (errorStatus != ERROR_SUCCESS) {
-		Log::log(LOG_ERROR,
-			_T("Error from WlanOpenHandle: %08X"), errorStatus);
-	} else {
-		PWLAN_INTERFACE_INFO_LIST wifiList= NULL;
-
-		errorStatus = WlanEnumInterfaces(wifiHandle, NULL, &wifiList);
-		if (errorStatus != ERROR_SUCCESS) {
-			Log::log(LOG_ERROR,
-				_T("Error in WlanEnumInterfaces: %08X"), errorStatus);
-		} else {
-			for (DWORD i = 0; i < wifiList->dwNumberOfItems; i++) {
-				WLAN_INTERFACE_INFO* info = &wifiList->InterfaceInfo[i];
-
-				if (info->isState == wlan_interface_state_connected) {
-					PVOID data;
-					DWORD dataSize = 0;
+			break;
 
-					errorStatus = WlanQueryInterface(wifiHandle,
-						&info->InterfaceGuid, wlan_intf_opcode_current_connection,
-						NULL, &dataSize, &data, NULL);
-
-					if (errorStatus == ERROR_SUCCESS) {
-						WLAN_CONNECTION_ATTRIBUTES* attr = (WLAN_CONNECTION_ATTRIBUTES*)data;
-
-						size_t ssidLength = attr->wlanAssociationAttributes.dot11Ssid.uSSIDLength;
-						if (ssidLength > (sizeof(status.ssid) - 1)) {
-							ssidLength = sizeof(status.ssid) - 1;
-						}
-						strncpy_s(status.ssid,
-							(const char *)attr->wlanAssociationAttributes.dot11Ssid.ucSSID,
-							ssidLength);
-						status.ssid[ssidLength] = '\0';
+		case IF_TYPE_PROP_VIRTUAL:
+			// Some adapters are always there, so check it has a valid IP4 address
+			if (curr.ip4Count > 0) {
+				foundVpn = true;
+			}
+			break;
 
-						// This is a 0-100 thing - 0 = -100dbm, 100 = -50dbm
-						status.signalQuality = (short)attr->wlanAssociationAttributes.wlanSignalQuality;
+		default:
+			static set<IFTYPE> reportedTypes;
 
-						status.rxRate = attr->wlanAssociationAttributes.ulRxRate;
-						status.txRate = attr->wlanAssociationAttributes.ulTxRate;
+			// Log these so we can see what's showing up in real life.  Just log it one time though,
+			// so we don't spam the log with this.
+			if (reportedTypes.find(curr.type) == reportedTypes.end()) {
+				reportedTypes.insert(curr.type);
 
-						WlanFreeMemory(data);
-					}
-				}
+				CString name(curr.name);
+				Log::log(LOG_WARNING,
+					_T("Ignoring type %d adapter: %s - look up in ipifcons.h"),
+					curr.type, (LPCTSTR)name);
 			}
-
-			WlanFreeMemory(wifiList);
 		}
-		WlanCloseHandle(wifiHandle, NULL);
 	}
+
+	attachedHash = adapterSnapshot->getHash();
+	attachedValid = true;
 }
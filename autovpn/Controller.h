@@ -8,17 +8,31 @@
 #pragma once
 
 #include "Message.h"
+#include "Ip4Network.h"
+#include "ServiceSnapshot.h"
 
-class Ip4Network;
-class DiagnosticsV1;
-class Settings;
+class Diagnostics;
+class DiagnosticsWorker;
+class ProbeCache;
+class ProbeStats;
+class HttpProbe;
+class SettingsSnapshot;
+class SettingsMonitor;
+class NetworkChangeSource;
+class EnableLookup;
+class VpnServiceController;
+class WifiMonitor;
+class AdapterSnapshot;
 class Controller
 {
 public:
 	class StatusListener {
 	public:
-		virtual void onStatusChanged(AutoVPNStatus *) = 0;
-		virtual void onSuggestion(LPCTSTR) = 0;
+		// Called once with everything on register, and after that only when the
+		// status or the suggestion changed.  The generation goes up by one on
+		// every change.
+		virtual void onStatusChanged(const AutoVPNStatus *, LPCTSTR suggestion,
+			unsigned long generation) = 0;
 	};
 
 	Controller();
@@ -27,22 +41,92 @@ public:
 	void main();
 	void stop();
 
+	// Run a cycle as soon as possible instead of waiting for the timer
+	void requestCycle();
+
+	// Asked for by the user, so these also skip the settle delay.  A forced
+	// diagnostics run goes to the network even if there are cached answers.
+	void recheckNow();
+	void runDiagnosticsNow();
+
+	// Called when addresses, routes, or interfaces change
+	void networkChanged();
+
+	// Timing histograms for the diagnostic probes, for the UI to ask about
+	void getProbeStats(list<AutoVPNProbeStats>& stats);
+
 	void registerStatusListener(StatusListener*);
 	void unregisterStatusListener(StatusListener*);
 
+	static bool sameStatus(const AutoVPNStatus& a, const AutoVPNStatus& b);
+
+	// For queries over the pipe.  None of these take the controller lock, so
+	// they can't be held up by a cycle.
+	shared_ptr<const ServiceSnapshot> getSnapshot();
+	shared_ptr<const DiagnosticsRun> getLastDiagnostics();
+	void getCounters(ServiceCounters& counters);
+
 private:
 	mutex lock;
 	volatile bool run;
+	bool cycleRequested;
+	bool cycleUrgent;
+
+	// Set by cycle() while we want the VPN and it isn't up yet, which picks the
+	// short interval.  Diagnostics can replace the published state, so that
+	// can't be used for this.
+	bool vpnPending;
+	bool diagnosticsForced;
 	condition_variable wake;
 
 	void cycle();
 
 	AutoVPNStatus status;
-	list<StatusListener*> statusListeners;
-	DiagnosticsV1 *diagnostics;
+	CString publishedSuggestion;
+	unsigned long statusGeneration;
+
+	// Replaced, never changed in place, so a broadcast can run on a copy of the
+	// pointer without holding the lock.  The broadcast lock is taken before the
+	// copy and held through the broadcast, so unregistering can wait out any
+	// broadcast that still has the old list.  Always taken before the lock.
+	shared_ptr<const vector<StatusListener*>> statusListeners;
+	mutex broadcastLock;
+
+	// Swapped with atomic_store whenever the status changes.  The history and
+	// transition count behind it are only touched by cycle().
+	shared_ptr<const ServiceSnapshot> snapshot;
+	deque<ServiceSnapshot::Transition> history;
+	unsigned long transitionCount;
+
+	ULONGLONG startTick;
+	atomic<unsigned long> cycleCount;
+	Diagnostics *diagnosticsV1;
+	Diagnostics *diagnosticsV2;
+	DiagnosticsWorker *diagnosticsWorker;
+	ProbeCache *probeCache;
+	ProbeStats *probeStats;
+	HttpProbe *verifier;
+	NetworkChangeSource *networkChanges;
+	SettingsMonitor *settingsMonitor;
+	EnableLookup *enableLookup;
+	VpnServiceController *vpnService;
+	WifiMonitor *wifiMonitor;
+	AdapterSnapshot *adapterSnapshot;
+
+	bool checkEnabled(const SettingsSnapshot& settings);
+	// Only used by cycle(), and only rebuilt when the adapter snapshot hash changes
+	vector<Ip4Network> attachedNetworks;
+	bool foundEthernet;
+	bool foundWifi;
+	bool foundVpn;
+	bool attachedValid;
+	uint64_t attachedHash;
+
+	// Whether we're on an internal network, for this adapter hash and settings generation
+	bool internalMatchValid;
+	uint64_t internalMatchHash;
+	unsigned long internalMatchGeneration;
+	bool internalMatch;
 
-	bool checkEnabled(Settings& settings);
-	void loadInternalNetworks(Settings &, list<shared_ptr<Ip4Network>>&);
-	void loadAttachedNetworks(list<shared_ptr<Ip4Network>>&, bool &foundEthernet, bool &foundWifi, bool &foundVpnAdapter);
-	void getWifiInfo(AutoVPNStatus& status);
+	void loadAttachedNetworks();
 };
@@ -7,11 +7,30 @@
 
 #pragma once
 
+class SettingsSnapshot;
+class Cancellation;
+
 class Diagnostics {
 public:
 	enum class CallReason {
 		VPN_NOT_CONNECTING = 1
 	};
 
-	virtual void diagnose(CallReason reason, AutoVPNStatus& status, CString& suggestion) = 0;
+	// Everything a run needs, gathered up front since it runs on the worker
+	// thread instead of the controller's.
+	struct Context {
+		CallReason reason;
+		shared_ptr<const SettingsSnapshot> settings;
+		Cancellation *cancellation;
+
+		// Adapters, gateways and SSID - probe results are only reused on the same one
+		uint64_t networkFingerprint;
+
+		// Go to the network even if there's a cached answer
+		bool bypassCache;
+	};
+
+	virtual ~Diagnostics() {}
+
+	virtual void diagnose(Context& context, AutoVPNStatus& status, CString& suggestion) = 0;
 };
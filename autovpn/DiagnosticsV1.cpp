@@ -10,64 +10,150 @@
 #include "Message.h"
 #include "Diagnostics.h"
 #include "DiagnosticsV1.h"
-#include "VerifyUrl.h"
-#include "Settings.h"
-
-DiagnosticsV1::DiagnosticsV1()
+#include "HttpProbe.h"
+#include "SettingsSnapshot.h"
+#include "ProbeCache.h"
+#include "ProbeStats.h"
+#include "ProbeRace.h"
+#include "WorkPool.h"
+#include "TlsPinCheck.h"
+
+// Enough for a few endpoints to be in the air at once while racing
+#define RACE_THREADS 4
+
+DiagnosticsV1::DiagnosticsV1(ProbeCache *probeCache, ProbeStats *probeStats, HttpProbe *verifier)
 {
+	this->probeCache = probeCache;
+	this->probeStats = probeStats;
+	this->verifier = verifier;
+
+	pool = new WorkPool(RACE_THREADS);
+	pool->start();
+
+	race = new ProbeRace(pool);
 }
 
 DiagnosticsV1::~DiagnosticsV1()
 {
+	delete race;
+
+	pool->stop();
+	delete pool;
 }
 
-void DiagnosticsV1::diagnose(CallReason reason, AutoVPNStatus& status, CString& suggestion)
+void DiagnosticsV1::diagnose(Context& context, AutoVPNStatus& status, CString& suggestion)
 {
-	switch (reason) {
+	switch (context.reason) {
 	case CallReason::VPN_NOT_CONNECTING:
-		diagnoseVpnNotConnecting(status, suggestion);
+		diagnoseVpnNotConnecting(context, status, suggestion);
 		break;
 	default:
 		break;
 	}
 }
 
-void DiagnosticsV1::diagnoseVpnNotConnecting(AutoVPNStatus& status, CString &suggestion)
+HttpProbe::Status DiagnosticsV1::probe(Context& context, const CString& url, const CString& expected)
+{
+	HttpProbe::Status status = HttpProbe::Status::UNKNOWN;
+
+	if (!context.bypassCache &&
+		probeCache->get(context.networkFingerprint, url, expected, status)) {
+		return status;
+	}
+
+	HttpProbe::Timing timing;
+	status = verifier->probe(url, expected,
+		HttpProbe::getTimeouts(*context.settings), context.cancellation, &timing);
+
+	probeStats->record(url, status, timing);
+
+	probeCache->put(context.networkFingerprint, url, expected, status,
+		context.settings->getDiagnosticsCacheSeconds());
+
+	return status;
+}
+
+HttpProbe::Status DiagnosticsV1::probeAny(Context& context, const vector<CString>& urls, const CString& expected)
 {
-	CString unencryptedInternetUrl;
-	CString unencryptedInternetContent;
-	CString encryptedInternetUrl;
-	CString encryptedInternetContent;
+	return race->race(urls, context.cancellation, context.settings->getDiagnosticsTimeout(),
+		[this, &context, &expected](const CString& url, Cancellation *cancellation) {
+			Context entrant = context;
+			entrant.cancellation = cancellation;
 
-	Settings settings;
+			return probe(entrant, url, expected);
+		});
+}
 
-	// For the unencrypted there's no reason not to use the MS NCSI server
-	if (!settings.readString(_T("UnencryptedInternetUrl"), unencryptedInternetUrl)) {
-		unencryptedInternetUrl = _T("http://www.msftncsi.com/ncsi.txt");
+HttpProbe::Status DiagnosticsV1::pinCheck(Context& context, const CString& url)
+{
+	HttpProbe::Status status = HttpProbe::Status::UNKNOWN;
+	const vector<CString>& pins = context.settings->getEncryptedInternetPins();
+
+	// Cached under the pins instead of content, so a pin change in policy
+	// doesn't get an old answer.
+	CString key(_T("pin:"));
+	key += url;
+
+	CString pinList;
+	for (const CString& pin : pins) {
+		pinList += pin;
+		pinList += _T(" ");
 	}
-	if (!settings.readString(_T("UnencryptedInternetContent"), unencryptedInternetContent)) {
-		unencryptedInternetContent = _T("Microsoft NCSI");
+
+	if (!context.bypassCache &&
+		probeCache->get(context.networkFingerprint, key, pinList, status)) {
+		return status;
 	}
 
-	settings.readString(_T("EncryptedInternetUrl"), encryptedInternetUrl);
-	settings.readString(_T("EncryptedInternetContent"), encryptedInternetContent);
+	status = TlsPinCheck::check(url, pins,
+		HttpProbe::getTimeouts(*context.settings), context.cancellation);
+
+	probeCache->put(context.networkFingerprint, key, pinList, status,
+		context.settings->getDiagnosticsCacheSeconds());
+
+	return status;
+}
+
+HttpProbe::Status DiagnosticsV1::pinCheckAny(Context& context, const vector<CString>& urls)
+{
+	return race->race(urls, context.cancellation, context.settings->getDiagnosticsTimeout(),
+		[this, &context](const CString& url, Cancellation *cancellation) {
+			Context entrant = context;
+			entrant.cancellation = cancellation;
 
-	if (!unencryptedInternetUrl.IsEmpty()) {
+			return pinCheck(entrant, url);
+		});
+}
+
+void DiagnosticsV1::diagnoseVpnNotConnecting(Context& context,
+	AutoVPNStatus& status, CString &suggestion)
+{
+	const SettingsSnapshot& settings = *context.settings;
+
+	const vector<CString>& unencryptedInternetUrls = settings.getUnencryptedInternetUrls();
+	const CString& unencryptedInternetContent = settings.getUnencryptedInternetContent();
+	const vector<CString>& encryptedInternetUrls = settings.getEncryptedInternetUrls();
+	const CString& encryptedInternetContent = settings.getEncryptedInternetContent();
+
+	if (!unencryptedInternetUrls.empty()) {
 		// This is more or less a basic NCSI check.  If we get some weird content back
 		// then we're probably behind a captive portal.  If we get some other error then
 		// we're not connected to the internet.
-		VerifyUrl::Status unencryptedStatus =
-			VerifyUrl::verifyUrl(unencryptedInternetUrl, unencryptedInternetContent);
+		HttpProbe::Status unencryptedStatus =
+			probeAny(context, unencryptedInternetUrls, unencryptedInternetContent);
+
+		if (unencryptedStatus == HttpProbe::Status::CANCELLED) {
+			// Nothing to say if we didn't get an answer
 
-		if (unencryptedStatus == VerifyUrl::Status::ERR_WRONG_CONTENT) {
+		} else if (unencryptedStatus == HttpProbe::Status::ERR_WRONG_CONTENT) {
 			status.state = AVS_NETWORK;
 			suggestion = _T("V1_NSCI_INTERCEPT");
 
-		} else if (unencryptedStatus != VerifyUrl::Status::SUCCESS) {
+		} else if (unencryptedStatus != HttpProbe::Status::SUCCESS) {
 			status.state = AVS_NETWORK;
 			suggestion = _T("V1_NCSI_FAILURE");
 		} else {
-			if (!encryptedInternetUrl.IsEmpty()) {
+			if (!encryptedInternetUrls.empty()) {
 				// If the unencrypted check passes but we're not connecting, then run a
 				// check to an encrypted endpoint.  This should flush out man-in-the-middle
 				// firewalls aka "SSL inspection".
@@ -78,17 +164,20 @@ void DiagnosticsV1::diagnoseVpnNotConnecting(AutoVPNStatus& status, CString &sug
 
 				// NOTE: This shouldn't actually catch a MITM at your own company as long
 				// as you push it out via GPO, since WinHttp uses the Windows certificate
-				// store.
+				// store.  With pins it will, because then we never ask the store - the
+				// handshake alone tells us whether the real server answered.
 
-				VerifyUrl::Status encryptedStatus =
-					VerifyUrl::verifyUrl(encryptedInternetUrl, encryptedInternetContent);
+				HttpProbe::Status encryptedStatus = settings.getEncryptedInternetPins().empty() ?
+					probeAny(context, encryptedInternetUrls, encryptedInternetContent) :
+					pinCheckAny(context, encryptedInternetUrls);
 
-				if (encryptedStatus != VerifyUrl::Status::SUCCESS) {
+				if ((encryptedStatus != HttpProbe::Status::SUCCESS) &&
+					(encryptedStatus != HttpProbe::Status::CANCELLED)) {
 					status.state = AVS_NETWORK;
 
 					switch (encryptedStatus) {
-					case VerifyUrl::Status::ERR_SECURITY_FAILED:
-					case VerifyUrl::Status::ERR_WRONG_CONTENT:
+					case HttpProbe::Status::ERR_SECURITY_FAILED:
+					case HttpProbe::Status::ERR_WRONG_CONTENT:
 						suggestion = _T("V1_ENCSI_INTERCEPT");
 						break;
 
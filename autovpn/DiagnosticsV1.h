@@ -6,13 +6,33 @@
  ******************************************************************************/
 
 #pragma once
+
+#include "HttpProbe.h"
+
+class ProbeCache;
+class ProbeStats;
+class ProbeRace;
+class WorkPool;
+
 class DiagnosticsV1 : public Diagnostics {
 public:
-	DiagnosticsV1();
+	DiagnosticsV1(ProbeCache *, ProbeStats *, HttpProbe *);
 	virtual ~DiagnosticsV1();
 
-	virtual void diagnose(CallReason reason, AutoVPNStatus& status, CString &suggestion);
+	virtual void diagnose(Context& context, AutoVPNStatus& status, CString &suggestion);
 private:
+	ProbeCache *probeCache;
+	ProbeStats *probeStats;
+	HttpProbe *verifier;
+	WorkPool *pool;
+	ProbeRace *race;
+
+	HttpProbe::Status probe(Context& context, const CString& url, const CString& expected);
+	HttpProbe::Status probeAny(Context& context, const vector<CString>& urls, const CString& expected);
+
+	HttpProbe::Status pinCheck(Context& context, const CString& url);
+	HttpProbe::Status pinCheckAny(Context& context, const vector<CString>& urls);
 
-	void diagnoseVpnNotConnecting(AutoVPNStatus& status, CString& suggestion);
+	void diagnoseVpnNotConnecting(Context& context,
+		AutoVPNStatus& status, CString& suggestion);
 };
@@ -0,0 +1,628 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "Message.h"
+#include "Diagnostics.h"
+#include "DiagnosticsV2.h"
+#include "HttpProbe.h"
+#include "SettingsSnapshot.h"
+#include "ProbeCache.h"
+#include "ProbeStats.h"
+#include "Cancellation.h"
+#include "WorkPool.h"
+#include "ProbeRace.h"
+#include "TlsPinCheck.h"
+
+// One chain per endpoint, and only the first probe of each can start right
+// away, so a run never has more than one probe per chain to hand out.  The
+// pool grows to fit the run, starting from the NCSI URL, the encrypted URL
+// and the headend, but a long list of URLs shares a few threads.
+#define PROBE_THREADS_MINIMUM 3
+#define PROBE_THREADS_MAXIMUM 8
+
+// If there's no port on HeadendAddress, assume the HTTPS port since most VPN
+// appliances have something listening there.
+#define DEFAULT_HEADEND_PORT 443
+
+struct DiagnosticsV2::Run {
+	Run(DWORD timeoutMs) : cancellation(timeoutMs) {
+		running = 0;
+		changedEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+	~Run() {
+		CloseHandle(changedEvent);
+	}
+
+	mutex lock;
+	vector<Node> nodes;
+	int running;
+
+	// Set every time a probe finishes
+	HANDLE changedEvent;
+
+	// Our own token, so a short-circuit doesn't cancel the caller's
+	Cancellation cancellation;
+
+	uint64_t networkFingerprint;
+	bool bypassCache;
+	int cacheSeconds;
+	HttpProbe::Timeouts timeouts;
+
+	// Only used by TLS nodes, and the cache key for them
+	vector<CString> pins;
+	CString pinList;
+
+	// In order of importance, with a chain for each endpoint
+	vector<Chain> ncsi;
+	vector<Chain> encrypted;
+	vector<Chain> headend;
+};
+
+DiagnosticsV2::DiagnosticsV2(ProbeCache *probeCache, ProbeStats *probeStats, HttpProbe *verifier)
+{
+	this->probeCache = probeCache;
+	this->probeStats = probeStats;
+	this->verifier = verifier;
+
+	pool = new WorkPool(PROBE_THREADS_MINIMUM);
+	pool->start();
+}
+
+DiagnosticsV2::~DiagnosticsV2()
+{
+	pool->stop();
+	delete pool;
+}
+
+int DiagnosticsV2::addNode(Run& run, NodeType type, int dependsOn)
+{
+	Node node;
+	node.type = type;
+	node.dependsOn = dependsOn;
+	node.port = 0;
+	node.state = NodeState::WAITING;
+	node.status = HttpProbe::Status::UNKNOWN;
+	ZeroMemory(&node.address, sizeof(node.address));
+
+	run.nodes.push_back(node);
+	return (int)run.nodes.size() - 1;
+}
+
+bool DiagnosticsV2::buildUrlChain(Run& run, const CString& url, const CString& expected, bool pinned, Chain& chain)
+{
+	chain.dns = -1;
+	chain.tcp = -1;
+	chain.http = -1;
+
+	if (url.IsEmpty()) {
+		return false;
+	}
+
+	URL_COMPONENTS urlParts;
+	ZeroMemory(&urlParts, sizeof(urlParts));
+	urlParts.dwStructSize = sizeof(urlParts);
+	urlParts.dwHostNameLength = -1;
+
+	if (!WinHttpCrackUrl(url.GetString(), url.GetLength(), 0, &urlParts)) {
+		Log::log(LOG_ERROR,
+			_T("Unable to parse URL with WinHttpCrackUrl: {w32err}"));
+		return false;
+	}
+
+	CString host(urlParts.lpszHostName, urlParts.dwHostNameLength);
+
+	chain.dns = addNode(run, NodeType::DNS, -1);
+	run.nodes[chain.dns].host = host;
+
+	chain.tcp = addNode(run, NodeType::TCP, chain.dns);
+	run.nodes[chain.tcp].host = host;
+	run.nodes[chain.tcp].port = urlParts.nPort;
+
+	chain.http = addNode(run, pinned ? NodeType::TLS : NodeType::HTTP, chain.tcp);
+	run.nodes[chain.http].url = url;
+	run.nodes[chain.http].expected = expected;
+
+	return true;
+}
+
+bool DiagnosticsV2::buildHostChain(Run& run, const CString& hostPort, Chain& chain)
+{
+	chain.dns = -1;
+	chain.tcp = -1;
+	chain.http = -1;
+
+	if (hostPort.IsEmpty()) {
+		return false;
+	}
+
+	CString host(hostPort);
+	INTERNET_PORT port = DEFAULT_HEADEND_PORT;
+
+	int split = hostPort.ReverseFind(':');
+	if (split > 0) {
+		int value = _ttoi(hostPort.Mid(split + 1));
+		if ((value <= 0) || (value > 65535)) {
+			Log::log(LOG_ERROR,
+				_T("Invalid port in HeadendAddress: %s"), (LPCTSTR)hostPort);
+			return false;
+		}
+
+		host = hostPort.Left(split);
+		port = (INTERNET_PORT)value;
+	}
+
+	chain.dns = addNode(run, NodeType::DNS, -1);
+	run.nodes[chain.dns].host = host;
+
+	chain.tcp = addNode(run, NodeType::TCP, chain.dns);
+	run.nodes[chain.tcp].host = host;
+	run.nodes[chain.tcp].port = port;
+
+	return true;
+}
+
+void DiagnosticsV2::diagnose(Context& context, AutoVPNStatus& status, CString& suggestion)
+{
+	if (context.reason != CallReason::VPN_NOT_CONNECTING) {
+		return;
+	}
+
+	const SettingsSnapshot& settings = *context.settings;
+
+	DWORD timeout = (DWORD)settings.getDiagnosticsTimeout();
+	if (context.cancellation != NULL) {
+		timeout = context.cancellation->getRemaining();
+	}
+	if (timeout == 0) {
+		return;
+	}
+
+	Run run(timeout);
+	run.networkFingerprint = context.networkFingerprint;
+	run.bypassCache = context.bypassCache;
+	run.cacheSeconds = settings.getDiagnosticsCacheSeconds();
+	run.timeouts = HttpProbe::getTimeouts(settings);
+
+	run.pins = settings.getEncryptedInternetPins();
+	for (const CString& pin : run.pins) {
+		run.pinList += pin;
+		run.pinList += _T(" ");
+	}
+
+	// Nodes are always added after what they depend on, which lets schedule()
+	// get away with one pass.
+	Chain chain;
+	for (const CString& url : settings.getUnencryptedInternetUrls()) {
+		if (buildUrlChain(run, url, settings.getUnencryptedInternetContent(), false, chain)) {
+			run.ncsi.push_back(chain);
+		}
+	}
+	for (const CString& url : settings.getEncryptedInternetUrls()) {
+		if (buildUrlChain(run, url, settings.getEncryptedInternetContent(), !run.pins.empty(), chain)) {
+			run.encrypted.push_back(chain);
+		}
+	}
+	if (buildHostChain(run, settings.getHeadendAddress(), chain)) {
+		run.headend.push_back(chain);
+	}
+
+	int chains = (int)(run.ncsi.size() + run.encrypted.size() + run.headend.size());
+	pool->grow(min(chains, PROBE_THREADS_MAXIMUM));
+
+	// If the caller cancels, that's the same as running out of time for us.  If
+	// it was a network change the worker throws away the result anyway.
+	HANDLE events[2];
+	events[0] = run.changedEvent;
+	events[1] = (context.cancellation != NULL) ?
+		context.cancellation->getEvent() : run.cancellation.getEvent();
+
+	CString finding;
+	bool conclusive = false;
+
+	for (bool waitRun = true; waitRun; ) {
+		{
+			unique_lock<mutex> permit(run.lock);
+			schedule(run);
+
+			conclusive = conclude(run, false, finding);
+			if (conclusive || (run.running == 0)) {
+				break;
+			}
+		}
+
+		DWORD remaining = run.cancellation.getRemaining();
+		if (remaining == 0) {
+			waitRun = false;
+		} else if (WaitForMultipleObjects(2, events, FALSE, remaining) != WAIT_OBJECT_0) {
+			waitRun = false;
+		}
+	}
+
+	// Whatever is left over doesn't matter now.  The probes reference the run
+	// on our stack, so we have to wait for all of them to notice.
+	run.cancellation.cancel();
+
+	for (;;) {
+		{
+			unique_lock<mutex> permit(run.lock);
+			if (run.running == 0) {
+				break;
+			}
+		}
+		WaitForSingleObject(run.changedEvent, INFINITE);
+	}
+
+	if (!conclusive) {
+		// Out of time.  On a working network none of these take anywhere near
+		// that long, so anything that didn't finish counts as a failure.
+		Log::log(LOG_WARNING, _T("Diagnostics ran out of time, using partial results"));
+
+		unique_lock<mutex> permit(run.lock);
+		conclusive = conclude(run, true, finding);
+	}
+
+	if (conclusive && !finding.IsEmpty()) {
+		status.state = AVS_NETWORK;
+		suggestion = finding;
+	}
+}
+
+void DiagnosticsV2::schedule(Run& run)
+{
+	// Called with the run lock held
+	if (run.cancellation.isCancelled()) {
+		return;
+	}
+
+	for (int i = 0; i < (int)run.nodes.size(); i++) {
+		Node& node = run.nodes[i];
+		if (node.state != NodeState::WAITING) {
+			continue;
+		}
+
+		if (node.dependsOn >= 0) {
+			const Node& dependency = run.nodes[node.dependsOn];
+
+			if ((dependency.state == NodeState::FAILED) || (dependency.state == NodeState::SKIPPED)) {
+				node.state = NodeState::SKIPPED;
+				continue;
+			} else if (dependency.state != NodeState::PASSED) {
+				continue;
+			}
+
+			if (dependency.type == NodeType::DNS) {
+				node.address = dependency.address;
+			}
+		}
+
+		node.state = NodeState::RUNNING;
+		run.running++;
+
+		pool->submit([this, &run, i] { runNode(run, i); });
+	}
+}
+
+void DiagnosticsV2::runNode(Run& run, int index)
+{
+	NodeType type;
+	CString host;
+	INTERNET_PORT port;
+	CString url;
+	CString expected;
+	IN_ADDR address;
+
+	{
+		unique_lock<mutex> permit(run.lock);
+		const Node& node = run.nodes[index];
+
+		type = node.type;
+		host = node.host;
+		port = node.port;
+		url = node.url;
+		expected = node.expected;
+		address = node.address;
+	}
+
+	HttpProbe::Status result = HttpProbe::Status::UNKNOWN;
+
+	if (run.cancellation.isCancelled()) {
+		result = HttpProbe::Status::CANCELLED;
+	} else if (type == NodeType::DNS) {
+		// Not cached - the resolver has its own cache, and we need the address
+		result = probeDns(run, host, address);
+	} else if (type == NodeType::TCP) {
+		CString key;
+		key.Format(_T("tcp://%s:%u"), (LPCTSTR)host, (unsigned int)port);
+
+		if (run.bypassCache || !probeCache->get(run.networkFingerprint, key, _T(""), result)) {
+			result = probeTcp(run, address, port);
+			probeCache->put(run.networkFingerprint, key, _T(""), result, run.cacheSeconds);
+		}
+	} else if (type == NodeType::HTTP) {
+		if (run.bypassCache || !probeCache->get(run.networkFingerprint, url, expected, result)) {
+			HttpProbe::Timing timing;
+			result = verifier->probe(url, expected, run.timeouts, &run.cancellation, &timing);
+
+			probeStats->record(url, result, timing);
+			probeCache->put(run.networkFingerprint, url, expected, result, run.cacheSeconds);
+		}
+	} else if (type == NodeType::TLS) {
+		CString key(_T("pin:"));
+		key += url;
+
+		if (run.bypassCache || !probeCache->get(run.networkFingerprint, key, run.pinList, result)) {
+			result = TlsPinCheck::check(url, run.pins, run.timeouts, &run.cancellation);
+			probeCache->put(run.networkFingerprint, key, run.pinList, result, run.cacheSeconds);
+		}
+	}
+
+	unique_lock<mutex> permit(run.lock);
+	Node& node = run.nodes[index];
+
+	node.status = result;
+	node.address = address;
+	node.state = (result == HttpProbe::Status::SUCCESS) ? NodeState::PASSED : NodeState::FAILED;
+
+	run.running--;
+	SetEvent(run.changedEvent);
+}
+
+bool DiagnosticsV2::checkChain(Run& run, const Chain& chain, bool final, int& failedNode)
+{
+	int order[] = { chain.dns, chain.tcp, chain.http };
+
+	for (int index : order) {
+		if (index < 0) {
+			continue;
+		}
+
+		NodeState state = run.nodes[index].state;
+		if ((state == NodeState::PASSED) || (state == NodeState::SKIPPED)) {
+			continue;
+		} else if ((state == NodeState::FAILED) || final) {
+			failedNode = index;
+			return true;
+		} else {
+			// Still waiting on this one
+			return false;
+		}
+	}
+
+	failedNode = -1;
+	return true;
+}
+
+bool DiagnosticsV2::checkGroup(Run& run, const vector<Chain>& chains, bool final, int& failedNode)
+{
+	// One endpoint getting all the way through is enough, even with others
+	// still going - the rest being down is their problem, not the network's.
+	// A failure needs all of them to agree, and then the one that got the
+	// furthest says the most about what's wrong.
+	bool decided = true;
+	int furthest = -1;
+	int furthestScore = -1;
+
+	for (const Chain& chain : chains) {
+		int failed = -1;
+
+		if (!checkChain(run, chain, final, failed)) {
+			decided = false;
+		} else if (failed < 0) {
+			failedNode = -1;
+			return true;
+		} else {
+			const Node& node = run.nodes[failed];
+			int score = ((int)node.type * 10) + ProbeRace::rank(node.status);
+
+			if (score > furthestScore) {
+				furthest = failed;
+				furthestScore = score;
+			}
+		}
+	}
+
+	if (!decided) {
+		return false;
+	}
+
+	failedNode = furthest;
+	return true;
+}
+
+bool DiagnosticsV2::conclude(Run& run, bool final, CString& suggestion)
+{
+	// Called with the run lock held.  Returns true once the answer can't change.
+	int failed = -1;
+
+	if (!checkGroup(run, run.ncsi, final, failed)) {
+		return false;
+	}
+	if (failed >= 0) {
+		const Node& node = run.nodes[failed];
+
+		if (node.type == NodeType::DNS) {
+			suggestion = _T("V2_DNS_FAILURE");
+		} else if ((node.type == NodeType::HTTP) &&
+			(node.status == HttpProbe::Status::ERR_WRONG_CONTENT)) {
+			// Something answered, but not with what we asked for
+			suggestion = _T("V2_CAPTIVE_PORTAL");
+		} else {
+			suggestion = _T("V2_NO_INTERNET");
+		}
+		return true;
+	}
+
+	if (!checkGroup(run, run.encrypted, final, failed)) {
+		return false;
+	}
+	if (failed >= 0) {
+		const Node& node = run.nodes[failed];
+
+		// NOTE: This shouldn't catch inspection by your own company's firewall
+		// as long as the root is pushed by GPO, since WinHttp uses the Windows
+		// certificate store.
+		if (((node.type == NodeType::HTTP) || (node.type == NodeType::TLS)) &&
+			((node.status == HttpProbe::Status::ERR_SECURITY_FAILED) ||
+			(node.status == HttpProbe::Status::ERR_WRONG_CONTENT))) {
+			suggestion = _T("V2_TLS_INTERCEPT");
+		} else {
+			suggestion = _T("V2_TLS_BLOCKED");
+		}
+		return true;
+	}
+
+	if (!checkGroup(run, run.headend, final, failed)) {
+		return false;
+	}
+	if (failed >= 0) {
+		// The internet works but we can't get to our own headend, which usually
+		// means the VPN port is blocked on this network.
+		suggestion = _T("V2_HEADEND_UNREACHABLE");
+		return true;
+	}
+
+	return true;
+}
+
+VOID WINAPI DiagnosticsV2::dnsComplete(PVOID context, PDNS_QUERY_RESULT)
+{
+	SetEvent((HANDLE)context);
+}
+
+HttpProbe::Status DiagnosticsV2::probeDns(Run& run, const CString& host, IN_ADDR& address)
+{
+	// Nothing to look up if it's already an address
+	if (InetPton(AF_INET, host, &address) == 1) {
+		return HttpProbe::Status::SUCCESS;
+	}
+
+	HttpProbe::Status rval = HttpProbe::Status::ERR_DNS_FAILED;
+
+	HANDLE queryEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	DNS_QUERY_REQUEST request;
+	ZeroMemory(&request, sizeof(request));
+	request.Version = DNS_QUERY_REQUEST_VERSION1;
+	request.QueryName = host;
+	request.QueryType = DNS_TYPE_A;
+	request.QueryOptions = DNS_QUERY_STANDARD;
+	request.pQueryCompletionCallback = dnsComplete;
+	request.pQueryContext = queryEvent;
+
+	DNS_QUERY_RESULT result;
+	ZeroMemory(&result, sizeof(result));
+	result.Version = DNS_QUERY_RESULTS_VERSION1;
+
+	DNS_QUERY_CANCEL cancel;
+	ZeroMemory(&cancel, sizeof(cancel));
+
+	bool cancelled = false;
+	bool timedOut = false;
+
+	DNS_STATUS status = DnsQueryEx(&request, &result, &cancel);
+	if (status == DNS_REQUEST_PENDING) {
+		HANDLE events[2];
+		events[0] = queryEvent;
+		events[1] = run.cancellation.getEvent();
+
+		DWORD waitMs = min(run.cancellation.getRemaining(), (DWORD)run.timeouts.resolve);
+
+		DWORD waitValue = WaitForMultipleObjects(2, events, FALSE, waitMs);
+		if (waitValue != WAIT_OBJECT_0) {
+			if ((waitValue == WAIT_TIMEOUT) && !run.cancellation.isCancelled()) {
+				timedOut = true;
+			} else {
+				cancelled = true;
+			}
+
+			// The completion routine still gets called once with the cancel
+			// status, and it references our stack, so we have to wait for it.
+			DnsCancelQuery(&cancel);
+			WaitForSingleObject(queryEvent, INFINITE);
+		}
+
+		status = result.QueryStatus;
+	}
+
+	if (cancelled) {
+		rval = HttpProbe::Status::CANCELLED;
+	} else if (timedOut) {
+		// Already ERR_DNS_FAILED
+	} else if (status == ERROR_SUCCESS) {
+		for (PDNS_RECORD record = result.pQueryRecords; record != NULL; record = record->pNext) {
+			// There could be CNAMEs on the way to the A record
+			if (record->wType == DNS_TYPE_A) {
+				address.s_addr = record->Data.A.IpAddress;
+				rval = HttpProbe::Status::SUCCESS;
+				break;
+			}
+		}
+	}
+
+	if (result.pQueryRecords != NULL) {
+		DnsRecordListFree(result.pQueryRecords, DnsFreeRecordList);
+	}
+
+	CloseHandle(queryEvent);
+
+	return rval;
+}
+
+HttpProbe::Status DiagnosticsV2::probeTcp(Run& run, const IN_ADDR& address, INTERNET_PORT port)
+{
+	HttpProbe::Status rval = HttpProbe::Status::ERR_CONNECTION_FAILED;
+
+	SOCKET probeSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (probeSocket == INVALID_SOCKET) {
+		Log::log(LOG_ERROR, _T("Unable to create probe socket: %d"), WSAGetLastError());
+		return HttpProbe::Status::ERR_UNKNOWN;
+	}
+
+	// This also puts the socket in non-blocking mode, so the connect can be
+	// waited on alongside the cancellation.
+	WSAEVENT connectEvent = WSACreateEvent();
+	if (WSAEventSelect(probeSocket, connectEvent, FD_CONNECT) != 0) {
+		Log::log(LOG_ERROR, _T("Unable to select probe socket events: %d"), WSAGetLastError());
+		rval = HttpProbe::Status::ERR_UNKNOWN;
+	} else {
+		SOCKADDR_IN target;
+		ZeroMemory(&target, sizeof(target));
+		target.sin_family = AF_INET;
+		target.sin_addr = address;
+		target.sin_port = htons(port);
+
+		if ((connect(probeSocket, (SOCKADDR *)&target, sizeof(target)) == 0) ||
+			(WSAGetLastError() == WSAEWOULDBLOCK)) {
+			HANDLE events[2];
+			events[0] = connectEvent;
+			events[1] = run.cancellation.getEvent();
+
+			DWORD waitMs = min(run.cancellation.getRemaining(), (DWORD)run.timeouts.connect);
+
+			DWORD waitValue = WaitForMultipleObjects(2, events, FALSE, waitMs);
+			if (waitValue == WAIT_OBJECT_0) {
+				WSANETWORKEVENTS networkEvents;
+				if ((WSAEnumNetworkEvents(probeSocket, connectEvent, &networkEvents) == 0) &&
+					((networkEvents.lNetworkEvents & FD_CONNECT) != 0) &&
+					(networkEvents.iErrorCode[FD_CONNECT_BIT] == 0)) {
+					rval = HttpProbe::Status::SUCCESS;
+				}
+			} else if ((waitValue == WAIT_TIMEOUT) && !run.cancellation.isCancelled()) {
+				// Hit the connect timeout, which counts as unreachable
+			} else {
+				rval = HttpProbe::Status::CANCELLED;
+			}
+		}
+	}
+
+	closesocket(probeSocket);
+	WSACloseEvent(connectEvent);
+
+	return rval;
+}
@@ -0,0 +1,102 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include "Diagnostics.h"
+#include "HttpProbe.h"
+
+class ProbeCache;
+class ProbeStats;
+class WorkPool;
+
+/*
+ * Runs the checks side by side instead of one after the other.  Each target
+ * (the NCSI URL, the encrypted URL, and the VPN headend) gets a chain of DNS,
+ * then TCP connect, then the HTTP fetch where there is one.  Chains run at the
+ * same time on a small pool, and as soon as the results decide a suggestion
+ * the rest are cancelled.
+ *
+ * The targets are ranked, so a finding on a lower-ranked target only counts
+ * once everything above it has passed.  That keeps the answer the same as if
+ * the checks had been done in order, just without waiting for each one.
+ *
+ * When a target lists several endpoints they each get a chain.  The target
+ * passes as soon as one chain does, and only fails once they all have.
+ */
+class DiagnosticsV2 : public Diagnostics {
+public:
+	DiagnosticsV2(ProbeCache *, ProbeStats *, HttpProbe *);
+	virtual ~DiagnosticsV2();
+
+	virtual void diagnose(Context& context, AutoVPNStatus& status, CString& suggestion);
+
+private:
+	enum class NodeType {
+		DNS = 1,
+		TCP = 2,
+		HTTP = 3,
+
+		// Handshake only, in place of HTTP when there are certificate pins
+		TLS = 4
+	};
+
+	enum class NodeState {
+		WAITING = 0,
+		RUNNING = 1,
+		PASSED = 2,
+		FAILED = 3,
+		SKIPPED = 4
+	};
+
+	struct Node {
+		NodeType type;
+		int dependsOn;
+
+		CString host;
+		INTERNET_PORT port;
+		CString url;
+		CString expected;
+
+		NodeState state;
+		HttpProbe::Status status;
+
+		// Filled in by a DNS node for the TCP node after it
+		IN_ADDR address;
+	};
+
+	// One target's nodes, in order.  Any of them can be -1 if not used.
+	struct Chain {
+		int dns;
+		int tcp;
+		int http;
+	};
+
+	// Shared between diagnose() and the probes it hands to the pool
+	struct Run;
+
+	ProbeCache *probeCache;
+	ProbeStats *probeStats;
+	HttpProbe *verifier;
+	WorkPool *pool;
+
+	bool buildUrlChain(Run& run, const CString& url, const CString& expected, bool pinned, Chain& chain);
+	bool buildHostChain(Run& run, const CString& hostPort, Chain& chain);
+	int addNode(Run& run, NodeType type, int dependsOn);
+
+	void schedule(Run& run);
+	void runNode(Run& run, int index);
+
+	bool conclude(Run& run, bool final, CString& suggestion);
+	bool checkChain(Run& run, const Chain& chain, bool final, int& failedNode);
+	bool checkGroup(Run& run, const vector<Chain>& chains, bool final, int& failedNode);
+
+	HttpProbe::Status probeDns(Run& run, const CString& host, IN_ADDR& address);
+	HttpProbe::Status probeTcp(Run& run, const IN_ADDR& address, INTERNET_PORT port);
+
+	static VOID WINAPI dnsComplete(PVOID context, PDNS_QUERY_RESULT result);
+};
@@ -0,0 +1,216 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "Controller.h"
+#include "SettingsSnapshot.h"
+#include "Cancellation.h"
+#include "DiagnosticsWorker.h"
+
+// Don't re-run more often than this.  This matches how often the checks used to
+// run inline with the cycle.
+#define RERUN_MILLISECONDS 5000
+
+DiagnosticsWorker::DiagnosticsWorker(Controller *controller,
+	Diagnostics *diagnosticsV1, Diagnostics *diagnosticsV2)
+{
+	this->controller = controller;
+	this->diagnosticsV1 = diagnosticsV1;
+	this->diagnosticsV2 = diagnosticsV2;
+
+	run = true;
+	pending = false;
+	pendingReason = Diagnostics::CallReason::VPN_NOT_CONNECTING;
+	pendingFingerprint = 0;
+	pendingBypass = false;
+
+	epoch = 0;
+	current = NULL;
+
+	haveResult = false;
+	result.settingsGeneration = 0;
+	result.networkFingerprint = 0;
+	result.state = AVS_UNKNOWN;
+	resultTime = 0;
+
+	runCount = 0;
+	timeoutCount = 0;
+
+	workThread = NULL;
+}
+
+DiagnosticsWorker::~DiagnosticsWorker()
+{
+}
+
+void DiagnosticsWorker::request(Diagnostics::CallReason reason, shared_ptr<const SettingsSnapshot> settings,
+	uint64_t networkFingerprint, bool bypassCache)
+{
+	unique_lock<mutex> permit(lock);
+
+	if (bypassCache) {
+		if (pending) {
+			pendingBypass = true;
+			return;
+		}
+	} else if ((current != NULL) || pending) {
+		return;
+	} else if (haveResult &&
+		(result.settingsGeneration == settings->getGeneration()) &&
+		(result.networkFingerprint == networkFingerprint) &&
+		((GetTickCount64() - resultTime) < RERUN_MILLISECONDS)) {
+		return;
+	}
+
+	pending = true;
+	pendingBypass = bypassCache;
+	pendingReason = reason;
+	pendingSettings = settings;
+	pendingFingerprint = networkFingerprint;
+	wake.notify_all();
+}
+
+void DiagnosticsWorker::invalidate()
+{
+	unique_lock<mutex> permit(lock);
+
+	epoch++;
+	haveResult = false;
+	pending = false;
+	pendingSettings.reset();
+
+	if (current != NULL) {
+		Log::log(LOG_DEBUG, _T("Cancelling diagnostics in progress"));
+		current->cancel();
+	}
+}
+
+bool DiagnosticsWorker::getResult(Result& result)
+{
+	unique_lock<mutex> permit(lock);
+	if (haveResult) {
+		result = this->result;
+	}
+	return haveResult;
+}
+
+shared_ptr<const DiagnosticsRun> DiagnosticsWorker::getLastRun()
+{
+	return atomic_load(&lastRun);
+}
+
+void DiagnosticsWorker::workLoop()
+{
+	unique_lock<mutex> permit(lock);
+
+	while (run) {
+		if (!pending) {
+			wake.wait(permit);
+			continue;
+		}
+
+		Diagnostics::Context context;
+		context.reason = pendingReason;
+		context.settings = pendingSettings;
+		context.networkFingerprint = pendingFingerprint;
+		context.bypassCache = pendingBypass;
+
+		pending = false;
+		pendingBypass = false;
+		pendingSettings.reset();
+
+		unsigned long runEpoch = epoch;
+
+		Cancellation cancellation(context.settings->getDiagnosticsTimeout());
+		context.cancellation = &cancellation;
+		current = &cancellation;
+
+		permit.unlock();
+
+		AutoVPNStatus status;
+		ZeroMemory(&status, sizeof(status));
+		status.state = AVS_VPN_ENABLED;
+
+		CString suggestion;
+		int engineNumber = (context.settings->getDiagnosticsEngine() == 2) ? 2 : 1;
+		Diagnostics *engine = (engineNumber == 2) ? diagnosticsV2 : diagnosticsV1;
+
+		ULONGLONG startTick = GetTickCount64();
+		engine->diagnose(context, status, suggestion);
+		ULONGLONG finishTick = GetTickCount64();
+
+		bool published = false;
+
+		permit.lock();
+		current = NULL;
+
+		if (run && (runEpoch == epoch)) {
+			if (cancellation.isCancelled()) {
+				Log::log(LOG_WARNING,
+					_T("Diagnostics did not finish within %d ms"),
+					context.settings->getDiagnosticsTimeout());
+				timeoutCount++;
+			}
+			runCount++;
+
+			shared_ptr<DiagnosticsRun> finished = make_shared<DiagnosticsRun>();
+			finished->state = status.state;
+			finished->suggestion = suggestion;
+			finished->engine = engineNumber;
+			finished->reason = context.reason;
+			finished->durationMs = (DWORD)(finishTick - startTick);
+			finished->timedOut = cancellation.isCancelled();
+			finished->finishedTick = finishTick;
+			atomic_store(&lastRun, shared_ptr<const DiagnosticsRun>(finished));
+
+			result.settingsGeneration = context.settings->getGeneration();
+			result.networkFingerprint = context.networkFingerprint;
+			result.state = status.state;
+			result.suggestion = suggestion;
+			resultTime = GetTickCount64();
+			haveResult = true;
+
+			published = true;
+		}
+
+		if (published) {
+			permit.unlock();
+			controller->requestCycle();
+			permit.lock();
+		}
+	}
+}
+
+void DiagnosticsWorker::start()
+{
+	{
+		unique_lock<mutex> permit(lock);
+		run = true;
+	}
+
+	workThread = new thread(&DiagnosticsWorker::workLoop, this);
+}
+
+void DiagnosticsWorker::stop()
+{
+	if (workThread != NULL) {
+		{
+			unique_lock<mutex> permit(lock);
+			run = false;
+			if (current != NULL) {
+				current->cancel();
+			}
+			wake.notify_all();
+		}
+
+		workThread->join();
+
+		delete workThread;
+		workThread = NULL;
+	}
+}
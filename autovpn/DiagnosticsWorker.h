@@ -0,0 +1,91 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include "Diagnostics.h"
+#include "ServiceSnapshot.h"
+
+class Controller;
+class Cancellation;
+
+/*
+ * Runs diagnostics on its own thread, since the HTTP checks can take a long
+ * time on a bad network and we don't want status updates to stall behind
+ * them.  The controller asks for a run and picks up the last finished result
+ * on a later cycle - we wake it up when a run finishes.
+ */
+class DiagnosticsWorker
+{
+public:
+	struct Result {
+		unsigned long settingsGeneration;
+		uint64_t networkFingerprint;
+		short state;
+		CString suggestion;
+	};
+
+	// The settings pick which engine is used for each run
+	DiagnosticsWorker(Controller *, Diagnostics *diagnosticsV1, Diagnostics *diagnosticsV2);
+	virtual ~DiagnosticsWorker();
+
+	void start();
+	void stop();
+
+	// Start a run unless one is going or the last result is recent.  Never blocks.
+	// Bypassing the cache always gets a fresh run, queued behind any run
+	// already going since that one may have used cached answers.
+	void request(Diagnostics::CallReason reason, shared_ptr<const SettingsSnapshot> settings,
+		uint64_t networkFingerprint, bool bypassCache = false);
+
+	// The network changed, so cancel anything in progress and forget the last result
+	void invalidate();
+
+	// Last completed result, if there is one
+	bool getResult(Result& result);
+
+	// The last run that finished, kept through invalidate() since it's only
+	// for reporting.  NULL until there has been one.  Never takes the lock.
+	shared_ptr<const DiagnosticsRun> getLastRun();
+
+	unsigned long getRunCount() const {
+		return runCount;
+	}
+	unsigned long getTimeoutCount() const {
+		return timeoutCount;
+	}
+
+private:
+	Controller *controller;
+	Diagnostics *diagnosticsV1;
+	Diagnostics *diagnosticsV2;
+
+	mutex lock;
+	condition_variable wake;
+	bool run;
+
+	bool pending;
+	Diagnostics::CallReason pendingReason;
+	shared_ptr<const SettingsSnapshot> pendingSettings;
+	uint64_t pendingFingerprint;
+	bool pendingBypass;
+
+	// Bumped on invalidate, so a run that was started before gets thrown away
+	unsigned long epoch;
+	Cancellation *current;
+
+	bool haveResult;
+	Result result;
+	ULONGLONG resultTime;
+
+	shared_ptr<const DiagnosticsRun> lastRun;
+	atomic<unsigned long> runCount;
+	atomic<unsigned long> timeoutCount;
+
+	void workLoop();
+	thread *workThread;
+};
@@ -0,0 +1,340 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "Controller.h"
+#include "EnableLookup.h"
+
+// Keep a sane floor and ceiling on whatever TTL the zone hands us
+#define MIN_TTL_SECONDS 10
+#define MAX_TTL_SECONDS 3600
+
+// How long to believe "that name doesn't exist"
+#define NEGATIVE_TTL_SECONDS 60
+
+// How soon to try again after a failure or timeout
+#define RETRY_SECONDS 30
+
+// Extra time to wait for a first answer, past the lookup's own timeout, so the
+// thread has time to pick it up and hand the result back
+#define FIRST_ANSWER_SLACK_MILLISECONDS 250
+
+EnableLookup::EnableLookup(Controller *controller)
+{
+	this->controller = controller;
+
+	run = false;
+	timeoutMilliseconds = 0;
+
+	enabled = true;
+	haveAnswer = false;
+	lookupWanted = false;
+	finishedCount = 0;
+
+	ZeroMemory(&counters, sizeof(counters));
+
+	lookupThread = NULL;
+	stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+EnableLookup::~EnableLookup()
+{
+	CloseHandle(stopEvent);
+}
+
+bool EnableLookup::isEnabled(const CString& name, int timeout)
+{
+	unique_lock<mutex> permit(lock);
+
+	if (hostname.Compare(name) != 0) {
+		// Policy changed which name we look at, so what we had is meaningless.
+		// Enabled is the default until we hear otherwise.
+		hostname = name;
+		enabled = true;
+		haveAnswer = false;
+	}
+	timeoutMilliseconds = timeout;
+
+	if (!haveAnswer || (chrono::steady_clock::now() >= expires)) {
+		if (!lookupWanted) {
+			lookupWanted = true;
+			wake.notify_all();
+		}
+	}
+
+	// Guessing enabled here would start the VPN on a cold start or a policy
+	// change at a site that says disabled, and stop it again a moment later
+	// when the answer lands.  So the first time round we wait for the lookup,
+	// the same as when this was done inline.
+	if (!haveAnswer && run) {
+		unsigned long startCount = finishedCount;
+		finished.wait_for(permit, chrono::milliseconds(timeout + FIRST_ANSWER_SLACK_MILLISECONDS),
+			[this, startCount] { return haveAnswer || !run || (finishedCount != startCount); });
+	}
+
+	return enabled;
+}
+
+void EnableLookup::invalidate()
+{
+	unique_lock<mutex> permit(lock);
+	invalidated = chrono::steady_clock::now();
+	expires = invalidated;
+}
+
+EnableLookup::Counters EnableLookup::getCounters()
+{
+	unique_lock<mutex> permit(lock);
+	return counters;
+}
+
+VOID WINAPI EnableLookup::queryComplete(PVOID context, PDNS_QUERY_RESULT)
+{
+	// The results land in the DNS_QUERY_RESULT we passed in, so all we have
+	// to do is let the waiting thread know.
+	SetEvent((HANDLE)context);
+}
+
+EnableLookup::Result EnableLookup::resolve(LPCTSTR name, int timeout, DWORD& ttl)
+{
+	Result rval = Result::FAILED;
+
+	HANDLE queryEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	DNS_QUERY_REQUEST request;
+	ZeroMemory(&request, sizeof(request));
+	request.Version = DNS_QUERY_REQUEST_VERSION1;
+	request.QueryName = name;
+
+	// Our flags are A (IPv4) records, so that's all we care about
+	request.QueryType = DNS_TYPE_A;
+	request.QueryOptions = DNS_QUERY_STANDARD;
+	request.pQueryCompletionCallback = queryComplete;
+	request.pQueryContext = queryEvent;
+
+	DNS_QUERY_RESULT result;
+	ZeroMemory(&result, sizeof(result));
+	result.Version = DNS_QUERY_RESULTS_VERSION1;
+
+	DNS_QUERY_CANCEL cancel;
+	ZeroMemory(&cancel, sizeof(cancel));
+
+	bool timedOut = false;
+
+	DNS_STATUS status = DnsQueryEx(&request, &result, &cancel);
+	if (status == DNS_REQUEST_PENDING) {
+		HANDLE events[2];
+		events[0] = queryEvent;
+		events[1] = stopEvent;
+
+		DWORD waitValue = WaitForMultipleObjects(2, events, FALSE, (DWORD)timeout);
+		if (waitValue != WAIT_OBJECT_0) {
+			timedOut = (waitValue == WAIT_TIMEOUT);
+
+			// The completion routine still gets called once with the cancel
+			// status, and it references our stack, so we have to wait for it.
+			DnsCancelQuery(&cancel);
+			WaitForSingleObject(queryEvent, INFINITE);
+		}
+
+		status = result.QueryStatus;
+	}
+
+	if (timedOut) {
+		rval = Result::TIMEOUT;
+	} else if (status == ERROR_SUCCESS) {
+		// Default is enabled if there's something there we don't understand
+		rval = Result::ENABLED;
+		ttl = MAX_TTL_SECONDS;
+
+		for (PDNS_RECORD record = result.pQueryRecords; record != NULL; record = record->pNext) {
+			// There could be CNAMEs on the way to the A record
+			if (record->dwTtl < ttl) {
+				ttl = record->dwTtl;
+			}
+
+			if (record->wType == DNS_TYPE_A) {
+				unsigned long rawIp = ntohl(record->Data.A.IpAddress);
+
+				// Use 127.0.0.2 to mean enabled and 127.0.0.3 to mean disabled.
+				//
+				// 1) I wanted to use A records because it's the most widely-implemented
+				//    type - most web providers these days implement TXT at least, but
+				//    A records are a lowest common denominator.
+				//
+				// 2) We can't use existence or non-existence because some ISPs
+				//    (as well as OpenDNS) will return a server of theirs instead
+				//    of NXDOMAIN.  So we have to use something that can't normally
+				//    occur on the open internet.
+				//
+				// 3) It used to be common practice to put localhost in zone files, or
+				//    I used to see it done.  So I'm avoiding 127.0.0.1.
+				//
+				// 4) AFAIK the alternate loopback addresses aren't in common use.  I
+				//    think I've seen them used for proxies with some ASA web portal
+				//    stuff, but I can't think of anywhere else.
+				//
+				// 5) There's precident in how some DNSRBLs are implemented.
+				//
+				if (rawIp == 0x7F000002) {
+					rval = Result::ENABLED;
+				} else if (rawIp == 0x7F000003) {
+					rval = Result::DISABLED;
+				} else {
+					// This is DEBUG because we don't want to spam the log if we're
+					// behind something that won't return NXDOMAIN
+
+					Log::log(LOG_DEBUG,
+						_T("Enable hostname value 0x%08X not understood"),
+						rawIp);
+				}
+				break;
+			}
+		}
+	} else if ((status == DNS_ERROR_RCODE_NAME_ERROR) || (status == DNS_INFO_NO_RECORDS)) {
+		rval = Result::NOT_FOUND;
+		ttl = NEGATIVE_TTL_SECONDS;
+	} else {
+		Log::log(LOG_WARNING,
+			_T("Unable to query for disabled hostname: %d"), status);
+	}
+
+	if (result.pQueryRecords != NULL) {
+		DnsRecordListFree(result.pQueryRecords, DnsFreeRecordList);
+	}
+
+	CloseHandle(queryEvent);
+
+	return rval;
+}
+
+void EnableLookup::lookupLoop()
+{
+	unique_lock<mutex> permit(lock);
+
+	while (run) {
+		wake.wait(permit, [this] { return !run || lookupWanted; });
+		if (!run) {
+			break;
+		}
+
+		CString name = hostname;
+		int timeout = timeoutMilliseconds;
+
+		permit.unlock();
+
+		chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+
+		DWORD ttl = RETRY_SECONDS;
+		Result result = resolve(name, timeout, ttl);
+
+		chrono::steady_clock::time_point endTime = chrono::steady_clock::now();
+		unsigned long latency = (unsigned long)
+			chrono::duration_cast<chrono::milliseconds>(endTime - startTime).count();
+
+		permit.lock();
+
+		lookupWanted = false;
+
+		counters.lookups++;
+		counters.lastLatency = latency;
+		counters.totalLatency += latency;
+		if (latency > counters.maxLatency) {
+			counters.maxLatency = latency;
+		}
+
+		if (hostname.Compare(name) != 0) {
+			// The name changed while we were busy, so this answer is useless.
+			// Go around again for the new one.
+			lookupWanted = true;
+			continue;
+		}
+
+		finishedCount++;
+		finished.notify_all();
+
+		bool oldEnabled = enabled;
+
+		switch (result) {
+		case Result::ENABLED:
+		case Result::NOT_FOUND:
+			enabled = true;
+			haveAnswer = true;
+			break;
+
+		case Result::DISABLED:
+			enabled = false;
+			haveAnswer = true;
+			break;
+
+		case Result::TIMEOUT:
+			counters.timeouts++;
+			Log::log(LOG_WARNING,
+				_T("Lookup of enable hostname timed out after %lu ms"), latency);
+			break;
+
+		case Result::FAILED:
+			counters.failures++;
+			break;
+		}
+
+		// Hold onto whatever we knew before if this one failed, and try again
+		// a little later.
+		if (ttl < MIN_TTL_SECONDS) {
+			ttl = MIN_TTL_SECONDS;
+		}
+		expires = endTime + chrono::seconds(ttl);
+
+		// If the network changed while we were asking, the answer we just got
+		// might already be stale.
+		if (invalidated >= startTime) {
+			expires = endTime;
+		}
+
+		Log::log(LOG_DEBUG,
+			_T("Enable hostname lookup took %lu ms, enabled=%d, good for %lu seconds"),
+			latency, enabled, ttl);
+
+		if (enabled != oldEnabled) {
+			permit.unlock();
+			controller->requestCycle();
+			permit.lock();
+		}
+	}
+}
+
+void EnableLookup::start()
+{
+	{
+		unique_lock<mutex> permit(lock);
+		run = true;
+	}
+
+	ResetEvent(stopEvent);
+	lookupThread = new thread(&EnableLookup::lookupLoop, this);
+}
+
+void EnableLookup::stop()
+{
+	if (lookupThread != NULL) {
+		{
+			unique_lock<mutex> permit(lock);
+			run = false;
+			wake.notify_all();
+			finished.notify_all();
+		}
+
+		// This breaks us out of a lookup in progress
+		SetEvent(stopEvent);
+
+		lookupThread->join();
+
+		delete lookupThread;
+		lookupThread = NULL;
+	}
+}
@@ -0,0 +1,86 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+class Controller;
+
+/*
+ * Resolves the EnableHostname on its own thread, so a slow or blackholed DNS
+ * server can't hold up the controller.  The controller always gets the last
+ * answer we know about, and we refresh it in the background once the record
+ * TTL runs out.
+ */
+class EnableLookup
+{
+public:
+	EnableLookup(Controller *);
+	virtual ~EnableLookup();
+
+	void start();
+	void stop();
+
+	// Returns the last known answer, and starts a lookup if we don't have one
+	// for this hostname or the one we have has expired.  Only waits when there
+	// has never been an answer for this hostname, and then no longer than the
+	// timeout - after that the answer is enabled until we hear otherwise.
+	bool isEnabled(const CString& hostname, int timeoutMilliseconds);
+
+	// Something changed on the network, so the answer could be different now.
+	// Keep using what we have, but look it up again on the next call.
+	void invalidate();
+
+	struct Counters {
+		unsigned long lookups;
+		unsigned long failures;
+		unsigned long timeouts;
+		unsigned long lastLatency;		// Milliseconds
+		unsigned long maxLatency;
+		unsigned long long totalLatency;
+	};
+
+	Counters getCounters();
+
+private:
+	Controller *controller;
+
+	mutex lock;
+	condition_variable wake;
+
+	// Signalled each time a lookup for the current hostname finishes, good or
+	// bad, for a caller waiting on the first answer.
+	condition_variable finished;
+	unsigned long finishedCount;
+	bool run;
+
+	CString hostname;
+	int timeoutMilliseconds;
+
+	bool enabled;
+	bool haveAnswer;
+	bool lookupWanted;
+	chrono::steady_clock::time_point expires;
+	chrono::steady_clock::time_point invalidated;
+
+	Counters counters;
+
+	enum class Result {
+		ENABLED,
+		DISABLED,
+		NOT_FOUND,
+		FAILED,
+		TIMEOUT
+	};
+
+	Result resolve(LPCTSTR name, int timeout, DWORD& ttl);
+	static VOID WINAPI queryComplete(PVOID context, PDNS_QUERY_RESULT results);
+
+	void lookupLoop();
+
+	HANDLE stopEvent;
+	thread *lookupThread;
+};
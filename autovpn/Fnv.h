@@ -0,0 +1,24 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+/*
+ * 64-bit FNV-1a, for cheap fingerprints of things we want to notice changing.
+ * Not for anything where someone might be trying to cause a collision.
+ */
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+static inline void fnvAdd(uint64_t &hash, const void *data, size_t length)
+{
+	const BYTE *bytes = (const BYTE *)data;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+}
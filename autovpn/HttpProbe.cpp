@@ -0,0 +1,21 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "HttpProbe.h"
+#include "SettingsSnapshot.h"
+
+HttpProbe::Timeouts HttpProbe::getTimeouts(const SettingsSnapshot& settings)
+{
+	Timeouts timeouts;
+	timeouts.resolve = settings.getProbeConnectTimeout();
+	timeouts.connect = settings.getProbeConnectTimeout();
+	timeouts.send = settings.getProbeSendTimeout();
+	timeouts.receive = settings.getProbeReceiveTimeout();
+
+	return timeouts;
+}
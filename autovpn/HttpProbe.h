@@ -0,0 +1,62 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+class Cancellation;
+class SettingsSnapshot;
+
+/*
+ * Fetches a URL and checks that the body starts with what we expect.  The
+ * diagnostics engines only talk to this, so they don't care how the request
+ * is actually made, and something scripted can stand in for the network.
+ */
+class HttpProbe {
+public:
+	enum class Status {
+		UNKNOWN = 0,
+		SUCCESS = 1,
+		ERR_UNKNOWN = 2,
+		ERR_DNS_FAILED = 3,
+		ERR_CONNECTION_FAILED = 4,
+		ERR_SECURITY_FAILED = 5,
+		ERR_WRONG_CONTENT = 6,
+		CANCELLED = 7
+	};
+
+	// Microseconds spent in each phase, or -1 if it didn't happen.  Plain HTTP
+	// has no TLS phase, and a connection that gets reused skips DNS and connect.
+	struct Timing {
+		long dns;
+		long connect;
+		long tls;
+		long firstByte;
+		long total;
+	};
+
+	// Timeouts in milliseconds for each step of a request
+	struct Timeouts {
+		int resolve;
+		int connect;
+		int send;
+		int receive;
+	};
+
+	static Timeouts getTimeouts(const SettingsSnapshot& settings);
+
+	virtual ~HttpProbe() {}
+
+	// If a cancellation is passed, the request is attached to it so it can be
+	// broken off, and the timeouts are held to the time remaining.  Has to be
+	// safe to call from several threads at once.
+	virtual Status probe(LPCTSTR url, LPCTSTR expected, const Timeouts& timeouts,
+		Cancellation *cancellation = NULL, Timing *timing = NULL) = 0;
+
+	// Forget anything kept from earlier requests, because it belongs to a
+	// network we aren't on anymore.
+	virtual void reset() = 0;
+};
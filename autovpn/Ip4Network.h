@@ -6,20 +6,222 @@
  ******************************************************************************/
 
 #pragma once
+
+/*
+ * An IPv4 address and mask, both kept in host byte order so bit 31 is the
+ * first bit of the prefix.  This is a plain 8-byte value - pass it around and
+ * keep it in vectors by value, there's no reason to put one on the heap.
+ *
+ * The parser works directly on a pointer and length so nothing gets copied
+ * into a CString first, and it doesn't depend on any Windows calls.
+ */
 class Ip4Network {
 public:
-	Ip4Network(struct in_addr &, struct in_addr &);
+	constexpr Ip4Network() : address(0), mask(0) {}
+	constexpr Ip4Network(uint32_t address, uint32_t mask)
+		: address(address & mask), mask(mask) {}
+
+	// Parse x.x.x.x/n or x.x.x.x/y.y.y.y
+	template<typename CharT>
+	static constexpr bool parse(const CharT *text, size_t length, Ip4Network &network);
+
+	// Parse a separate address and dotted mask
+	template<typename CharT>
+	static constexpr bool parse(const CharT *address, size_t addressLength,
+		const CharT *mask, size_t maskLength, Ip4Network &network);
+
+	static bool parse(LPCTSTR text, Ip4Network &network) {
+		return parse(text, _tcslen(text), network);
+	}
+
+	// Build from an address and prefix length, as the IP helper API reports them
+	static constexpr Ip4Network fromPrefix(uint32_t address, int prefixLength) {
+		// Shifting a 32-bit value by 32 is undefined, so /0 gets special treatment
+		return Ip4Network(address,
+			(prefixLength <= 0) ? 0 : (0xFFFFFFFFU << (32 - ((prefixLength > 32) ? 32 : prefixLength))));
+	}
 
-	static shared_ptr<Ip4Network> Create(LPCTSTR);
-	static shared_ptr<Ip4Network> Create(LPCSTR, LPCSTR);
+	constexpr bool equals(const Ip4Network &b) const {
+		return (address == b.address) && (mask == b.mask);
+	}
 
-	bool equals(Ip4Network *);
-	bool includes(Ip4Network *);
+	// True if b is the same network or a smaller network inside this one
+	constexpr bool includes(const Ip4Network &b) const {
+		return ((mask & ~b.mask) == 0) && ((b.address & mask) == address);
+	}
 
-	CString toString();
+	constexpr uint32_t getAddress() const { return address; }
+	constexpr uint32_t getMask() const { return mask; }
+
+	// Number of leading one bits in the mask, and whether that's all of them
+	int getPrefixLength() const;
+	bool isContiguous() const;
+
+	CString toString() const;
 
 private:
-	struct in_addr address;
-	struct in_addr mask;
+	uint32_t address;
+	uint32_t mask;
+
+	template<typename CharT>
+	static constexpr bool parseAddress(const CharT *text, size_t length, uint32_t &value);
+
+	template<typename CharT>
+	static constexpr bool parseLength(const CharT *text, size_t length, int &value);
 };
 
+static_assert(sizeof(Ip4Network) == 8, "Ip4Network should be two words");
+static_assert(is_trivially_copyable<Ip4Network>::value, "Ip4Network should be a plain value");
+
+template<typename CharT>
+constexpr bool Ip4Network::parseAddress(const CharT *text, size_t length, uint32_t &value)
+{
+	uint32_t result = 0;
+	int octets = 0;
+
+	size_t pos = 0;
+	while (octets < 4) {
+		// Each octet is one to three digits, and all but the last end in a dot
+		unsigned int octet = 0;
+		int digits = 0;
+		while ((pos < length) && (text[pos] >= '0') && (text[pos] <= '9') && (digits < 3)) {
+			octet = (octet * 10) + (unsigned int)(text[pos] - '0');
+			digits++;
+			pos++;
+		}
+
+		if ((digits == 0) || (octet > 255)) {
+			return false;
+		}
+
+		result = (result << 8) | octet;
+		octets++;
+
+		if (octets < 4) {
+			if ((pos >= length) || (text[pos] != '.')) {
+				return false;
+			}
+			pos++;
+		}
+	}
+
+	if (pos != length) {
+		return false;
+	}
+
+	value = result;
+	return true;
+}
+
+template<typename CharT>
+constexpr bool Ip4Network::parseLength(const CharT *text, size_t length, int &value)
+{
+	if ((length == 0) || (length > 2)) {
+		return false;
+	}
+
+	int result = 0;
+	for (size_t pos = 0; pos < length; pos++) {
+		if ((text[pos] < '0') || (text[pos] > '9')) {
+			return false;
+		}
+		result = (result * 10) + (int)(text[pos] - '0');
+	}
+
+	if (result > 32) {
+		return false;
+	}
+
+	value = result;
+	return true;
+}
+
+template<typename CharT>
+constexpr bool Ip4Network::parse(const CharT *text, size_t length, Ip4Network &network)
+{
+	size_t split = 0;
+	while ((split < length) && (text[split] != '/')) {
+		split++;
+	}
+	if ((split == 0) || (split >= length)) {
+		return false;
+	}
+
+	const CharT *maskPart = text + split + 1;
+	size_t maskLength = length - split - 1;
+
+	bool dotted = false;
+	for (size_t pos = 0; pos < maskLength; pos++) {
+		if (maskPart[pos] == '.') {
+			dotted = true;
+		}
+	}
+
+	if (dotted) {
+		return parse(text, split, maskPart, maskLength, network);
+	}
+
+	uint32_t address = 0;
+	int prefixLength = 0;
+	if (!parseAddress(text, split, address) || !parseLength(maskPart, maskLength, prefixLength)) {
+		return false;
+	}
+
+	network = fromPrefix(address, prefixLength);
+	return true;
+}
+
+template<typename CharT>
+constexpr bool Ip4Network::parse(const CharT *address, size_t addressLength,
+	const CharT *mask, size_t maskLength, Ip4Network &network)
+{
+	uint32_t addressValue = 0;
+	uint32_t maskValue = 0;
+	if (!parseAddress(address, addressLength, addressValue) || !parseAddress(mask, maskLength, maskValue)) {
+		return false;
+	}
+
+	network = Ip4Network(addressValue, maskValue);
+	return true;
+}
+
+// The parser is constexpr, so these run on every build and need nothing from
+// Windows.  Lengths come from the array size, less the terminator.
+namespace Ip4NetworkChecks {
+	template<typename CharT, size_t N>
+	constexpr bool parses(const CharT (&text)[N], uint32_t address, uint32_t mask) {
+		Ip4Network network;
+		return Ip4Network::parse(text, N - 1, network) &&
+			(network.getAddress() == address) && (network.getMask() == mask);
+	}
+
+	template<typename CharT, size_t N>
+	constexpr bool rejects(const CharT (&text)[N]) {
+		Ip4Network network;
+		return !Ip4Network::parse(text, N - 1, network);
+	}
+}
+
+// CIDR, with host bits dropped
+static_assert(Ip4NetworkChecks::parses("10.0.0.0/8", 0x0A000000, 0xFF000000), "CIDR /8");
+static_assert(Ip4NetworkChecks::parses("192.168.1.77/24", 0xC0A80100, 0xFFFFFF00), "CIDR host bits");
+static_assert(Ip4NetworkChecks::parses("0.0.0.0/0", 0x00000000, 0x00000000), "CIDR /0");
+static_assert(Ip4NetworkChecks::parses("172.16.5.4/32", 0xAC100504, 0xFFFFFFFF), "CIDR /32");
+static_assert(Ip4NetworkChecks::parses(L"10.1.0.0/16", 0x0A010000, 0xFFFF0000), "CIDR wide");
+
+// Dotted masks, including ones that aren't contiguous
+static_assert(Ip4NetworkChecks::parses("172.16.0.0/255.240.0.0", 0xAC100000, 0xFFF00000), "dotted mask");
+static_assert(Ip4NetworkChecks::parses("10.9.5.1/255.0.255.0", 0x0A000500, 0xFF00FF00), "non-contiguous mask");
+
+// Malformed
+static_assert(Ip4NetworkChecks::rejects("10.0.0.0"), "no mask");
+static_assert(Ip4NetworkChecks::rejects("/8"), "no address");
+static_assert(Ip4NetworkChecks::rejects("10.0.0.0/"), "empty mask");
+static_assert(Ip4NetworkChecks::rejects("10.0.0/8"), "three octets");
+static_assert(Ip4NetworkChecks::rejects("10.0.0.0.0/8"), "five octets");
+static_assert(Ip4NetworkChecks::rejects("10..0.0/8"), "empty octet");
+static_assert(Ip4NetworkChecks::rejects("10.0.0.256/8"), "octet over 255");
+static_assert(Ip4NetworkChecks::rejects("1000.0.0.0/8"), "four digit octet");
+static_assert(Ip4NetworkChecks::rejects("10.0.0.0/33"), "prefix over 32");
+static_assert(Ip4NetworkChecks::rejects("10.0.0.0/8x"), "trailing garbage");
+static_assert(Ip4NetworkChecks::rejects("10.0.0.0/255.0.0"), "short dotted mask");
@@ -7,9 +7,14 @@
 
 #include "pch.h"
 #include "Log.h"
+#include "LogQueue.h"
+
+// How long a critical message waits to make it to the file
+#define CRITICAL_FLUSH_MILLISECONDS 2000
 
 CRITICAL_SECTION Log::sLock;
 HANDLE Log::fileLog;
+LogQueue *Log::queue= NULL;
 
 Log::Log()
 {
@@ -34,6 +39,23 @@ VOID Log::init(LPCTSTR logFile)
 			fileLog = ::GetStdHandle(STD_ERROR_HANDLE);
 		}
 	}
+
+	queue = new LogQueue();
+	if (!queue->start(fileLog)) {
+		delete queue;
+		queue = NULL;
+	}
+}
+
+VOID Log::shutdown()
+{
+	if (queue != NULL) {
+		LogQueue *stopping = queue;
+		queue = NULL;
+
+		stopping->stop();
+		delete stopping;
+	}
 }
 
 #define FORMAT_BUFFER_LEN 1024
@@ -151,9 +173,21 @@ VOID Log::log(const SLogInfo &sInfo, LPCTSTR format, ...)
 		CT2A logLine(line.GetBuffer(0));
 		line.ReleaseBuffer();
 
+		DWORD logLineLen= (DWORD)strlen(logLine);
+
+		// The writer thread does the actual write, so a slow disk doesn't
+		// hold up whoever is logging.
+		if (queue != NULL) {
+			uint64_t ticket;
+			if (queue->push(logLine, logLineLen, ticket) && (sInfo.eLevel == LL_CRITICAL)) {
+				// Probably on the way down, so make sure this one gets out
+				queue->flush(ticket, CRITICAL_FLUSH_MILLISECONDS);
+			}
+			return;
+		}
+
 		::EnterCriticalSection(&sLock);
 
-		DWORD logLineLen= (DWORD)strlen(logLine);
 		DWORD lBytesWritten = 0;
 		if (!WriteFile(fileLog, logLine, logLineLen, &lBytesWritten, NULL)) {
 			// Wut?
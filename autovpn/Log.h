@@ -29,6 +29,8 @@ typedef struct SLogInfo {
 #define LOG_INFO     SLogInfo{ LL_INFO,     _T(__FILE__), _T(__FUNCTION__), __LINE__, 0 }
 #define LOG_DEBUG    SLogInfo{ LL_DEBUG,    _T(__FILE__), _T(__FUNCTION__), __LINE__, 0 }
 
+class LogQueue;
+
 class Log
 {
 public:
@@ -37,9 +39,16 @@ public:
 
 	static VOID init(LPCTSTR logfile);
 
+	// Writes out anything still queued.  Nothing else can be logging by then.
+	static VOID shutdown();
+
 	static VOID log(const SLogInfo &, LPCTSTR, ...);
 
 protected:
 	static CRITICAL_SECTION sLock;
 	static HANDLE fileLog;
+
+	// Lines go through here once it's running, and are written directly
+	// before init() and after shutdown().
+	static LogQueue *queue;
 };
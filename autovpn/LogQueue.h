@@ -0,0 +1,286 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+ * Hands finished log lines to a writer thread, so nobody logging ever waits
+ * on the disk - or on whatever is scanning the log file.  Shared by the
+ * service and the user interface.
+ *
+ * The queue is a fixed ring of fixed-size records.  Each record carries a
+ * sequence number that says whether it's free for the lap a producer is on or
+ * filled for the lap the writer is on, so producers claim a slot with one
+ * compare-exchange and never take a lock.  There's only ever the one writer.
+ * If the ring is full the line is dropped and counted, and the writer puts a
+ * line in the log saying how many went missing.
+ *
+ * The writer collects whatever is waiting into one buffer and writes it with
+ * a single WriteFile, so a burst costs one write instead of one per line.
+ */
+
+// Must be a power of two
+#define LOG_QUEUE_RECORDS		256
+
+// Longest line kept, including the CRLF - anything longer is cut off
+#define LOG_RECORD_SIZE			2048
+
+// Lines are gathered up to this much before each write
+#define LOG_BATCH_SIZE			(64 * 1024)
+
+// The writer checks in this often even if nobody wakes it
+#define LOG_IDLE_MILLISECONDS	1000
+
+class LogQueue {
+public:
+	LogQueue() {
+		records = new Record[LOG_QUEUE_RECORDS];
+		for (uint64_t i = 0; i < LOG_QUEUE_RECORDS; i++) {
+			records[i].sequence.store(i, std::memory_order_relaxed);
+			records[i].length = 0;
+		}
+
+		enqueuePos = 0;
+		dequeuePos = 0;
+		writtenPos = 0;
+		dropped = 0;
+		reportedDropped = 0;
+		writerWaiting = false;
+
+		file = INVALID_HANDLE_VALUE;
+		wake = NULL;
+		writer = NULL;
+		run = false;
+	}
+
+	~LogQueue() {
+		stop();
+		delete[] records;
+	}
+
+	// The file stays open and belongs to the caller
+	bool start(HANDLE file) {
+		this->file = file;
+		batch.reserve(LOG_BATCH_SIZE);
+
+		wake = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (wake == NULL) {
+			return false;
+		}
+
+		run = true;
+		writer = ::CreateThread(NULL, 0, &LogQueue::writerThread, this, 0, NULL);
+		if (writer == NULL) {
+			run = false;
+			::CloseHandle(wake);
+			wake = NULL;
+			return false;
+		}
+
+		return true;
+	}
+
+	// Writes out whatever is waiting and stops the writer
+	void stop() {
+		if (writer == NULL) {
+			return;
+		}
+
+		run = false;
+		::SetEvent(wake);
+		::WaitForSingleObject(writer, INFINITE);
+
+		::CloseHandle(writer);
+		writer = NULL;
+		::CloseHandle(wake);
+		wake = NULL;
+	}
+
+	bool isRunning() const {
+		return writer != NULL;
+	}
+
+	// Copies the line into the ring.  Never blocks - if the ring is full the
+	// line is counted as dropped and false comes back.  Ticket is where the
+	// line went, for flush().
+	bool push(const char *line, size_t length, uint64_t& ticket) {
+		if (length > LOG_RECORD_SIZE) {
+			length = LOG_RECORD_SIZE;
+		}
+
+		uint64_t pos = enqueuePos.load(std::memory_order_relaxed);
+		Record *record;
+		for (;;) {
+			record = &records[pos & (LOG_QUEUE_RECORDS - 1)];
+			uint64_t sequence = record->sequence.load(std::memory_order_acquire);
+			int64_t lap = (int64_t)(sequence - pos);
+
+			if (lap == 0) {
+				// Free for this lap, if nobody beats us to it
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (lap < 0) {
+				// The writer hasn't gotten to it on the last lap, so we're full
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			} else {
+				// Somebody else took it
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+
+		memcpy(record->text, line, length);
+		if ((length == LOG_RECORD_SIZE) && (length >= 2)) {
+			record->text[length - 2] = '\r';
+			record->text[length - 1] = '\n';
+		}
+		record->length = (uint32_t)length;
+
+		// Both of these are sequentially consistent, which pairs with the
+		// writer setting its flag and then checking the record, so either we
+		// see it waiting or it sees the line.
+		record->sequence.store(pos + 1);
+		if (writerWaiting.load()) {
+			::SetEvent(wake);
+		}
+
+		ticket = pos + 1;
+		return true;
+	}
+
+	// Waits a while for everything up to the ticket to hit the file, for
+	// messages that matter too much to lose if the process goes down.
+	void flush(uint64_t ticket, DWORD timeoutMs) {
+		ULONGLONG start = ::GetTickCount64();
+		while (writtenPos.load() < ticket) {
+			if ((::GetTickCount64() - start) >= timeoutMs) {
+				break;
+			}
+			::SetEvent(wake);
+			::Sleep(1);
+		}
+	}
+
+	uint64_t getDropped() const {
+		return dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Record {
+		std::atomic<uint64_t> sequence;
+		uint32_t length;
+		char text[LOG_RECORD_SIZE];
+	};
+
+	Record *records;
+	std::atomic<uint64_t> enqueuePos;
+	std::atomic<uint64_t> dropped;
+
+	// Only the writer thread touches these
+	uint64_t dequeuePos;
+	uint64_t reportedDropped;
+	std::vector<char> batch;
+
+	std::atomic<uint64_t> writtenPos;
+	std::atomic<bool> writerWaiting;
+
+	HANDLE file;
+	HANDLE wake;
+	HANDLE writer;
+	volatile bool run;
+
+	static DWORD WINAPI writerThread(LPVOID context) {
+		((LogQueue *)context)->writeLoop();
+		return 0;
+	}
+
+	// Takes one line off the ring if there is one
+	bool take() {
+		Record& record = records[dequeuePos & (LOG_QUEUE_RECORDS - 1)];
+		if (record.sequence.load() != (dequeuePos + 1)) {
+			return false;
+		}
+
+		if ((batch.size() + record.length) > LOG_BATCH_SIZE) {
+			writeBatch();
+		}
+		batch.insert(batch.end(), record.text, record.text + record.length);
+
+		// Free for the producers' next lap
+		record.sequence.store(dequeuePos + LOG_QUEUE_RECORDS, std::memory_order_release);
+		dequeuePos++;
+		return true;
+	}
+
+	void writeBatch() {
+		if (batch.empty()) {
+			return;
+		}
+
+		DWORD written = 0;
+		if (!::WriteFile(file, batch.data(), (DWORD)batch.size(), &written, NULL)) {
+			// Wut?
+			fprintf(stderr, "Error writing to log file!\r\n");
+		}
+		batch.clear();
+	}
+
+	void reportDropped() {
+		uint64_t total = dropped.load(std::memory_order_relaxed);
+		if (total == reportedDropped) {
+			return;
+		}
+
+		SYSTEMTIME now;
+		::GetLocalTime(&now);
+
+		char line[128];
+		int length = sprintf_s(line, sizeof(line),
+			"%04d-%02d-%02d %02d:%02d:%02d [WARNING] Log queue was full, dropped %llu messages\r\n",
+			now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond,
+			(unsigned long long)(total - reportedDropped));
+		reportedDropped = total;
+
+		if (length > 0) {
+			batch.insert(batch.end(), line, line + length);
+		}
+	}
+
+	void writeLoop() {
+		for (;;) {
+			while (take()) {
+			}
+
+			reportDropped();
+			writeBatch();
+			writtenPos.store(dequeuePos);
+
+			if (!run) {
+				// Anything pushed after this is too late to matter
+				if (!take()) {
+					break;
+				}
+				continue;
+			}
+
+			writerWaiting.store(true);
+			if (records[dequeuePos & (LOG_QUEUE_RECORDS - 1)].sequence.load() != (dequeuePos + 1)) {
+				::WaitForSingleObject(wake, LOG_IDLE_MILLISECONDS);
+			}
+			writerWaiting.store(false);
+		}
+
+		writeBatch();
+		writtenPos.store(dequeuePos);
+	}
+};
@@ -37,6 +37,8 @@
 
 #define AV_MESSAGE_STATUS			0x01
 #define AV_MESSAGE_SUGGESTION		0x02
+#define AV_MESSAGE_PROBE_STATS_REQUEST	0x03	// Client to service, no body
+#define AV_MESSAGE_PROBE_STATS		0x04	// One per URL in reply
 
 typedef struct _AutoVPNHeader {
 	unsigned char version;
@@ -62,4 +64,26 @@ typedef struct _AutoVPNStatus {
 	unsigned long txRate;
 } AutoVPNStatus;
 
+/*
+ * Timing histograms for the diagnostic probes, one message per URL.  The
+ * bucket upper limits in milliseconds are 10, 25, 50, 100, 250, 500, 1000,
+ * 2500 and 5000, and the last bucket is everything over that.  A phase that
+ * didn't happen on a probe - like TLS on plain HTTP - isn't counted.
+ */
+#define AV_PROBE_PHASE_DNS			0
+#define AV_PROBE_PHASE_CONNECT		1
+#define AV_PROBE_PHASE_TLS			2
+#define AV_PROBE_PHASE_FIRST_BYTE	3
+#define AV_PROBE_PHASE_TOTAL		4
+#define AV_PROBE_PHASES				5
+
+#define AV_PROBE_BUCKETS			10
+
+typedef struct _AutoVPNProbeStats {
+	wchar_t url[256];
+	unsigned long probes;
+	unsigned long failures;
+	unsigned long buckets[AV_PROBE_PHASES][AV_PROBE_BUCKETS];
+} AutoVPNProbeStats;
+
 #pragma pack(pop, autovpn)
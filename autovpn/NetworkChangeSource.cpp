@@ -0,0 +1,107 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "Controller.h"
+#include "NetworkChangeSource.h"
+
+NetworkChangeSource::NetworkChangeSource(Controller *controller)
+{
+	this->controller = controller;
+
+	interfaceNotify = NULL;
+	addressNotify = NULL;
+	routeNotify = NULL;
+}
+
+NetworkChangeSource::~NetworkChangeSource()
+{
+	stop();
+}
+
+bool NetworkChangeSource::start()
+{
+	bool rval = true;
+
+	// We only make decisions on IPv4, so don't get woken up for every IPv6
+	// privacy address rotation.
+	DWORD status = NotifyIpInterfaceChange(AF_INET,
+		interfaceCallback, this, FALSE, &interfaceNotify);
+	if (status != NO_ERROR) {
+		Log::log(LOG_ERROR,
+			_T("Unable to register for interface changes: 0x%08X"), status);
+		interfaceNotify = NULL;
+		rval = false;
+	}
+
+	status = NotifyUnicastIpAddressChange(AF_INET,
+		addressCallback, this, FALSE, &addressNotify);
+	if (status != NO_ERROR) {
+		Log::log(LOG_ERROR,
+			_T("Unable to register for address changes: 0x%08X"), status);
+		addressNotify = NULL;
+		rval = false;
+	}
+
+	status = NotifyRouteChange2(AF_INET,
+		routeCallback, this, FALSE, &routeNotify);
+	if (status != NO_ERROR) {
+		Log::log(LOG_ERROR,
+			_T("Unable to register for route changes: 0x%08X"), status);
+		routeNotify = NULL;
+		rval = false;
+	}
+
+	return rval;
+}
+
+void NetworkChangeSource::stop()
+{
+	// CancelMibChangeNotify2 waits for any callback in progress to finish, so
+	// once this returns nothing is going to touch the controller.
+	if (interfaceNotify != NULL) {
+		CancelMibChangeNotify2(interfaceNotify);
+		interfaceNotify = NULL;
+	}
+	if (addressNotify != NULL) {
+		CancelMibChangeNotify2(addressNotify);
+		addressNotify = NULL;
+	}
+	if (routeNotify != NULL) {
+		CancelMibChangeNotify2(routeNotify);
+		routeNotify = NULL;
+	}
+}
+
+void NetworkChangeSource::onChange(LPCTSTR what, MIB_NOTIFICATION_TYPE type)
+{
+	// These come in on a system thread pool thread, so don't do anything
+	// here except poke the controller.
+	if (type != MibInitialNotification) {
+		Log::log(LOG_DEBUG, _T("Network %s change type %d"), what, type);
+		controller->networkChanged();
+	}
+}
+
+VOID NETIOAPI_API_ NetworkChangeSource::interfaceCallback(
+	PVOID context, PMIB_IPINTERFACE_ROW, MIB_NOTIFICATION_TYPE type)
+{
+	((NetworkChangeSource *)context)->onChange(_T("interface"), type);
+}
+
+VOID NETIOAPI_API_ NetworkChangeSource::addressCallback(
+	PVOID context, PMIB_UNICASTIPADDRESS_ROW, MIB_NOTIFICATION_TYPE type)
+{
+	((NetworkChangeSource *)context)->onChange(_T("address"), type);
+}
+
+VOID NETIOAPI_API_ NetworkChangeSource::routeCallback(
+	PVOID context, PMIB_IPFORWARD_ROW2, MIB_NOTIFICATION_TYPE type)
+{
+	((NetworkChangeSource *)context)->onChange(_T("route"), type);
+}
@@ -0,0 +1,38 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+class Controller;
+
+/*
+ * This hooks the IP helper change notifications so the controller gets woken
+ * up as soon as an interface, address, or route changes instead of finding
+ * out on the next timed cycle.
+ */
+class NetworkChangeSource
+{
+public:
+	NetworkChangeSource(Controller *);
+	virtual ~NetworkChangeSource();
+
+	bool start();
+	void stop();
+
+private:
+	Controller *controller;
+
+	HANDLE interfaceNotify;
+	HANDLE addressNotify;
+	HANDLE routeNotify;
+
+	void onChange(LPCTSTR what, MIB_NOTIFICATION_TYPE type);
+
+	static VOID NETIOAPI_API_ interfaceCallback(PVOID, PMIB_IPINTERFACE_ROW, MIB_NOTIFICATION_TYPE);
+	static VOID NETIOAPI_API_ addressCallback(PVOID, PMIB_UNICASTIPADDRESS_ROW, MIB_NOTIFICATION_TYPE);
+	static VOID NETIOAPI_API_ routeCallback(PVOID, PMIB_IPFORWARD_ROW2, MIB_NOTIFICATION_TYPE);
+};
@@ -0,0 +1,84 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Ip4Network.h"
+#include "NetworkTrie.h"
+
+NetworkTrie::NetworkTrie()
+{
+	Node root = { { 0, 0 }, false };
+	nodes.push_back(root);
+
+	count = 0;
+}
+
+void NetworkTrie::add(const Ip4Network &network)
+{
+	count++;
+
+	if (!network.isContiguous()) {
+		irregular.push_back(network);
+		return;
+	}
+
+	uint32_t address = network.getAddress();
+	int length = network.getPrefixLength();
+
+	unsigned int node = 0;
+	for (int depth = 0; depth < length; depth++) {
+		// If a shorter prefix already covers this one there's nothing to add
+		if (nodes[node].terminal) {
+			return;
+		}
+
+		int bit = (address >> (31 - depth)) & 1;
+		if (nodes[node].child[bit] == 0) {
+			Node child = { { 0, 0 }, false };
+			nodes.push_back(child);
+
+			// Careful - push_back can move the vector, so index again
+			nodes[node].child[bit] = (unsigned int)(nodes.size() - 1);
+		}
+		node = nodes[node].child[bit];
+	}
+
+	nodes[node].terminal = true;
+}
+
+bool NetworkTrie::includes(const Ip4Network &network) const
+{
+	// An internal prefix of length N can only include the attached network if
+	// the attached mask has at least N leading ones, so that's as deep as we go.
+	uint32_t address = network.getAddress();
+	int length = network.getPrefixLength();
+
+	unsigned int node = 0;
+	if (nodes[node].terminal) {
+		return true;
+	}
+
+	for (int depth = 0; depth < length; depth++) {
+		int bit = (address >> (31 - depth)) & 1;
+
+		node = nodes[node].child[bit];
+		if (node == 0) {
+			break;
+		}
+		if (nodes[node].terminal) {
+			return true;
+		}
+	}
+
+	for (const Ip4Network& candidate : irregular) {
+		if (candidate.includes(network)) {
+			return true;
+		}
+	}
+
+	return false;
+}
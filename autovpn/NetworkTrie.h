@@ -0,0 +1,49 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include "Ip4Network.h"
+
+/*
+ * A binary trie of IPv4 prefixes, used to answer "is this attached network
+ * inside any of the internal networks" without comparing against every entry.
+ * A lookup walks at most one node per bit of the attached prefix.
+ *
+ * The nodes live in one vector and point at each other by index, so the whole
+ * thing is a single allocation that's friendly to the cache.  This gets built
+ * once per settings load and never changes afterwards.
+ */
+class NetworkTrie
+{
+public:
+	NetworkTrie();
+
+	void add(const Ip4Network &);
+
+	// True if any network that was added includes the given one
+	bool includes(const Ip4Network &) const;
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+private:
+	struct Node {
+		// Index of the child for a 0 or 1 bit.  Zero means no child, which is
+		// safe because the root is never anybody's child.
+		unsigned int child[2];
+		bool terminal;
+	};
+
+	vector<Node> nodes;
+
+	// Someone could write a mask like 255.0.255.0 that can't live in a trie.
+	// Those are rare enough that checking them one by one is fine.
+	vector<Ip4Network> irregular;
+
+	size_t count;
+};
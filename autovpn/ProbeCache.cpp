@@ -0,0 +1,69 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "ProbeCache.h"
+
+ProbeCache::ProbeCache()
+{
+}
+
+ProbeCache::~ProbeCache()
+{
+}
+
+bool ProbeCache::get(uint64_t fingerprint, const CString& url, const CString& expected, HttpProbe::Status& status)
+{
+	unique_lock<mutex> permit(lock);
+
+	auto found = entries.find(make_tuple(fingerprint, url, expected));
+	if (found == entries.end()) {
+		return false;
+	}
+
+	if (GetTickCount64() >= found->second.expires) {
+		entries.erase(found);
+		return false;
+	}
+
+	status = found->second.status;
+	return true;
+}
+
+void ProbeCache::put(uint64_t fingerprint, const CString& url, const CString& expected,
+	HttpProbe::Status status, int ttlSeconds)
+{
+	// A cancelled probe didn't find anything out
+	if ((ttlSeconds <= 0) || (status == HttpProbe::Status::CANCELLED)) {
+		return;
+	}
+
+	ULONGLONG now = GetTickCount64();
+
+	unique_lock<mutex> permit(lock);
+
+	// There are only ever a handful of these, so just sweep out the old ones
+	// here instead of keeping a timer.
+	for (auto i = entries.begin(); i != entries.end(); ) {
+		if (now >= i->second.expires) {
+			i = entries.erase(i);
+		} else {
+			i++;
+		}
+	}
+
+	Entry& entry = entries[make_tuple(fingerprint, url, expected)];
+	entry.status = status;
+	entry.expires = now + ((ULONGLONG)ttlSeconds * 1000);
+}
+
+void ProbeCache::clear()
+{
+	unique_lock<mutex> permit(lock);
+	entries.clear();
+}
@@ -0,0 +1,41 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include "HttpProbe.h"
+
+/*
+ * Remembers probe results for a while, keyed by a fingerprint of the network
+ * we're on and the URL.  While the VPN can't connect the diagnostics would
+ * otherwise hit the same URLs every few seconds with the same answer.
+ */
+class ProbeCache
+{
+public:
+	ProbeCache();
+	virtual ~ProbeCache();
+
+	// Find an unexpired result for this URL and content on this network
+	bool get(uint64_t fingerprint, const CString& url, const CString& expected, HttpProbe::Status& status);
+
+	void put(uint64_t fingerprint, const CString& url, const CString& expected,
+		HttpProbe::Status status, int ttlSeconds);
+
+	// Throw everything away, because the network changed
+	void clear();
+
+private:
+	struct Entry {
+		HttpProbe::Status status;
+		ULONGLONG expires;
+	};
+
+	mutex lock;
+	// The expected content is part of the key since it decides what the status means
+	map<tuple<uint64_t, CString, CString>, Entry> entries;
+};
@@ -0,0 +1,221 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "ProbeRace.h"
+#include "Cancellation.h"
+#include "WorkPool.h"
+
+// How long to give an endpoint before starting the next one alongside it.  A
+// healthy endpoint answers well inside this, so normally only one request
+// goes out.
+#define STAGGER_MILLISECONDS 250
+
+struct ProbeRace::Entrant {
+	Entrant(const CString& url, DWORD timeoutMs) : url(url), cancellation(timeoutMs) {
+		started = false;
+		finished = false;
+		status = HttpProbe::Status::UNKNOWN;
+	}
+
+	CString url;
+	Cancellation cancellation;
+
+	bool started;
+	bool finished;
+	HttpProbe::Status status;
+};
+
+ProbeRace::ProbeRace(WorkPool *pool)
+{
+	this->pool = pool;
+}
+
+ProbeRace::~ProbeRace()
+{
+}
+
+int ProbeRace::rank(HttpProbe::Status status)
+{
+	switch (status) {
+	case HttpProbe::Status::ERR_WRONG_CONTENT:
+		return 5;
+	case HttpProbe::Status::ERR_SECURITY_FAILED:
+		return 4;
+	case HttpProbe::Status::ERR_CONNECTION_FAILED:
+		return 3;
+	case HttpProbe::Status::ERR_DNS_FAILED:
+		return 2;
+	case HttpProbe::Status::ERR_UNKNOWN:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+HttpProbe::Status ProbeRace::race(const vector<CString>& urls, Cancellation *cancellation,
+	DWORD timeoutMs, const Probe& probe)
+{
+	if (urls.empty()) {
+		return HttpProbe::Status::UNKNOWN;
+	} else if (urls.size() == 1) {
+		// Nothing to race
+		return probe(urls.front(), cancellation);
+	}
+
+	DWORD timeout = (cancellation != NULL) ? cancellation->getRemaining() : timeoutMs;
+	if (timeout == 0) {
+		return HttpProbe::Status::CANCELLED;
+	}
+
+	// Each entrant has its own token, so the winner can cancel the others
+	// without touching the caller's.
+	vector<unique_ptr<Entrant>> entrants;
+	for (const CString& url : urls) {
+		entrants.push_back(make_unique<Entrant>(url, timeout));
+	}
+
+	mutex lock;
+	HANDLE changedEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	Cancellation deadline(timeout);
+
+	// The same handle can't be in the list twice
+	HANDLE events[3];
+	DWORD eventCount = 0;
+	events[eventCount++] = changedEvent;
+	events[eventCount++] = deadline.getEvent();
+	if (cancellation != NULL) {
+		events[eventCount++] = cancellation->getEvent();
+	}
+
+	HttpProbe::Status result = HttpProbe::Status::CANCELLED;
+	int winner = -1;
+	bool decided = false;
+
+	size_t next = 0;
+	ULONGLONG nextStart = GetTickCount64();
+
+	for (;;) {
+		bool startNext = false;
+		{
+			unique_lock<mutex> permit(lock);
+
+			int running = 0;
+			int finished = 0;
+			for (size_t i = 0; i < entrants.size(); i++) {
+				const Entrant& entrant = *entrants[i];
+				if (entrant.finished) {
+					finished++;
+					if (entrant.status == HttpProbe::Status::SUCCESS) {
+						winner = (int)i;
+					}
+				} else if (entrant.started) {
+					running++;
+				}
+			}
+
+			if (winner >= 0) {
+				result = HttpProbe::Status::SUCCESS;
+				decided = true;
+			} else if (finished == (int)entrants.size()) {
+				decided = true;
+			}
+
+			if (decided) {
+				break;
+			}
+
+			// Don't sit out the stagger if everything started so far has failed
+			if (next < entrants.size()) {
+				startNext = (running == 0) || (GetTickCount64() >= nextStart);
+			}
+		}
+
+		if (startNext) {
+			Entrant *entrant = entrants[next++].get();
+			{
+				unique_lock<mutex> permit(lock);
+				entrant->started = true;
+			}
+
+			pool->submit([&lock, &probe, changedEvent, entrant] {
+				HttpProbe::Status status = probe(entrant->url, &entrant->cancellation);
+
+				unique_lock<mutex> permit(lock);
+				entrant->status = status;
+				entrant->finished = true;
+				SetEvent(changedEvent);
+			});
+
+			nextStart = GetTickCount64() + STAGGER_MILLISECONDS;
+			continue;
+		}
+
+		DWORD waitMs = deadline.getRemaining();
+		if (next < entrants.size()) {
+			ULONGLONG now = GetTickCount64();
+			waitMs = min(waitMs, (now < nextStart) ? (DWORD)(nextStart - now) : 0);
+		}
+
+		if (WaitForMultipleObjects(eventCount, events, FALSE, waitMs) != WAIT_OBJECT_0) {
+			if (deadline.isCancelled() ||
+				((cancellation != NULL) && cancellation->isCancelled())) {
+				break;
+			}
+		}
+	}
+
+	// Call off whoever is left, and wait for them since they reference our stack
+	for (unique_ptr<Entrant>& entrant : entrants) {
+		entrant->cancellation.cancel();
+	}
+
+	for (;;) {
+		{
+			unique_lock<mutex> permit(lock);
+
+			bool running = false;
+			for (unique_ptr<Entrant>& entrant : entrants) {
+				if (entrant->started && !entrant->finished) {
+					running = true;
+				}
+			}
+			if (!running) {
+				break;
+			}
+		}
+		WaitForSingleObject(changedEvent, INFINITE);
+	}
+
+	CloseHandle(changedEvent);
+
+	if ((cancellation != NULL) && cancellation->isCancelled() && (winner < 0)) {
+		return HttpProbe::Status::CANCELLED;
+	}
+
+	// Whoever lost to a working endpoint is most likely down on their own
+	for (size_t i = 0; i < entrants.size(); i++) {
+		const Entrant& entrant = *entrants[i];
+
+		if (winner >= 0) {
+			if (entrant.finished && (rank(entrant.status) > 0)) {
+				Log::log(LOG_WARNING,
+					_T("Probe endpoint %s failed while %s worked, it may be down"),
+					(LPCTSTR)entrant.url, (LPCTSTR)entrants[winner]->url);
+			}
+		} else if (entrant.finished && (rank(entrant.status) > rank(result))) {
+			result = entrant.status;
+		}
+	}
+
+	if (!decided && (winner < 0)) {
+		Log::log(LOG_WARNING, _T("Probe race ran out of time, using partial results"));
+	}
+
+	return result;
+}
@@ -0,0 +1,47 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include "HttpProbe.h"
+
+class Cancellation;
+class WorkPool;
+
+/*
+ * Runs the same check against several endpoints, happy eyeballs style.  The
+ * first endpoint starts right away, and each one after it starts when the
+ * ones before it have all failed or after a short stagger, whichever comes
+ * first.  A success from any endpoint ends the race and the rest are
+ * cancelled.
+ *
+ * A failure only counts once every endpoint has failed, so one endpoint being
+ * down doesn't look like a broken network.  When they all fail, the answer is
+ * the failure that says the most about the network - see rank().
+ */
+class ProbeRace {
+public:
+	// Checks one endpoint, giving up when the cancellation fires
+	typedef function<HttpProbe::Status(const CString& url, Cancellation *cancellation)> Probe;
+
+	ProbeRace(WorkPool *pool);
+	virtual ~ProbeRace();
+
+	// If no cancellation is passed the race is limited to timeoutMs
+	HttpProbe::Status race(const vector<CString>& urls, Cancellation *cancellation,
+		DWORD timeoutMs, const Probe& probe);
+
+	// Higher means the failure got further, and so tells us more.  Content that
+	// doesn't match means something answered in the endpoint's place, which is
+	// a stronger finding than a name that didn't resolve.
+	static int rank(HttpProbe::Status status);
+
+private:
+	WorkPool *pool;
+
+	struct Entrant;
+};
@@ -0,0 +1,94 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "ProbeStats.h"
+
+// Upper limits in milliseconds, which have to match the comment in Message.h
+static const long bucketLimits[AV_PROBE_BUCKETS - 1] = {
+	10, 25, 50, 100, 250, 500, 1000, 2500, 5000
+};
+
+// The URLs come from policy so there shouldn't be many, but don't let a
+// misbehaving setup grow this forever.
+#define MAX_URLS 32
+
+ProbeStats::ProbeStats()
+{
+}
+
+ProbeStats::~ProbeStats()
+{
+}
+
+void ProbeStats::add(UrlStats& stats, int phase, long micros)
+{
+	if (micros < 0) {
+		return;
+	}
+
+	long millis = micros / 1000;
+
+	int bucket = 0;
+	while ((bucket < (AV_PROBE_BUCKETS - 1)) && (millis >= bucketLimits[bucket])) {
+		bucket++;
+	}
+
+	stats.buckets[phase][bucket]++;
+}
+
+void ProbeStats::record(const CString& url, HttpProbe::Status status, const HttpProbe::Timing& timing)
+{
+	// A cancelled probe would only tell us how long it took to give up
+	if (status == HttpProbe::Status::CANCELLED) {
+		return;
+	}
+
+	unique_lock<mutex> permit(lock);
+
+	auto found = urls.find(url);
+	if (found == urls.end()) {
+		if (urls.size() >= MAX_URLS) {
+			return;
+		}
+
+		UrlStats empty;
+		ZeroMemory(&empty, sizeof(empty));
+		found = urls.insert(make_pair(url, empty)).first;
+	}
+
+	UrlStats& stats = found->second;
+
+	stats.probes++;
+	if (status != HttpProbe::Status::SUCCESS) {
+		stats.failures++;
+	}
+
+	add(stats, AV_PROBE_PHASE_DNS, timing.dns);
+	add(stats, AV_PROBE_PHASE_CONNECT, timing.connect);
+	add(stats, AV_PROBE_PHASE_TLS, timing.tls);
+	add(stats, AV_PROBE_PHASE_FIRST_BYTE, timing.firstByte);
+	add(stats, AV_PROBE_PHASE_TOTAL, timing.total);
+}
+
+void ProbeStats::getStats(list<AutoVPNProbeStats>& stats)
+{
+	unique_lock<mutex> permit(lock);
+
+	for (auto& entry : urls) {
+		AutoVPNProbeStats message;
+		ZeroMemory(&message, sizeof(message));
+
+		wcsncpy_s(message.url, entry.first, _TRUNCATE);
+		message.probes = entry.second.probes;
+		message.failures = entry.second.failures;
+		CopyMemory(message.buckets, entry.second.buckets, sizeof(message.buckets));
+
+		stats.push_back(message);
+	}
+}
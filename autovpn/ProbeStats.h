@@ -0,0 +1,40 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include "Message.h"
+#include "HttpProbe.h"
+
+/*
+ * Per-URL histograms of how long each phase of a probe took, so when somebody
+ * says the VPN is slow we can tell whether it's DNS, the connection, TLS or
+ * the server.  These can be read by the UI over the pipe.
+ */
+class ProbeStats
+{
+public:
+	ProbeStats();
+	virtual ~ProbeStats();
+
+	void record(const CString& url, HttpProbe::Status status, const HttpProbe::Timing& timing);
+
+	// Copy out in wire format, one entry per URL
+	void getStats(list<AutoVPNProbeStats>& stats);
+
+private:
+	struct UrlStats {
+		unsigned long probes;
+		unsigned long failures;
+		unsigned long buckets[AV_PROBE_PHASES][AV_PROBE_BUCKETS];
+	};
+
+	mutex lock;
+	map<CString, UrlStats> urls;
+
+	static void add(UrlStats& stats, int phase, long micros);
+};
@@ -0,0 +1,369 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * Version 2 of the pipe protocol between the service and the user interface.
+ *
+ * The version 1 messages in Message.h are raw structs, which ties both ends to
+ * the same struct layout and a 16-bit length.  Version 2 is a frame holding a
+ * run of records, with every field written out explicitly little-endian:
+ *
+ *   frame    'A' 'V' version:u8 flags:u8 length:u32, then length bytes of records
+ *   record   type:u16 flags:u16 length:u32, then length bytes of value
+ *
+ * Some record values are themselves a run of records, called fields here, so
+ * a reader skips anything it doesn't know and new fields don't break old
+ * readers.  One frame can carry several records, so status, suggestion and
+ * whatever else go out in a single pipe write.  Readers work directly on the
+ * receive buffer and never copy a record out.
+ *
+ * A client asks for version 2 by sending the usual 8-byte hello followed by
+ * the highest version it speaks as a u16 and a u16 of hello flags.  The service
+ * answers with a HELLO record holding the version it picked.  A bare 8-byte
+ * hello is a version 1 client, which keeps getting Message.h structs.
+ *
+ * A client that follows the shared status page in StatusPage.h sets
+ * PAGE_STATUS, and then never gets STATUS, STATUS_DELTA or SUGGESTION on its
+ * own - the pipe is only for queries and commands.
+ *
+ * Status goes out in full once when a client subscribes, and after that only
+ * as a STATUS_DELTA holding the fields that changed.  Both carry the service's
+ * status generation, and a delta also carries the generation it was built on,
+ * so a client that finds it doesn't match what it has sends RESYNC and gets a
+ * full STATUS and SUGGESTION back.
+ *
+ * A client can also send a QUERY at any time, tagged with a request ID of its
+ * choosing.  The RESPONSE echoes the ID and the query, holds a result code, and
+ * then the answer as nested records - STATUS and SUGGESTION, DIAGNOSTIC, one
+ * TRANSITION per state change oldest first, or COUNTERS.  Responses come from
+ * snapshots the service keeps anyway, so asking never holds up the service.
+ *
+ * RECHECK and RUN_DIAGNOSTICS are commands from the user.  The service answers
+ * each with a COMMAND_RESULT, and anything that changes comes back as the
+ * usual STATUS_DELTA.  Each logon session can only ask so often,
+ * however many times it reconnects.
+ */
+
+#define AVP_VERSION					2
+
+#define AVP_HELLO_BYTES				{ 0x43, 0x81, 0xa9, 0x17, 0xee, 0xf2, 0x01, 0x92 }
+#define AVP_HELLO_SIZE				8
+#define AVP_EXTENDED_HELLO_SIZE		12
+
+// Hello flags
+#define AVP_HELLO_FLAG_PAGE_STATUS	0x0001	// Status comes from the status page, don't send it
+
+#define AVP_FRAME_HEADER_SIZE		8
+#define AVP_RECORD_HEADER_SIZE		8
+
+// Nothing we send comes anywhere close, so anything bigger is garbage
+#define AVP_MAX_FRAME_SIZE			(1024 * 1024)
+
+// Records
+#define AVP_RECORD_HELLO				0x0001	// Fields: VERSION
+#define AVP_RECORD_STATUS				0x0010	// Fields: STATE through GENERATION
+#define AVP_RECORD_SUGGESTION			0x0011	// UTF-16LE text, no terminator, empty to clear
+#define AVP_RECORD_STATUS_DELTA			0x0012	// Fields: GENERATION, BASE_GENERATION, whatever changed
+#define AVP_RECORD_RESYNC				0x0013	// Client to service, no value
+#define AVP_RECORD_PROBE_STATS_REQUEST	0x0020	// Client to service, no value
+#define AVP_RECORD_PROBE_STATS			0x0021	// One per URL, fields: URL through BUCKETS
+#define AVP_RECORD_QUERY				0x0030	// Client to service, fields: REQUEST_ID, QUERY
+#define AVP_RECORD_RESPONSE				0x0031	// Fields: REQUEST_ID, QUERY, RESULT, then the answer
+#define AVP_RECORD_DIAGNOSTIC			0x0032	// Fields: RESULT_STATE through TIMED_OUT
+#define AVP_RECORD_TRANSITION			0x0033	// Fields: TRANSITION_AGE through TO_STATE
+#define AVP_RECORD_COUNTERS				0x0034	// Fields: UPTIME through ENABLE_AVG_LATENCY
+#define AVP_RECORD_RECHECK				0x0040	// Client to service, no value
+#define AVP_RECORD_RUN_DIAGNOSTICS		0x0041	// Client to service, no value
+#define AVP_RECORD_COMMAND_RESULT		0x0042	// Fields: COMMAND, RESULT
+
+// Queries
+#define AVP_QUERY_STATUS				0x0001	// STATUS and SUGGESTION
+#define AVP_QUERY_DIAGNOSTIC			0x0002	// DIAGNOSTIC for the last completed run
+#define AVP_QUERY_HISTORY				0x0003	// TRANSITION for each recent state change
+#define AVP_QUERY_COUNTERS				0x0004	// COUNTERS
+
+// Query results
+#define AVP_RESULT_OK					0x0000
+#define AVP_RESULT_UNKNOWN_QUERY		0x0001
+#define AVP_RESULT_NOT_AVAILABLE		0x0002	// Nothing to report yet
+#define AVP_RESULT_RATE_LIMITED			0x0003	// Asked again too soon, nothing done
+
+// Fields of HELLO
+#define AVP_FIELD_VERSION				0x0001	// u16
+
+// Fields of STATUS and STATUS_DELTA
+#define AVP_FIELD_STATE					0x0001	// u16, one of the AVS_ values
+#define AVP_FIELD_SSID					0x0002	// Raw SSID bytes, not terminated
+#define AVP_FIELD_WIFI_PROBLEM			0x0003	// u16
+#define AVP_FIELD_SIGNAL_QUALITY		0x0004	// u16
+#define AVP_FIELD_RX_RATE				0x0005	// u32, kbps
+#define AVP_FIELD_TX_RATE				0x0006	// u32, kbps
+#define AVP_FIELD_GENERATION			0x0007	// u32
+#define AVP_FIELD_BASE_GENERATION		0x0008	// u32, STATUS_DELTA only
+
+// Fields of PROBE_STATS
+#define AVP_FIELD_URL					0x0001	// UTF-16LE text
+#define AVP_FIELD_PROBES				0x0002	// u32
+#define AVP_FIELD_FAILURES				0x0003	// u32
+#define AVP_FIELD_BUCKETS				0x0004	// u32 per bucket, phase by phase as in Message.h
+
+// Fields of QUERY, RESPONSE and COMMAND_RESULT
+#define AVP_FIELD_REQUEST_ID			0x0001	// u32, picked by the client
+#define AVP_FIELD_QUERY					0x0002	// u16, one of the AVP_QUERY_ values
+#define AVP_FIELD_RESULT				0x0003	// u16, one of the AVP_RESULT_ values
+#define AVP_FIELD_COMMAND				0x0004	// u16, the record type of the command
+
+// Fields of DIAGNOSTIC
+#define AVP_FIELD_RESULT_STATE			0x0001	// u16, one of the AVS_ values
+#define AVP_FIELD_RESULT_SUGGESTION		0x0002	// UTF-16LE text, the suggestion key
+#define AVP_FIELD_ENGINE				0x0003	// u16, 1 or 2
+#define AVP_FIELD_DURATION				0x0004	// u32, milliseconds
+#define AVP_FIELD_AGE					0x0005	// u32, seconds since it finished
+#define AVP_FIELD_TIMED_OUT				0x0006	// u16, 1 if the run was cut short
+
+// Fields of TRANSITION
+#define AVP_FIELD_TRANSITION_AGE		0x0001	// u32, seconds ago
+#define AVP_FIELD_FROM_STATE			0x0002	// u16
+#define AVP_FIELD_TO_STATE				0x0003	// u16
+
+// Fields of COUNTERS
+#define AVP_FIELD_UPTIME				0x0001	// u32, seconds
+#define AVP_FIELD_CYCLES				0x0002	// u32
+#define AVP_FIELD_TRANSITIONS			0x0003	// u32
+#define AVP_FIELD_DIAGNOSTIC_RUNS		0x0004	// u32
+#define AVP_FIELD_DIAGNOSTIC_TIMEOUTS	0x0005	// u32
+#define AVP_FIELD_SESSIONS				0x0006	// u32, clients connected now
+#define AVP_FIELD_MESSAGES_SENT			0x0007	// u64
+#define AVP_FIELD_BYTES_SENT			0x0008	// u64
+#define AVP_FIELD_ENABLE_LOOKUPS		0x0009	// u32, EnableHostname lookups answered
+#define AVP_FIELD_ENABLE_FAILURES		0x000A	// u32
+#define AVP_FIELD_ENABLE_TIMEOUTS		0x000B	// u32
+#define AVP_FIELD_ENABLE_LAST_LATENCY	0x000C	// u32, milliseconds
+#define AVP_FIELD_ENABLE_MAX_LATENCY	0x000D	// u32, milliseconds
+#define AVP_FIELD_ENABLE_AVG_LATENCY	0x000E	// u32, milliseconds
+
+class ProtocolReader;
+
+// One record or field, pointing into the buffer it was read from
+struct ProtocolRecord {
+	uint16_t type;
+	uint16_t flags;
+	const uint8_t *value;
+	uint32_t length;
+
+	static uint16_t readU16(const uint8_t *p) {
+		return (uint16_t)(p[0] | (p[1] << 8));
+	}
+	static uint32_t readU32(const uint8_t *p) {
+		return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+	static uint64_t readU64(const uint8_t *p) {
+		return (uint64_t)readU32(p) | ((uint64_t)readU32(p + 4) << 32);
+	}
+
+	// These return 0 if the value is too short, which is also what an
+	// unknown or missing field is treated as.
+	uint16_t getU16() const {
+		return (length >= 2) ? readU16(value) : 0;
+	}
+	uint32_t getU32() const {
+		return (length >= 4) ? readU32(value) : 0;
+	}
+	uint32_t getU32(uint32_t index) const {
+		return (length >= ((index + 1) * 4)) ? readU32(value + (index * 4)) : 0;
+	}
+	uint64_t getU64() const {
+		return (length >= 8) ? readU64(value) : 0;
+	}
+
+	// Text is UTF-16LE, which is what wchar_t is on Windows anyway.  It isn't
+	// aligned, so it has to be copied out to be used as a string.
+	uint32_t getTextLength() const {
+		return length / 2;
+	}
+	void getText(wchar_t *text, uint32_t textLength) const {
+		for (uint32_t i = 0; (i < textLength) && (i < getTextLength()); i++) {
+			text[i] = (wchar_t)readU16(value + (i * 2));
+		}
+	}
+
+	inline ProtocolReader getFields() const;
+};
+
+class ProtocolReader {
+public:
+	ProtocolReader() {
+		position = NULL;
+		end = NULL;
+	}
+
+	ProtocolReader(const void *data, size_t length) {
+		position = (const uint8_t *)data;
+		end = position + length;
+	}
+
+	// Checks the frame header, and if it's good sets up a reader for the records
+	static bool openFrame(const void *data, size_t length, ProtocolReader& reader) {
+		const uint8_t *frame = (const uint8_t *)data;
+
+		if ((length < AVP_FRAME_HEADER_SIZE) || (frame[0] != 'A') || (frame[1] != 'V') ||
+			(frame[2] != AVP_VERSION)) {
+			return false;
+		}
+
+		uint32_t recordsLength = ProtocolRecord::readU32(frame + 4);
+		if (recordsLength > (length - AVP_FRAME_HEADER_SIZE)) {
+			return false;
+		}
+
+		reader = ProtocolReader(frame + AVP_FRAME_HEADER_SIZE, recordsLength);
+		return true;
+	}
+
+	// False at the end, or if what's left doesn't hold together
+	bool next(ProtocolRecord& record) {
+		if ((size_t)(end - position) < AVP_RECORD_HEADER_SIZE) {
+			return false;
+		}
+
+		uint32_t length = ProtocolRecord::readU32(position + 4);
+		if (length > (size_t)(end - position - AVP_RECORD_HEADER_SIZE)) {
+			return false;
+		}
+
+		record.type = ProtocolRecord::readU16(position);
+		record.flags = ProtocolRecord::readU16(position + 2);
+		record.value = position + AVP_RECORD_HEADER_SIZE;
+		record.length = length;
+
+		position += AVP_RECORD_HEADER_SIZE + length;
+		return true;
+	}
+
+private:
+	const uint8_t *position;
+	const uint8_t *end;
+};
+
+inline ProtocolReader ProtocolRecord::getFields() const
+{
+	return ProtocolReader(value, length);
+}
+
+// Builds one frame.  Records can be nested by calling begin() inside another.
+class ProtocolWriter {
+public:
+	ProtocolWriter() {
+		buffer.reserve(256);
+		buffer.push_back('A');
+		buffer.push_back('V');
+		buffer.push_back(AVP_VERSION);
+		buffer.push_back(0);
+		putU32(0);
+	}
+
+	void begin(uint16_t type) {
+		open.push_back(buffer.size());
+		putU16(type);
+		putU16(0);
+		putU32(0);
+	}
+
+	void end() {
+		size_t start = open.back();
+		open.pop_back();
+		setU32(start + 4, (uint32_t)(buffer.size() - start - AVP_RECORD_HEADER_SIZE));
+	}
+
+	void addEmpty(uint16_t type) {
+		begin(type);
+		end();
+	}
+
+	void addU16(uint16_t type, uint16_t value) {
+		begin(type);
+		putU16(value);
+		end();
+	}
+
+	void addU32(uint16_t type, uint32_t value) {
+		begin(type);
+		putU32(value);
+		end();
+	}
+
+	void addU64(uint16_t type, uint64_t value) {
+		begin(type);
+		putU32((uint32_t)(value & 0xFFFFFFFF));
+		putU32((uint32_t)(value >> 32));
+		end();
+	}
+
+	void addU32s(uint16_t type, const unsigned long *values, size_t count) {
+		begin(type);
+		for (size_t i = 0; i < count; i++) {
+			putU32((uint32_t)values[i]);
+		}
+		end();
+	}
+
+	void addBytes(uint16_t type, const void *data, size_t length) {
+		begin(type);
+		buffer.insert(buffer.end(), (const uint8_t *)data, (const uint8_t *)data + length);
+		end();
+	}
+
+	void addText(uint16_t type, const wchar_t *text, size_t length) {
+		begin(type);
+		for (size_t i = 0; i < length; i++) {
+			putU16((uint16_t)text[i]);
+		}
+		end();
+	}
+
+	bool isEmpty() const {
+		return buffer.size() == AVP_FRAME_HEADER_SIZE;
+	}
+
+	// Fills in the frame length - call once everything is added
+	const std::vector<uint8_t>& finish() {
+		setU32(4, (uint32_t)(buffer.size() - AVP_FRAME_HEADER_SIZE));
+		return buffer;
+	}
+
+	// Same as finish(), but hands the buffer over instead of copying it
+	std::vector<uint8_t> take() {
+		finish();
+		return std::move(buffer);
+	}
+
+private:
+	std::vector<uint8_t> buffer;
+	std::vector<size_t> open;
+
+	void putU16(uint16_t value) {
+		buffer.push_back((uint8_t)(value & 0xFF));
+		buffer.push_back((uint8_t)(value >> 8));
+	}
+	void putU32(uint32_t value) {
+		buffer.push_back((uint8_t)(value & 0xFF));
+		buffer.push_back((uint8_t)((value >> 8) & 0xFF));
+		buffer.push_back((uint8_t)((value >> 16) & 0xFF));
+		buffer.push_back((uint8_t)(value >> 24));
+	}
+	void setU32(size_t offset, uint32_t value) {
+		buffer[offset] = (uint8_t)(value & 0xFF);
+		buffer[offset + 1] = (uint8_t)((value >> 8) & 0xFF);
+		buffer[offset + 2] = (uint8_t)((value >> 16) & 0xFF);
+		buffer[offset + 3] = (uint8_t)(value >> 24);
+	}
+};
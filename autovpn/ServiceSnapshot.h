@@ -0,0 +1,65 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include "Message.h"
+#include "Diagnostics.h"
+
+/*
+ * What the service knows, for answering queries from the pipe.  These are
+ * built once by whoever owns the data and never changed after that, so a
+ * reader holding the shared_ptr needs no lock - the owner just swaps in a new
+ * one.  Times are GetTickCount64() values.
+ */
+
+// The status as last sent to listeners, plus how it got there
+struct ServiceSnapshot {
+	AutoVPNStatus status;
+	CString suggestion;
+	unsigned long generation;
+	ULONGLONG changedTick;
+
+	struct Transition {
+		ULONGLONG tick;
+		short from;
+		short to;
+	};
+
+	// Most recent state changes, oldest first
+	vector<Transition> history;
+
+	// Every state change since the service started
+	unsigned long transitions;
+};
+
+// The last diagnostics run that finished
+struct DiagnosticsRun {
+	short state;
+	CString suggestion;
+	int engine;
+	Diagnostics::CallReason reason;
+	DWORD durationMs;
+	bool timedOut;
+	ULONGLONG finishedTick;
+};
+
+// Running counts, filled in from atomics on request
+struct ServiceCounters {
+	ULONGLONG uptimeSeconds;
+	unsigned long cycles;
+	unsigned long diagnosticRuns;
+	unsigned long diagnosticTimeouts;
+
+	// EnableHostname lookups, latency in milliseconds over the ones answered
+	unsigned long enableLookups;
+	unsigned long enableFailures;
+	unsigned long enableTimeouts;
+	unsigned long enableLastLatency;
+	unsigned long enableMaxLatency;
+	unsigned long enableAverageLatency;
+};
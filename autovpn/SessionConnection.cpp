@@ -7,341 +7,615 @@
 
 #include "pch.h"
 #include "Message.h"
+#include "Protocol.h"
 #include "Controller.h"
 #include "SessionConnection.h"
 #include "SessionManager.h"
 #include "Settings.h"
 #include "Log.h"
 
-SessionConnection::SessionConnection(SessionManager *manager, Controller *autoVPN)
+#define INBUFFER_SIZE 4096
+#define OUTBUFFER_SIZE 4096
+
+// Changes that land this close together go out in one message
+#define COALESCE_MILLISECONDS 200
+
+// Messages waiting on a client that isn't reading, past which the oldest go
+#define SEND_QUEUE_LIMIT 16
+
+// Rate limit key for clients whose logon session couldn't be found
+#define UNKNOWN_CLIENT_SESSION 0xFFFFFFFF
+
+SessionConnection::SessionConnection(SessionManager *manager, Controller *autoVPN, HANDLE port)
 {
 	this->manager= manager;
 	this->autoVPN= autoVPN;
+	this->port= port;
+
+	pipe= INVALID_HANDLE_VALUE;
+	state= State::IDLE;
+	pendingIo= 0;
+	everConnected= false;
+
+	ZeroMemory(&connectOverlapped, sizeof(connectOverlapped));
+	ZeroMemory(&readOverlapped, sizeof(readOverlapped));
+	ZeroMemory(&publishOverlapped, sizeof(publishOverlapped));
 
-	sessionThread= NULL;
-	first= false;
-	stopEvent= CreateEvent(NULL, TRUE, FALSE, NULL);
-	sendPipe = INVALID_HANDLE_VALUE;
+	readBuffer.resize(INBUFFER_SIZE + 1);
+	helloReceived= false;
+	discardRead= false;
+	protocolVersion = 1;
 
-	lastSuggestionTime = (time_t)0;
+	ZeroMemory(&latestStatus, sizeof(latestStatus));
+	latestGeneration = 0;
+	publishPending = false;
+	publishTimer = CreateThreadpoolTimer(&SessionConnection::publishTimerCallback, this, NULL);
+
+	subscribed = false;
+	sentValid = false;
+	ZeroMemory(&sentStatus, sizeof(sentStatus));
+	sentGeneration = 0;
+
+	ZeroMemory(&writeOverlapped, sizeof(writeOverlapped));
+	writePending = false;
+	publishDeferred = false;
+
+	clientSession = 0;
 }
 
 SessionConnection::~SessionConnection()
 {
-	CloseHandle(stopEvent);
-}
+	// A callback could still be on its way in even after the timer is
+	// cleared, and it uses this object.
+	if (publishTimer != NULL) {
+		SetThreadpoolTimer(publishTimer, NULL, 0, 0);
+		WaitForThreadpoolTimerCallbacks(publishTimer, TRUE);
+		CloseThreadpoolTimer(publishTimer);
+	}
 
-#define INBUFFER_SIZE 4096
-#define OUTBUFFER_SIZE 4096
+	if (pipe != INVALID_HANDLE_VALUE) {
+		::DisconnectNamedPipe(pipe);
+		::CloseHandle(pipe);
+	}
+}
 
-LPSECURITY_ATTRIBUTES SessionConnection::buildSecurityAttributes()
+bool SessionConnection::listen(LPSECURITY_ATTRIBUTES securityAttributes)
 {
-	LPSECURITY_ATTRIBUTES sa= (LPSECURITY_ATTRIBUTES)HeapAlloc(
-		GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SECURITY_ATTRIBUTES));
+	LPCTSTR pipeName= _T("\\\\.\\pipe\\teaglu_autovpn");
+
+	pipe= ::CreateNamedPipe(pipeName,
+		PIPE_ACCESS_DUPLEX | WRITE_DAC | FILE_FLAG_OVERLAPPED,
+		PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+		PIPE_UNLIMITED_INSTANCES,
+		INBUFFER_SIZE,
+		OUTBUFFER_SIZE,
+		NMPWAIT_USE_DEFAULT_WAIT,
+		securityAttributes);
+
+	if (pipe == INVALID_HANDLE_VALUE) {
+		Log::log(LOG_ERROR,
+			_T("Error creating named pipe [%s] for session agent server {w32err}"),
+			pipeName);
+		return false;
+	}
 
-	PSECURITY_DESCRIPTOR securityDescriptor= (PSECURITY_DESCRIPTOR)
-		HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, SECURITY_DESCRIPTOR_MIN_LENGTH);
+	// Everything on this instance completes to the port, keyed by us
+	if (::CreateIoCompletionPort(pipe, port, (ULONG_PTR)this, 0) == NULL) {
+		Log::log(LOG_ERROR,
+			_T("Error attaching session pipe to completion port: {w32err}"));
+		return false;
+	}
 
-	SID_IDENTIFIER_AUTHORITY ntAuthority= SECURITY_NT_AUTHORITY;
+	if (publishTimer == NULL) {
+		Log::log(LOG_ERROR, _T("Failed to create session publish timer: {w32err}"));
+		return false;
+	}
 
-	PSID anonymousSid= NULL;
-	PTOKEN_USER userToken= NULL;
+	unique_lock<mutex> permit(ioLock);
+	state= State::LISTENING;
+	postConnect();
 
-	PACL acl= NULL;
+	return state == State::LISTENING;
+}
 
-	bool success= false;
-	do {
-		if (!InitializeSecurityDescriptor(securityDescriptor, SECURITY_DESCRIPTOR_REVISION)) {
-			Log::log(LOG_ERROR,
-				_T("Failed to initialize session pipe security descriptor: {w32err}"));
-			break;
-		}
+void SessionConnection::shutdown()
+{
+	unique_lock<mutex> permit(ioLock);
+	close();
+}
 
-		if (!AllocateAndInitializeSid(&ntAuthority, 1, SECURITY_INTERACTIVE_RID, 0, 0, 0, 0, 0, 0, 0, &anonymousSid)) {
-			Log::log(LOG_ERROR,
-				_T("Failed to allocate SID for session pipe: {w32err}"));
-			break;
+void SessionConnection::postConnect()
+{
+	ZeroMemory(&connectOverlapped, sizeof(connectOverlapped));
+
+	if (ConnectNamedPipe(pipe, &connectOverlapped)) {
+		// Doesn't happen on an overlapped handle, but the completion is
+		// queued either way.
+		pendingIo++;
+	} else if (GetLastError() == ERROR_IO_PENDING) {
+		pendingIo++;
+	} else if (GetLastError() == ERROR_PIPE_CONNECTED) {
+		// The client got in between creating the instance and the accept, so
+		// there won't be a completion unless we queue one ourselves.
+		pendingIo++;
+		if (!PostQueuedCompletionStatus(port, 0, (ULONG_PTR)this, &connectOverlapped)) {
+			Log::log(LOG_ERROR, _T("Failed to post session accept: {w32err}"));
+			pendingIo--;
+			state= State::CLOSING;
 		}
+	} else {
+		Log::log(LOG_ERROR, _T("Error in ConnectNamedPipe: {w32err}"));
+		state= State::CLOSING;
+	}
+}
 
-		HANDLE processToken;
-		if( !OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &processToken) )
-		{
+void SessionConnection::postRead()
+{
+	ZeroMemory(&readOverlapped, sizeof(readOverlapped));
+
+	// Successful or not, anything but an immediate failure completes through
+	// the port.
+	if (ReadFile(pipe, readBuffer.data(), INBUFFER_SIZE, NULL, &readOverlapped) ||
+		(GetLastError() == ERROR_IO_PENDING) || (GetLastError() == ERROR_MORE_DATA)) {
+		pendingIo++;
+	} else {
+		if (GetLastError() != ERROR_BROKEN_PIPE) {
 			Log::log(LOG_ERROR,
-				_T("Failed to open current process token: {w32err}"));
-			break;
+				_T("Error reading pipe message: {w32err}"));
 		}
+		close();
+	}
+}
 
-		DWORD userTokenLen;
-		if (GetTokenInformation(processToken, TokenUser, userToken, 0, &userTokenLen)) {
-			Log::log(LOG_ERROR,
-				_T("Failed to load token information for sesion pipe: {w32err}"));
-			CloseHandle(processToken);
-			break;
+bool SessionConnection::onCompletion(LPOVERLAPPED overlapped, DWORD bytes, DWORD error, bool& connected)
+{
+	unique_lock<mutex> permit(ioLock);
+
+	pendingIo--;
+	connected= false;
+
+	if (overlapped == &connectOverlapped) {
+		if (state != State::LISTENING) {
+			// Cancelled on the way down
+		} else if (error != ERROR_SUCCESS) {
+			SetLastError(error);
+			Log::log(LOG_ERROR, _T("Deferred error in ConnectNamedPipe: {w32err}"));
+			state= State::CLOSING;
 		} else {
-			if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
-				Log::log(LOG_ERROR,
-					_T("Failed to retrieve size for token information for session pipe: {w32err}"));
-				CloseHandle(processToken);
-				break;
-			}
+			connected= true;
+			onConnected();
 		}
-
-		userToken = (PTOKEN_USER)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, userTokenLen);
-		if (!GetTokenInformation(processToken, TokenUser, userToken, userTokenLen, &userTokenLen)) {
-			Log::log(LOG_ERROR,
-				_T("Failed to retrieve token information for sesion pipe: {w32err}"));
-			CloseHandle(processToken);
-			break;
+	} else if (overlapped == &readOverlapped) {
+		onRead(bytes, error);
+	} else if (overlapped == &writeOverlapped) {
+		finishWrite(bytes, error);
+	} else if (overlapped == &publishOverlapped) {
+		if (state == State::CONNECTED) {
+			publish();
 		}
+	}
 
-		CloseHandle(processToken);
+	return (state == State::CLOSING) && (pendingIo == 0);
+}
 
-		PSID runningSid= userToken->User.Sid;
-		
-		DWORD aclSize= sizeof(ACL) + (2 * sizeof(ACCESS_ALLOWED_ACE) - sizeof(DWORD)) + GetLengthSid(anonymousSid) + GetLengthSid(runningSid);
+void SessionConnection::onConnected()
+{
+	Log::log(LOG_DEBUG, _T("Got connection"));
 
-		acl= (PACL)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, aclSize);
+	state= State::CONNECTED;
+	everConnected= true;
 
-		if (!InitializeAcl(acl, aclSize, ACL_REVISION)) {
-			Log::log(LOG_ERROR,
-				_T("Failed to initialize ACL structure for session pipe: {w32err}"));
-			break;
-		}
+	// Commands are limited per logon session.  If we can't tell which one,
+	// the client shares a limit with every other client we couldn't place.
+	if (!GetNamedPipeClientSessionId(pipe, &clientSession)) {
+		Log::log(LOG_WARNING, _T("Unable to get session pipe client session: {w32err}"));
+		clientSession = UNKNOWN_CLIENT_SESSION;
+	}
+	helloReceived= false;
+	discardRead= false;
 
-		if (!AddAccessAllowedAce(acl, ACL_REVISION, FILE_GENERIC_READ|FILE_GENERIC_WRITE, anonymousSid)) {
-			Log::log(LOG_ERROR,
-				_T("Failed to add anonymous ID to sesion pipe ACL: {w32err}"));
-			break;
-		}
+	postRead();
+}
 
+void SessionConnection::onRead(DWORD bytes, DWORD error)
+{
+	if (state != State::CONNECTED) {
+		return;
+	}
 
-		if (!AddAccessAllowedAce(acl, ACL_REVISION, GENERIC_ALL, runningSid)) {
-			Log::log(LOG_ERROR,
-				_T("Failed to add SID for self to session pipe: {w32err}"));
-			break;
+	if (error == ERROR_MORE_DATA) {
+		// Nothing a client sends comes close to the buffer, so whatever this
+		// is gets thrown away - the rest of it too.
+		Log::log(LOG_WARNING, _T("Oversized message from client"));
+		discardRead= true;
+	} else if (error != ERROR_SUCCESS) {
+		if ((error != ERROR_BROKEN_PIPE) && (error != ERROR_OPERATION_ABORTED)) {
+			SetLastError(error);
+			Log::log(LOG_ERROR, _T("Failed getting overlapped result: {w32err}"));
 		}
+		close();
+		return;
+	} else if (discardRead) {
+		discardRead= false;
+	} else if (!helloReceived) {
+		processHello(readBuffer.data(), bytes);
+	} else if (protocolVersion >= AVP_VERSION) {
+		processFrame((char *)readBuffer.data(), bytes);
+	} else {
+		readBuffer[bytes]= '\0';
+		processMessage((char *)readBuffer.data(), bytes);
+	}
 
-		if (!SetSecurityDescriptorDacl(securityDescriptor, TRUE, acl, FALSE)) {
-			Log::log(LOG_ERROR,
-				_T("Failed to set security DACL on session pipe: {w32err}"));
-			break;
-		}
+	if (state == State::CONNECTED) {
+		postRead();
+	}
+}
 
-		sa->nLength= sizeof(SECURITY_ATTRIBUTES);
-		sa->bInheritHandle= FALSE;
-		sa->lpSecurityDescriptor= securityDescriptor;
-		success= true;
-	} while (false);
+void SessionConnection::processHello(BYTE *buffer, DWORD bufferLen)
+{
+	BYTE helloMessage[AVP_HELLO_SIZE]= AVP_HELLO_BYTES;
+
+	// The bare hello is what version 1 clients send.  Newer ones
+	// add the highest version they understand.
+	bool match= false;
+	if ((bufferLen == AVP_HELLO_SIZE) || (bufferLen == AVP_EXTENDED_HELLO_SIZE)) {
+		match= true;
+		for (int i= 0; match && (i < AVP_HELLO_SIZE); i++) {
+			if (helloMessage[i] != buffer[i]) {
+				match= false;
+			}
+		}
+	}
 
-	if (anonymousSid) {
-		FreeSid(anonymousSid);
+	if (!match) {
+		Log::log(LOG_ERROR, _T("Client did not handshake correctly"));
+		return;
 	}
-	if (userToken) {
-		HeapFree(GetProcessHeap(), 0, userToken);
+
+	helloReceived= true;
+
+	protocolVersion= 1;
+	int helloFlags= 0;
+	if (bufferLen == AVP_EXTENDED_HELLO_SIZE) {
+		int requested= ProtocolRecord::readU16(buffer + AVP_HELLO_SIZE);
+		protocolVersion= (requested >= AVP_VERSION) ? AVP_VERSION : 1;
+		helloFlags= ProtocolRecord::readU16(buffer + AVP_HELLO_SIZE + 2);
 	}
 
-	if (!success) {
-		HeapFree(GetProcessHeap(), 0, securityDescriptor);
-		HeapFree(GetProcessHeap(), 0, sa);
-		sa= NULL;
+	Log::log(LOG_DEBUG, _T("Client is using protocol version %d"), protocolVersion);
+
+	if (protocolVersion >= AVP_VERSION) {
+		ProtocolWriter writer;
+		writer.begin(AVP_RECORD_HELLO);
+		writer.addU16(AVP_FIELD_VERSION, (uint16_t)protocolVersion);
+		writer.end();
+
+		sendFrame(writer);
+
+		// Reading the status page already, so status here would only be
+		// the same thing twice.
+		if (helloFlags & AVP_HELLO_FLAG_PAGE_STATUS) {
+			Log::log(LOG_DEBUG, _T("Client reads status from the status page"));
+			return;
+		}
 	}
 
-	return sa;
+	// Registering hands us the current state, which goes out in full
+	// right away rather than waiting out the timer.
+	sentValid= false;
+	subscribed= true;
+	autoVPN->registerStatusListener(this);
+	publish();
 }
 
-void SessionConnection::freeSecurityAttributes(LPSECURITY_ATTRIBUTES securityAttributes)
+void SessionConnection::close()
 {
-	HeapFree(GetProcessHeap(), 0, securityAttributes->lpSecurityDescriptor);
-	HeapFree(GetProcessHeap(), 0, securityAttributes);
-}
+	if ((state == State::CLOSING) || (state == State::IDLE)) {
+		return;
+	}
 
-void SessionConnection::mainLoop()
-{
-	bool rval= false;
+	state= State::CLOSING;
 
-	for (bool run= true; run; ) {
-		LPCTSTR pipeName= _T("\\\\.\\pipe\\teaglu_autovpn");
+	if (subscribed) {
+		autoVPN->unregisterStatusListener(this);
+		subscribed= false;
+
+		SetThreadpoolTimer(publishTimer, NULL, 0, 0);
+	}
 
-		LPSECURITY_ATTRIBUTES securityAttributes= NULL;
+	// Whatever is outstanding comes back aborted, and the last one to come
+	// back finishes us off.
+	CancelIoEx(pipe, NULL);
+}
+
+void SessionConnection::processMessage(char *buffer, int bufferLen)
+{
+	if ((bufferLen < 0) || ((size_t)bufferLen < sizeof(AutoVPNHeader))) {
+		Log::log(LOG_WARNING, _T("Short message from client: %d bytes"), bufferLen);
+		return;
+	}
 
-		// FIXME we can probably just do this once
-		securityAttributes= buildSecurityAttributes();
+	AutoVPNHeader *header = (AutoVPNHeader *)buffer;
 
-		HANDLE pipe= ::CreateNamedPipe(pipeName,
-			PIPE_ACCESS_DUPLEX | WRITE_DAC | FILE_FLAG_OVERLAPPED,
-			PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
-			PIPE_UNLIMITED_INSTANCES,
-			INBUFFER_SIZE,
-			OUTBUFFER_SIZE,
-			NMPWAIT_USE_DEFAULT_WAIT,
-			securityAttributes);
+	switch (header->opcode) {
+	case AV_MESSAGE_PROBE_STATS_REQUEST:
+		{
+			list<AutoVPNProbeStats> stats;
+			autoVPN->getProbeStats(stats);
 
-		if (pipe == INVALID_HANDLE_VALUE) {
-			Log::log(LOG_ERROR,
-				_T("Error creating named pipe [%s] for session agent server {w32err}"),
-				pipeName);
-			run= false;
+			for (AutoVPNProbeStats& urlStats : stats) {
+				sendMessage(AV_MESSAGE_PROBE_STATS, &urlStats, sizeof(urlStats));
+			}
 		}
+		break;
 
-		if (securityAttributes != NULL) {
-			freeSecurityAttributes(securityAttributes);
-		}
+	default:
+		Log::log(LOG_WARNING, _T("Unknown message opcode %d from client"), header->opcode);
+		break;
+	}
+}
 
-		if (!run) break;
-
-		HANDLE pipeEvent= CreateEvent(NULL, FALSE, FALSE, NULL);
-
-		OVERLAPPED overlapped= { 0 };
-		overlapped.hEvent= pipeEvent;
-
-		bool error= false;
-
-		if (ConnectNamedPipe(pipe, &overlapped)) {
-			manager->connectionStart(this);
-			bool handlerOk= handleClient(pipe, pipeEvent);
-
-			manager->connectionStop(this);
-		} else if (GetLastError() == ERROR_IO_PENDING) {
-			HANDLE events[2];
-			events[0]= pipeEvent;
-			events[1]= stopEvent;
-
-			DWORD waitValue= ::WaitForMultipleObjects(2, events, FALSE, INFINITE);
-			if (waitValue == WAIT_OBJECT_0) {
-				DWORD bytesRead;	// Not used
-				if (!GetOverlappedResult(pipe, &overlapped, &bytesRead, FALSE)) {
-					Log::log(LOG_ERROR, _T("Deferred error in ConnectNamedPipe: {w32err}"));
-				} else {
-					manager->connectionStart(this);
-					if (!handleClient(pipe, pipeEvent)) {
-						// false return means shutdown was called
-						Log::log(LOG_DEBUG, _T("Got shutdown return from client loop"));
-						run= false;
-					} else {
-						// If we're running down don't call connectionStop() or we get a deadlock
-						manager->connectionStop(this);
-					}
+void SessionConnection::processFrame(char *frame, int frameLen)
+{
+	ProtocolReader reader;
+	if (!ProtocolReader::openFrame(frame, frameLen, reader)) {
+		Log::log(LOG_WARNING, _T("Bad frame from client: %d bytes"), frameLen);
+		return;
+	}
+
+	// Everything asked for in one frame goes back in one frame
+	ProtocolWriter writer;
+	bool resync = false;
+
+	ProtocolRecord record;
+	while (reader.next(record)) {
+		switch (record.type) {
+		case AVP_RECORD_PROBE_STATS_REQUEST:
+			{
+				list<AutoVPNProbeStats> stats;
+				autoVPN->getProbeStats(stats);
+
+				for (AutoVPNProbeStats& urlStats : stats) {
+					writer.begin(AVP_RECORD_PROBE_STATS);
+					writer.addText(AVP_FIELD_URL, urlStats.url, wcsnlen(urlStats.url, _countof(urlStats.url)));
+					writer.addU32(AVP_FIELD_PROBES, urlStats.probes);
+					writer.addU32(AVP_FIELD_FAILURES, urlStats.failures);
+					writer.addU32s(AVP_FIELD_BUCKETS, &urlStats.buckets[0][0],
+						AV_PROBE_PHASES * AV_PROBE_BUCKETS);
+					writer.end();
 				}
-			} else if (waitValue == (WAIT_OBJECT_0 + 1)) {
-				// Stop handle
-				run= false;
-			} else {
-				Log::log(LOG_ERROR, _T("SessionConnection: error in WaitForMultipleObjects: {w32err}"));
-				run= false;
 			}
-		} else {
-			Log::log(LOG_ERROR, _T("Error in ConnectNamedPipe: {w32err}"));
-			run= false;
+			break;
+
+		case AVP_RECORD_RESYNC:
+			// The client lost track of a delta somewhere
+			resync = true;
+			break;
+
+		case AVP_RECORD_QUERY:
+			answerQuery(writer, record);
+			break;
+
+		case AVP_RECORD_RECHECK:
+		case AVP_RECORD_RUN_DIAGNOSTICS:
+			runCommand(writer, record.type);
+			break;
+
+		default:
+			// Could be from a newer client, so not worth more than a debug line
+			Log::log(LOG_DEBUG, _T("Unknown record type %d from client"), record.type);
+			break;
 		}
+	}
 
-		::CloseHandle(pipeEvent);
+	if (!writer.isEmpty()) {
+		sendFrame(writer);
+	}
 
-		::FlushFileBuffers(pipe);
-		::DisconnectNamedPipe(pipe);
-		::CloseHandle(pipe);
+	if (resync) {
+		sentValid = false;
+		publish();
 	}
 }
 
-bool SessionConnection::handleClient(HANDLE pipe, HANDLE pipeEvent)
+void SessionConnection::answerQuery(ProtocolWriter& writer, const ProtocolRecord& query)
 {
-	bool rval= true;
+	uint32_t requestId = 0;
+	uint16_t queryType = 0;
+
+	ProtocolReader fields = query.getFields();
+	ProtocolRecord field;
+	while (fields.next(field)) {
+		switch (field.type) {
+		case AVP_FIELD_REQUEST_ID:
+			requestId = field.getU32();
+			break;
+		case AVP_FIELD_QUERY:
+			queryType = field.getU16();
+			break;
+		}
+	}
 
-	Log::log(LOG_DEBUG, _T("Got connection"));
+	// All of these come from snapshots, so a query never waits on a cycle
+	ULONGLONG now = GetTickCount64();
 
-	bool helloReceived= false;
-	for (bool run= true; run; ) {
-		// Data handle
-		BYTE buffer[INBUFFER_SIZE + 1];
-		DWORD bufferLen= 0;
-
-		bool processData= false;
-
-		OVERLAPPED overlapped= { 0 };
-		overlapped.hEvent= pipeEvent;
-
-		if (ReadFile(pipe, buffer, INBUFFER_SIZE, (LPDWORD)&bufferLen, &overlapped)) {
-			processData= true;
-		} else if (GetLastError() == ERROR_IO_PENDING) {
-			HANDLE events[2];
-			events[0]= pipeEvent;
-			events[1]= stopEvent;
-
-			DWORD waitValue= ::WaitForMultipleObjects(2, events, FALSE, INFINITE);
-			//Log::log(LOG_DEBUG, "Got async return (%d)", GetCurrentThreadId());
-			if (waitValue == WAIT_OBJECT_0) {
-				if (!GetOverlappedResult(pipe, &overlapped, &bufferLen, FALSE)) {
-					if (GetLastError() != ERROR_BROKEN_PIPE) {
-						Log::log(LOG_ERROR, _T("Failed getting overlapped result: {w32err}"));
-					}
-					run= false;
-				} else {
-					processData= true;
-				}
-			} else if (waitValue == (WAIT_OBJECT_0 + 1)) {
-				// Stop handle
-				run= false;
-				rval= false;
-			} else {
-				Log::log(LOG_ERROR, _T("SessionConnection: error in client WaitForMultipleObjects: {w32err}"));
-				run= false;
-			}
-		} else {
-			if (GetLastError() != ERROR_BROKEN_PIPE) {
-				Log::log(LOG_ERROR,
-					_T("Error reading pipe message: {w32err}"));
-			}
-			run= false;
+	writer.begin(AVP_RECORD_RESPONSE);
+	writer.addU32(AVP_FIELD_REQUEST_ID, requestId);
+	writer.addU16(AVP_FIELD_QUERY, queryType);
+
+	switch (queryType) {
+	case AVP_QUERY_STATUS:
+		{
+			shared_ptr<const ServiceSnapshot> snapshot = autoVPN->getSnapshot();
+
+			writer.addU16(AVP_FIELD_RESULT, AVP_RESULT_OK);
+			addStatus(writer, snapshot->status, snapshot->generation);
+			writer.addText(AVP_RECORD_SUGGESTION, snapshot->suggestion, snapshot->suggestion.GetLength());
 		}
+		break;
 
-		if (processData) {
-			if (!helloReceived) {
-				BYTE helloMessage[8]={ 0x43, 0x81, 0xa9, 0x17, 0xee, 0xf2, 0x01, 0x92 };
-
-				bool match= false;
-				if (bufferLen == 8) {
-					match= true;
-					for (int i= 0; match && (i < 8); i++) {
-						if (helloMessage[i] != buffer[i]) {
-							match= false;
-						}
-					}
-				}
+	case AVP_QUERY_DIAGNOSTIC:
+		{
+			shared_ptr<const DiagnosticsRun> run = autoVPN->getLastDiagnostics();
 
-				if (!match) {
-					Log::log(LOG_ERROR, _T("Client did not handshake correctly"));
-				} else {
-					helloReceived= true;
+			if (!run) {
+				writer.addU16(AVP_FIELD_RESULT, AVP_RESULT_NOT_AVAILABLE);
+				break;
+			}
 
-					{
-						unique_lock<mutex> permit(sendLock);
-						sendPipe = pipe;
-					}
+			writer.addU16(AVP_FIELD_RESULT, AVP_RESULT_OK);
+			writer.begin(AVP_RECORD_DIAGNOSTIC);
+			writer.addU16(AVP_FIELD_RESULT_STATE, (uint16_t)run->state);
+			writer.addText(AVP_FIELD_RESULT_SUGGESTION, run->suggestion, run->suggestion.GetLength());
+			writer.addU16(AVP_FIELD_ENGINE, (uint16_t)run->engine);
+			writer.addU32(AVP_FIELD_DURATION, run->durationMs);
+			writer.addU32(AVP_FIELD_AGE, (uint32_t)((now - run->finishedTick) / 1000));
+			writer.addU16(AVP_FIELD_TIMED_OUT, run->timedOut ? 1 : 0);
+			writer.end();
+		}
+		break;
 
-					autoVPN->registerStatusListener(this);
-				}
-			} else {
-				buffer[bufferLen]= '\0';
-				processMessage((char *)buffer, bufferLen);
+	case AVP_QUERY_HISTORY:
+		{
+			shared_ptr<const ServiceSnapshot> snapshot = autoVPN->getSnapshot();
+
+			writer.addU16(AVP_FIELD_RESULT, AVP_RESULT_OK);
+			for (const ServiceSnapshot::Transition& transition : snapshot->history) {
+				writer.begin(AVP_RECORD_TRANSITION);
+				writer.addU32(AVP_FIELD_TRANSITION_AGE, (uint32_t)((now - transition.tick) / 1000));
+				writer.addU16(AVP_FIELD_FROM_STATE, (uint16_t)transition.from);
+				writer.addU16(AVP_FIELD_TO_STATE, (uint16_t)transition.to);
+				writer.end();
 			}
 		}
+		break;
+
+	case AVP_QUERY_COUNTERS:
+		{
+			shared_ptr<const ServiceSnapshot> snapshot = autoVPN->getSnapshot();
+
+			ServiceCounters counters;
+			autoVPN->getCounters(counters);
+
+			unsigned long long messages, bytes;
+			manager->getSentTotals(messages, bytes);
+
+			writer.addU16(AVP_FIELD_RESULT, AVP_RESULT_OK);
+			writer.begin(AVP_RECORD_COUNTERS);
+			writer.addU32(AVP_FIELD_UPTIME, (uint32_t)counters.uptimeSeconds);
+			writer.addU32(AVP_FIELD_CYCLES, counters.cycles);
+			writer.addU32(AVP_FIELD_TRANSITIONS, snapshot->transitions);
+			writer.addU32(AVP_FIELD_DIAGNOSTIC_RUNS, counters.diagnosticRuns);
+			writer.addU32(AVP_FIELD_DIAGNOSTIC_TIMEOUTS, counters.diagnosticTimeouts);
+			writer.addU32(AVP_FIELD_SESSIONS, (uint32_t)manager->getSessionCount());
+			writer.addU64(AVP_FIELD_MESSAGES_SENT, messages);
+			writer.addU64(AVP_FIELD_BYTES_SENT, bytes);
+			writer.addU32(AVP_FIELD_ENABLE_LOOKUPS, counters.enableLookups);
+			writer.addU32(AVP_FIELD_ENABLE_FAILURES, counters.enableFailures);
+			writer.addU32(AVP_FIELD_ENABLE_TIMEOUTS, counters.enableTimeouts);
+			writer.addU32(AVP_FIELD_ENABLE_LAST_LATENCY, counters.enableLastLatency);
+			writer.addU32(AVP_FIELD_ENABLE_MAX_LATENCY, counters.enableMaxLatency);
+			writer.addU32(AVP_FIELD_ENABLE_AVG_LATENCY, counters.enableAverageLatency);
+			writer.end();
+		}
+		break;
+
+	default:
+		writer.addU16(AVP_FIELD_RESULT, AVP_RESULT_UNKNOWN_QUERY);
+		break;
 	}
 
-	if (helloReceived) {
-		autoVPN->unregisterStatusListener(this);
+	writer.end();
+}
+
+void SessionConnection::runCommand(ProtocolWriter& writer, uint16_t command)
+{
+	bool diagnostics = (command == AVP_RECORD_RUN_DIAGNOSTICS);
+	uint16_t result = AVP_RESULT_OK;
+
+	if (!manager->allowCommand(clientSession, diagnostics)) {
+		Log::log(LOG_DEBUG, _T("Session %lu asked for command %d again too soon"),
+			clientSession, command);
+		result = AVP_RESULT_RATE_LIMITED;
+	} else {
+
+		// Whatever changes comes back as a normal status update
+		if (diagnostics) {
+			Log::log(LOG_INFO, _T("User asked for a diagnostics run"));
+			autoVPN->runDiagnosticsNow();
+		} else {
+			autoVPN->recheckNow();
+		}
 	}
 
-	unique_lock<mutex> permit(sendLock);
-	sendPipe = INVALID_HANDLE_VALUE;
+	writer.begin(AVP_RECORD_COMMAND_RESULT);
+	writer.addU16(AVP_FIELD_COMMAND, command);
+	writer.addU16(AVP_FIELD_RESULT, result);
+	writer.end();
+}
 
-	return rval;
+void SessionConnection::addStatus(ProtocolWriter& writer, const AutoVPNStatus& status,
+	unsigned long generation)
+{
+	writer.begin(AVP_RECORD_STATUS);
+	writer.addU16(AVP_FIELD_STATE, (uint16_t)status.state);
+	writer.addBytes(AVP_FIELD_SSID, status.ssid, strnlen(status.ssid, sizeof(status.ssid)));
+	writer.addU16(AVP_FIELD_WIFI_PROBLEM, (uint16_t)status.wifiProblem);
+	writer.addU16(AVP_FIELD_SIGNAL_QUALITY, (uint16_t)status.signalQuality);
+	writer.addU32(AVP_FIELD_RX_RATE, status.rxRate);
+	writer.addU32(AVP_FIELD_TX_RATE, status.txRate);
+	writer.addU32(AVP_FIELD_GENERATION, (uint32_t)generation);
+	writer.end();
 }
 
-void SessionConnection::processMessage(char *buffer, int bufferLen)
+void SessionConnection::addStatusDelta(ProtocolWriter& writer,
+	const AutoVPNStatus& base, unsigned long baseGeneration,
+	const AutoVPNStatus& status, unsigned long generation)
+{
+	writer.begin(AVP_RECORD_STATUS_DELTA);
+	writer.addU32(AVP_FIELD_BASE_GENERATION, (uint32_t)baseGeneration);
+	writer.addU32(AVP_FIELD_GENERATION, (uint32_t)generation);
+
+	if (status.state != base.state) {
+		writer.addU16(AVP_FIELD_STATE, (uint16_t)status.state);
+	}
+	if (strncmp(status.ssid, base.ssid, sizeof(status.ssid)) != 0) {
+		// An empty SSID field means the SSID went away
+		writer.addBytes(AVP_FIELD_SSID, status.ssid, strnlen(status.ssid, sizeof(status.ssid)));
+	}
+	if (status.wifiProblem != base.wifiProblem) {
+		writer.addU16(AVP_FIELD_WIFI_PROBLEM, (uint16_t)status.wifiProblem);
+	}
+	if (status.signalQuality != base.signalQuality) {
+		writer.addU16(AVP_FIELD_SIGNAL_QUALITY, (uint16_t)status.signalQuality);
+	}
+	if (status.rxRate != base.rxRate) {
+		writer.addU32(AVP_FIELD_RX_RATE, status.rxRate);
+	}
+	if (status.txRate != base.txRate) {
+		writer.addU32(AVP_FIELD_TX_RATE, status.txRate);
+	}
+
+	writer.end();
+}
+
+void SessionConnection::sendFrame(ProtocolWriter& writer, bool status)
 {
-	// Do stuff and/or things?
+	vector<uint8_t> frame = writer.take();
+
+	if (frame.size() > AVP_MAX_FRAME_SIZE) {
+		Log::log(LOG_ERROR,
+			_T("Attempt to send %zu byte frame on pipe, which is beyond AVP_MAX_FRAME_SIZE"),
+			frame.size());
+		return;
+	}
+
+	// Message mode, so a frame bigger than the pipe buffer still arrives
+	// as one message - the reader just has to collect it.
+	queueSend(move(frame), status);
 }
 
-void SessionConnection::sendMessage(char type, void *data, size_t length)
+void SessionConnection::sendMessage(char type, void *data, size_t length, bool status)
 {
 	if (length > OUTBUFFER_SIZE) {
 		Log::log(LOG_ERROR,
@@ -350,74 +624,212 @@ void SessionConnection::sendMessage(char type, void *data, size_t length)
 		return;
 	}
 
-	unique_lock<mutex> permit(sendLock);
+	vector<uint8_t> message(sizeof(AutoVPNHeader) + length);
+	AutoVPNHeader* header = (AutoVPNHeader*)message.data();
+
+	// This is all named pipes on the same host, so we don't have to
+	// worry about htons etc.
+
+	header->version = AV_VERSION;
+	header->opcode = type;
+	header->length = (short)(length & 0xFFFF);
+
+	CopyMemory(&message[sizeof(AutoVPNHeader)], data, length);
+
+	queueSend(move(message), status);
+}
+
+void SessionConnection::queueSend(vector<uint8_t>&& data, bool status)
+{
+	if (state != State::CONNECTED) {
+		return;
+	}
+
+	sendQueue.push_back(Outbound{ move(data), status });
 
-	if (sendPipe != INVALID_HANDLE_VALUE) {
-		DWORD messageLen = sizeof(AutoVPNHeader) + (DWORD)length;
-		BYTE *message = new BYTE[messageLen];
-		AutoVPNHeader* header = (AutoVPNHeader*)message;
+	if (sendQueue.size() > SEND_QUEUE_LIMIT) {
+		// The one at the front may already be in flight, and has to stay put
+		auto oldest = sendQueue.begin() + (writePending ? 1 : 0);
+
+		// The client is now a step behind on status, so it gets everything
+		// next time instead of a delta it can't use.
+		if (oldest->status) {
+			sentValid = false;
+		}
 
-		// This is all named pipes on the same host, so we don't have to
-		// worry about htons etc.
+		sendQueue.erase(oldest);
+		Log::log(LOG_WARNING, _T("Session client is not reading, dropped oldest queued message"));
+	}
+
+	startWrite();
+}
+
+void SessionConnection::startWrite()
+{
+	if (writePending || sendQueue.empty() || (state != State::CONNECTED)) {
+		return;
+	}
 
-		header->version = AV_VERSION;
-		header->opcode = type;
-		header->length = (short)(length & 0xFFFF);
+	const vector<uint8_t>& data = sendQueue.front().data;
 
-		CopyMemory(&message[sizeof(AutoVPNHeader)], data, length);
+	ZeroMemory(&writeOverlapped, sizeof(writeOverlapped));
 
-		DWORD bytesWritten;
-		if (!WriteFile(sendPipe, message, messageLen, &bytesWritten, NULL)) {
+	// Even when this finishes right away it completes through the port
+	if (WriteFile(pipe, data.data(), (DWORD)data.size(), NULL, &writeOverlapped) ||
+		(GetLastError() == ERROR_IO_PENDING)) {
+		writePending = true;
+		pendingIo++;
+	} else {
+		if (GetLastError() != ERROR_NO_DATA) {
 			Log::log(LOG_ERROR,
 				_T("Error writing message to pipe: {w32err}"));
 		}
 
-		delete[] message;
+		// The read side will find out the pipe is gone
+		sendQueue.clear();
 	}
 }
 
-void SessionConnection::onStatusChanged(AutoVPNStatus *status)
+void SessionConnection::finishWrite(DWORD bytes, DWORD error)
 {
-	sendMessage(AV_MESSAGE_STATUS, status, sizeof(AutoVPNStatus));
+	if (error != ERROR_SUCCESS) {
+		if ((error != ERROR_BROKEN_PIPE) && (error != ERROR_NO_DATA) &&
+			(error != ERROR_OPERATION_ABORTED)) {
+			SetLastError(error);
+			Log::log(LOG_ERROR,
+				_T("Error writing message to pipe: {w32err}"));
+		}
+	} else {
+		manager->countSent(bytes);
+	}
+
+	writePending = false;
+	sendQueue.pop_front();
+
+	startWrite();
+
+	// Status held back while the client was behind goes out now, as one
+	// message covering everything that changed in the meantime.
+	if (sendQueue.empty() && publishDeferred && (state == State::CONNECTED)) {
+		publishDeferred = false;
+		publish();
+	}
 }
 
-void SessionConnection::onSuggestion(LPCTSTR suggestion)
+void SessionConnection::onStatusChanged(const AutoVPNStatus *status, LPCTSTR suggestion,
+	unsigned long generation)
 {
-	time_t now;
-	time(&now);
-
-	// Only send the same suggestion once in a row per 60 seconds
-	bool send= true;
-	if (lastSuggestion.Compare(suggestion) == 0) {
-		if (lastSuggestionTime > 0) {
-			if ((now - lastSuggestionTime) < 60) {
-				send = false;
-			}
-		}
+	unique_lock<mutex> permit(latestLock);
+
+	// Registering and a broadcast can cross, since neither holds the
+	// controller lock while calling us.  Older news is dropped.
+	if (generation < latestGeneration) {
+		return;
 	}
 
-	if (send) {
-		// Send the (TCHAR)0 through as well to make things easier
-		sendMessage(AV_MESSAGE_SUGGESTION,
-			(void *)suggestion, (wcslen(suggestion) + 1) * sizeof(TCHAR));
+	latestStatus = *status;
+	latestSuggestion = suggestion;
+	latestGeneration = generation;
+
+	// The window starts at the first change, so a steady trickle can't
+	// hold things back forever.
+	if (!publishPending) {
+		publishPending = true;
+
+		// Negative means relative, in 100ns units
+		ULARGE_INTEGER due;
+		due.QuadPart = (ULONGLONG)(-10000LL * COALESCE_MILLISECONDS);
 
-		lastSuggestion = suggestion;
-		lastSuggestionTime = now;
+		FILETIME dueTime;
+		dueTime.dwLowDateTime = due.LowPart;
+		dueTime.dwHighDateTime = due.HighPart;
+
+		SetThreadpoolTimer(publishTimer, &dueTime, 0, 0);
 	}
 }
 
-void SessionConnection::start(bool first)
+void CALLBACK SessionConnection::publishTimerCallback(PTP_CALLBACK_INSTANCE, PVOID context, PTP_TIMER)
 {
-	this->first= first;
-	ResetEvent(stopEvent);
-	sessionThread= new thread(&SessionConnection::mainLoop, this);
+	((SessionConnection *)context)->postPublish();
 }
 
-void SessionConnection::stop()
+void SessionConnection::postPublish()
 {
-	SetEvent(stopEvent);
-	sessionThread->join();
+	// The publish itself happens on a worker like everything else, so it
+	// never runs alongside a read or write on this connection.
+	unique_lock<mutex> permit(ioLock);
+
+	if (state == State::CONNECTED) {
+		pendingIo++;
+		if (!PostQueuedCompletionStatus(port, 0, (ULONG_PTR)this, &publishOverlapped)) {
+			Log::log(LOG_ERROR, _T("Failed to post session publish: {w32err}"));
+			pendingIo--;
+		}
+	}
+}
+
+void SessionConnection::publish()
+{
+	if (!subscribed) {
+		return;
+	}
+
+	// Don't pile status up behind a client that isn't keeping up - it
+	// goes once the queue drains, as whatever is latest by then.
+	if (!sendQueue.empty()) {
+		publishDeferred = true;
+		return;
+	}
+
+	AutoVPNStatus status;
+	CString suggestion;
+	unsigned long generation;
+	{
+		unique_lock<mutex> permit(latestLock);
+		status = latestStatus;
+		suggestion = latestSuggestion;
+		generation = latestGeneration;
+		publishPending = false;
+	}
+
+	if (sentValid && (generation == sentGeneration)) {
+		return;
+	}
+
+	bool suggestionChanged = !sentValid || (sentSuggestion.Compare(suggestion) != 0);
+
+	if (protocolVersion >= AVP_VERSION) {
+		ProtocolWriter writer;
+
+		// The status record always goes, even if only the suggestion changed,
+		// so the client knows the generation.
+		if (!sentValid) {
+			addStatus(writer, status, generation);
+		} else {
+			addStatusDelta(writer, sentStatus, sentGeneration, status, generation);
+		}
+
+		if (suggestionChanged) {
+			writer.addText(AVP_RECORD_SUGGESTION, suggestion, suggestion.GetLength());
+		}
+
+		sendFrame(writer, true);
+	} else {
+		// Version 1 has no deltas, so it gets the whole struct when anything in
+		// it changed.
+		if (!sentValid || !Controller::sameStatus(sentStatus, status)) {
+			sendMessage(AV_MESSAGE_STATUS, &status, sizeof(AutoVPNStatus), true);
+		}
+
+		if (suggestionChanged) {
+			// Send the (TCHAR)0 through as well to make things easier
+			sendMessage(AV_MESSAGE_SUGGESTION,
+				(void *)(LPCTSTR)suggestion, (suggestion.GetLength() + 1) * sizeof(TCHAR), true);
+		}
+	}
 
-	delete sessionThread;
-	sessionThread = NULL;
+	sentStatus = status;
+	sentSuggestion = suggestion;
+	sentGeneration = generation;
+	sentValid = true;
 }
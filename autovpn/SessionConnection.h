@@ -10,42 +10,139 @@
 class SessionManager;
 class Controller;
 class Controller::StatusListener;
+class ProtocolWriter;
+struct ProtocolRecord;
 
+/*
+ * One instance of the session pipe, first listening and then serving the
+ * client that connected to it.  There's no thread here - every accept, read
+ * and write completes on the session manager's completion port, and the
+ * worker that picks it up calls onCompletion().  The I/O lock keeps two
+ * workers from handling the same connection at once.
+ */
 class SessionConnection : public Controller::StatusListener
 {
 public:
-	SessionConnection(SessionManager *manager, Controller *autoVPN);
+	SessionConnection(SessionManager *manager, Controller *autoVPN, HANDLE port);
 	~SessionConnection();
 
-	void start(bool first);
-	void stop();
+	// Creates the pipe instance and posts the accept, false if that failed.
+	// The security attributes belong to the caller and only need to last
+	// through the call.
+	bool listen(LPSECURITY_ATTRIBUTES securityAttributes);
 
-	void sendMessage(char type, void* data, size_t length);
+	// Cancels everything outstanding, so the connection finishes soon after
+	void shutdown();
 
-	virtual void onStatusChanged(AutoVPNStatus* status);
-	virtual void onSuggestion(LPCTSTR);
+	// Called by a worker for each completion.  Connected is set when this was
+	// the accept and a client is now attached.  Returns true once nothing is
+	// outstanding, at which point the caller deletes it.
+	bool onCompletion(LPOVERLAPPED overlapped, DWORD bytes, DWORD error, bool& connected);
+
+	// Whether a client ever connected, for the manager's listener count
+	bool hadClient() const {
+		return everConnected;
+	}
+
+	// These only queue the message, and are only called holding the I/O lock.
+	// Status messages are marked so a dropped one forces a full status next.
+
+	// Version 1 clients only
+	void sendMessage(char type, void* data, size_t length, bool status = false);
+
+	// Version 2 clients only
+	void sendFrame(ProtocolWriter& writer, bool status = false);
+
+	virtual void onStatusChanged(const AutoVPNStatus* status, LPCTSTR suggestion,
+		unsigned long generation);
 
 private:
 	SessionManager *manager;
 	Controller *autoVPN;
+	HANDLE port;
+	HANDLE pipe;
+
+	enum class State {
+		IDLE,
+		LISTENING,
+		CONNECTED,
+		CLOSING
+	};
+
+	mutex ioLock;
+	State state;
+	int pendingIo;
+	bool everConnected;
 
-	HANDLE stopEvent;
+	OVERLAPPED connectOverlapped;
+	OVERLAPPED readOverlapped;
+	OVERLAPPED publishOverlapped;
 
-	mutex sendLock;
-	HANDLE sendPipe;
+	vector<BYTE> readBuffer;
+	bool helloReceived;
+	bool discardRead;
 
-	// Don't send the same thing over and over
-	CString lastSuggestion;
-	time_t lastSuggestionTime;
+	// Written to the client one at a time.  A client that stops reading can
+	// only back up its own connection.  Status collapses to the latest while
+	// anything is waiting, and the queue drops oldest first when full.
+	struct Outbound {
+		vector<uint8_t> data;
+		bool status;
+	};
+	deque<Outbound> sendQueue;
+	OVERLAPPED writeOverlapped;
+	bool writePending;
+	bool publishDeferred;
 
-	bool first;
-	LPSECURITY_ATTRIBUTES buildSecurityAttributes();
-	void freeSecurityAttributes(LPSECURITY_ATTRIBUTES);
+	void queueSend(vector<uint8_t>&& data, bool status);
+	void startWrite();
+	void finishWrite(DWORD bytes, DWORD error);
 
-	bool handleClient(HANDLE pipe, HANDLE pipeEvent);
-	void mainLoop();
+	// The latest from the controller, which can call in at any time.  It gets
+	// sent once the timer fires, so a burst of changes goes out as one message.
+	mutex latestLock;
+	AutoVPNStatus latestStatus;
+	CString latestSuggestion;
+	unsigned long latestGeneration;
+	bool publishPending;
+	PTP_TIMER publishTimer;
 
+	static void CALLBACK publishTimerCallback(PTP_CALLBACK_INSTANCE, PVOID context, PTP_TIMER);
+	void postPublish();
+
+	// What this client has.  Until sentValid is set the next publish is a full
+	// snapshot.
+	bool subscribed;
+	bool sentValid;
+	AutoVPNStatus sentStatus;
+	CString sentSuggestion;
+	unsigned long sentGeneration;
+
+	void publish();
+
+	// Picked from the client's hello, and fixed for the life of the connection
+	int protocolVersion;
+
+	void postConnect();
+	void postRead();
+	void onConnected();
+	void onRead(DWORD bytes, DWORD error);
+	void close();
+
+	void processHello(BYTE *buffer, DWORD bufferLen);
 	void processMessage(char *message, int messageLen);
+	void processFrame(char *frame, int frameLen);
+	void answerQuery(ProtocolWriter& writer, const ProtocolRecord& query);
+
+	// The client's logon session, which the manager limits commands by so it
+	// can't keep the probes going by asking over and over.
+	ULONG clientSession;
+
+	void runCommand(ProtocolWriter& writer, uint16_t command);
 
-	thread *sessionThread;
+	static void addStatus(ProtocolWriter& writer, const AutoVPNStatus& status,
+		unsigned long generation);
+	static void addStatusDelta(ProtocolWriter& writer,
+		const AutoVPNStatus& base, unsigned long baseGeneration,
+		const AutoVPNStatus& status, unsigned long generation);
 };
@@ -12,93 +12,459 @@
 #include "SessionManager.h"
 #include "SessionConnection.h"
 
+// How often the sent message and byte counts are logged
+#define SENT_REPORT_MILLISECONDS	(60 * 60 * 1000)
+
+// Threads serving the completion port.  Each connection does very little
+// work per completion, so this doesn't need to grow with the user count.
+#define WORKER_THREADS				2
+
+// Pipe instances kept with an accept posted.  The target is the number of
+// connects in the window, kept between the minimum and maximum.
+#define LISTEN_MINIMUM				4
+#define LISTEN_MAXIMUM				64
+#define CONNECT_WINDOW_MILLISECONDS	10000
+
+// How often one logon session can ask for a recheck or a diagnostics run
+#define RECHECK_INTERVAL_MILLISECONDS		2000
+#define DIAGNOSTICS_INTERVAL_MILLISECONDS	30000
+
+// Delay before replacing a failed listener, doubled for each failure in a row
+#define REFILL_BACKOFF_MINIMUM		100
+#define REFILL_BACKOFF_MAXIMUM		5000
+
+// Posted to wake a worker so it picks up a new refill time
+#define REFILL_WAKE_KEY				1
+
 SessionManager::SessionManager(Controller *controller)
 {
 	this->controller = controller;
-	collectRun = false;
-	collectThread = NULL;
 
-	totalCnt= 0;
+	port= NULL;
+	listeningCnt= 0;
 	connectedCnt= 0;
 
-	spareTarget= 1;
 	rundown= false;
+	securityAttributes= NULL;
+
+	sentMessages= 0;
+	sentBytes= 0;
+	totalMessages= 0;
+	totalBytes= 0;
+	sentReportTime= 0;
 
-	collectEvent= CreateEvent(NULL, FALSE, FALSE, NULL);
+	refillTime= 0;
+	refillBackoff= 0;
 }
 
 SessionManager::~SessionManager()
 {
-	CloseHandle(collectEvent);
+	if (port != NULL) {
+		CloseHandle(port);
+	}
+	if (securityAttributes != NULL) {
+		freeSecurityAttributes(securityAttributes);
+	}
 }
 
-void SessionManager::connectionStart(SessionConnection *)
+LPSECURITY_ATTRIBUTES SessionManager::buildSecurityAttributes()
 {
-	std::unique_lock<std::mutex> lock(mutex);
+	LPSECURITY_ATTRIBUTES sa= (LPSECURITY_ATTRIBUTES)HeapAlloc(
+		GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SECURITY_ATTRIBUTES));
 
-	connectedCnt++;
-	if (!rundown && ((totalCnt - connectedCnt) < spareTarget)) {
-		SessionConnection *conn= new SessionConnection(this, controller);
-		connectionList.push_back(conn);
-		conn->start(false);
-		totalCnt++;
+	PSECURITY_DESCRIPTOR securityDescriptor= (PSECURITY_DESCRIPTOR)
+		HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, SECURITY_DESCRIPTOR_MIN_LENGTH);
+
+	SID_IDENTIFIER_AUTHORITY ntAuthority= SECURITY_NT_AUTHORITY;
+
+	PSID anonymousSid= NULL;
+	PTOKEN_USER userToken= NULL;
+
+	PACL acl= NULL;
+
+	bool success= false;
+	do {
+		if (!InitializeSecurityDescriptor(securityDescriptor, SECURITY_DESCRIPTOR_REVISION)) {
+			Log::log(LOG_ERROR,
+				_T("Failed to initialize session pipe security descriptor: {w32err}"));
+			break;
+		}
+
+		if (!AllocateAndInitializeSid(&ntAuthority, 1, SECURITY_INTERACTIVE_RID, 0, 0, 0, 0, 0, 0, 0, &anonymousSid)) {
+			Log::log(LOG_ERROR,
+				_T("Failed to allocate SID for session pipe: {w32err}"));
+			break;
+		}
+
+		HANDLE processToken;
+		if( !OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &processToken) )
+		{
+			Log::log(LOG_ERROR,
+				_T("Failed to open current process token: {w32err}"));
+			break;
+		}
+
+		DWORD userTokenLen;
+		if (GetTokenInformation(processToken, TokenUser, userToken, 0, &userTokenLen)) {
+			Log::log(LOG_ERROR,
+				_T("Failed to load token information for sesion pipe: {w32err}"));
+			CloseHandle(processToken);
+			break;
+		} else {
+			if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+				Log::log(LOG_ERROR,
+					_T("Failed to retrieve size for token information for session pipe: {w32err}"));
+				CloseHandle(processToken);
+				break;
+			}
+		}
+
+		userToken = (PTOKEN_USER)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, userTokenLen);
+		if (!GetTokenInformation(processToken, TokenUser, userToken, userTokenLen, &userTokenLen)) {
+			Log::log(LOG_ERROR,
+				_T("Failed to retrieve token information for sesion pipe: {w32err}"));
+			CloseHandle(processToken);
+			break;
+		}
+
+		CloseHandle(processToken);
+
+		PSID runningSid= userToken->User.Sid;
+		
+		DWORD aclSize= sizeof(ACL) + (2 * sizeof(ACCESS_ALLOWED_ACE) - sizeof(DWORD)) + GetLengthSid(anonymousSid) + GetLengthSid(runningSid);
+
+		acl= (PACL)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, aclSize);
+
+		if (!InitializeAcl(acl, aclSize, ACL_REVISION)) {
+			Log::log(LOG_ERROR,
+				_T("Failed to initialize ACL structure for session pipe: {w32err}"));
+			break;
+		}
+
+		if (!AddAccessAllowedAce(acl, ACL_REVISION, FILE_GENERIC_READ|FILE_GENERIC_WRITE, anonymousSid)) {
+			Log::log(LOG_ERROR,
+				_T("Failed to add anonymous ID to sesion pipe ACL: {w32err}"));
+			break;
+		}
+
+
+		if (!AddAccessAllowedAce(acl, ACL_REVISION, GENERIC_ALL, runningSid)) {
+			Log::log(LOG_ERROR,
+				_T("Failed to add SID for self to session pipe: {w32err}"));
+			break;
+		}
+
+		if (!SetSecurityDescriptorDacl(securityDescriptor, TRUE, acl, FALSE)) {
+			Log::log(LOG_ERROR,
+				_T("Failed to set security DACL on session pipe: {w32err}"));
+			break;
+		}
+
+		sa->nLength= sizeof(SECURITY_ATTRIBUTES);
+		sa->bInheritHandle= FALSE;
+		sa->lpSecurityDescriptor= securityDescriptor;
+		success= true;
+	} while (false);
+
+	if (anonymousSid) {
+		FreeSid(anonymousSid);
+	}
+	if (userToken) {
+		HeapFree(GetProcessHeap(), 0, userToken);
+	}
+
+	if (!success) {
+		if (acl) {
+			HeapFree(GetProcessHeap(), 0, acl);
+		}
+		HeapFree(GetProcessHeap(), 0, securityDescriptor);
+		HeapFree(GetProcessHeap(), 0, sa);
+		sa= NULL;
+	}
+
+	return sa;
+}
+
+void SessionManager::freeSecurityAttributes(LPSECURITY_ATTRIBUTES securityAttributes)
+{
+	// The ACL was allocated separately and only the descriptor points to it
+	BOOL aclPresent= FALSE;
+	BOOL aclDefaulted= FALSE;
+	PACL acl= NULL;
+	if (GetSecurityDescriptorDacl(securityAttributes->lpSecurityDescriptor,
+		&aclPresent, &acl, &aclDefaulted) && aclPresent && (acl != NULL)) {
+		HeapFree(GetProcessHeap(), 0, acl);
+	}
+
+	HeapFree(GetProcessHeap(), 0, securityAttributes->lpSecurityDescriptor);
+	HeapFree(GetProcessHeap(), 0, securityAttributes);
+}
+
+void SessionManager::countSent(DWORD bytes)
+{
+	sentMessages++;
+	sentBytes+= bytes;
+	totalMessages++;
+	totalBytes+= bytes;
+}
+
+int SessionManager::getSessionCount() const
+{
+	return connectedCnt;
+}
+
+void SessionManager::getSentTotals(unsigned long long& messages, unsigned long long& bytes) const
+{
+	messages= totalMessages;
+	bytes= totalBytes;
+}
+
+bool SessionManager::allowCommand(ULONG sessionId, bool diagnostics)
+{
+	std::unique_lock<std::mutex> lock(commandLock);
+
+	ULONGLONG now= GetTickCount64();
+
+	// Sessions that logged off would otherwise stay forever
+	for (auto it= commandTicks.begin(); it != commandTicks.end(); ) {
+		if (((now - it->second.recheck) >= RECHECK_INTERVAL_MILLISECONDS) &&
+			((now - it->second.diagnostics) >= DIAGNOSTICS_INTERVAL_MILLISECONDS)) {
+			it= commandTicks.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	auto found= commandTicks.find(sessionId);
+	if (found != commandTicks.end()) {
+		ULONGLONG lastTick= diagnostics ? found->second.diagnostics : found->second.recheck;
+		ULONGLONG interval= diagnostics ? DIAGNOSTICS_INTERVAL_MILLISECONDS : RECHECK_INTERVAL_MILLISECONDS;
+		if ((now - lastTick) < interval) {
+			return false;
+		}
 	}
+
+	// A new entry starts with the other command already allowed
+	CommandTicks& ticks= commandTicks[sessionId];
+	if (found == commandTicks.end()) {
+		ticks.recheck= now - RECHECK_INTERVAL_MILLISECONDS;
+		ticks.diagnostics= now - DIAGNOSTICS_INTERVAL_MILLISECONDS;
+	}
+	if (diagnostics) {
+		ticks.diagnostics= now;
+	} else {
+		ticks.recheck= now;
+	}
+
+	return true;
+}
+
+DWORD SessionManager::timerWait()
+{
+	ULONGLONG now= GetTickCount64();
+	ULONGLONG wakeTime= sentReportTime;
+
+	ULONGLONG pending= refillTime;
+	if ((pending != 0) && (pending < wakeTime)) {
+		wakeTime= pending;
+	}
+
+	return (now >= wakeTime) ? 0 : (DWORD)(wakeTime - now);
 }
 
-void SessionManager::connectionStop(SessionConnection * conn)
+void SessionManager::checkReport()
+{
+	ULONGLONG now= GetTickCount64();
+	ULONGLONG reportTime= sentReportTime;
+
+	// Whichever worker moves the time along does the logging
+	if ((now >= reportTime) &&
+		sentReportTime.compare_exchange_strong(reportTime, now + SENT_REPORT_MILLISECONDS)) {
+		unsigned long messages= sentMessages.exchange(0);
+		unsigned long long bytes= sentBytes.exchange(0);
+
+		Log::log(LOG_INFO,
+			_T("Sent %lu messages and %llu bytes to user sessions in the last hour"),
+			messages, bytes);
+	}
+}
+
+void SessionManager::workerLoop()
+{
+	for (bool run= true; run; ) {
+		DWORD bytes= 0;
+		ULONG_PTR key= 0;
+		LPOVERLAPPED overlapped= NULL;
+
+		BOOL success= ::GetQueuedCompletionStatus(port, &bytes, &key, &overlapped, timerWait());
+		DWORD error= success ? ERROR_SUCCESS : GetLastError();
+
+		if (overlapped == NULL) {
+			if (error == WAIT_TIMEOUT) {
+				checkReport();
+				checkRefill();
+			} else if (error != ERROR_SUCCESS) {
+				Log::log(LOG_ERROR,
+					_T("Session manager completion port wait failed: {w32err}"));
+				run= false;
+			} else if (key == 0) {
+				// Posted by stop()
+				run= false;
+			}
+			continue;
+		}
+
+		// Failed I/O still has its overlapped, and goes to the connection
+		// with the error.
+		SessionConnection *conn= (SessionConnection *)key;
+
+		bool connected= false;
+		bool done= conn->onCompletion(overlapped, bytes, error, connected);
+
+		if (connected) {
+			connectionStart();
+		}
+		if (done) {
+			connectionDone(conn);
+		}
+
+		// A busy port might never time out
+		checkRefill();
+	}
+
+	Log::log(LOG_DEBUG, _T("Session manager worker exiting"));
+}
+
+void SessionManager::connectionStart()
 {
-	bool stayAlive= false;
 	std::unique_lock<std::mutex> lock(mutex);
 
-	connectedCnt--;
+	listeningCnt--;
+	connectedCnt++;
+
+	recentConnects.push_back(GetTickCount64());
+
+	// Listening works again, whatever went wrong before
+	refillBackoff= 0;
+	refillTime= 0;
+
+	fillListeners();
+}
 
-	if (rundown || ((totalCnt - connectedCnt) > spareTarget)) {
-		collectList.push_back(conn);
-		SetEvent(collectEvent);
+int SessionManager::listenTarget()
+{
+	ULONGLONG now= GetTickCount64();
+	while (!recentConnects.empty() && ((now - recentConnects.front()) > CONNECT_WINDOW_MILLISECONDS)) {
+		recentConnects.pop_front();
 	}
+
+	return max(LISTEN_MINIMUM, min(LISTEN_MAXIMUM, (int)recentConnects.size()));
 }
 
-void SessionManager::collectLoop()
+void SessionManager::connectionDone(SessionConnection *conn)
 {
-	while (collectRun) {
-		Log::log(LOG_DEBUG, _T("Waiting to collect things"));
-		DWORD waitVal= ::WaitForSingleObject(collectEvent, INFINITE);
-		if (waitVal != WAIT_OBJECT_0) {
-			Log::log(LOG_ERROR,
-				_T("Session manager collection thread event wait failed: {w32err}"));
-			collectRun= false;
+	std::unique_lock<std::mutex> lock(mutex);
+
+	if (conn->hadClient()) {
+		connectedCnt--;
+	} else {
+		// A listener that failed or was cancelled.  It's replaced after the
+		// backoff rather than right here, or a pipe that keeps failing would
+		// spin, but it has to be replaced or we could run out entirely.
+		listeningCnt--;
+		if (!rundown) {
+			scheduleRefill();
 		}
+	}
 
-		Log::log(LOG_DEBUG, _T("Starting collection loop"));
-		std::unique_lock<std::mutex> lock(mutex);
-		while (!collectList.empty()) {
-			SessionConnection *conn= collectList.front();
-			collectList.pop_front();
-			totalCnt--;
+	// When the rate drops, spare listeners aren't closed - they just aren't
+	// replaced as clients use them up.
+
+	Log::log(LOG_DEBUG, _T("Session connection %p done"), conn);
+	connectionList.remove(conn);
+	delete conn;
+
+	drained.notify_all();
+}
 
-			Log::log(LOG_DEBUG, _T("Stopping session connection %p"), conn);
-			conn->stop();
-			Log::log(LOG_DEBUG, _T("Stop complete on %p"), conn);
+void SessionManager::fillListeners()
+{
+	int target= listenTarget();
 
-			connectionList.remove(conn);
+	while (!rundown && (listeningCnt < target)) {
+		SessionConnection *conn= new SessionConnection(this, controller, port);
+		if (!conn->listen(securityAttributes)) {
 			delete conn;
+			scheduleRefill();
+			break;
 		}
-		Log::log(LOG_DEBUG, _T("Collection loop done"));
+
+		connectionList.push_back(conn);
+		listeningCnt++;
+	}
+}
+
+void SessionManager::scheduleRefill()
+{
+	// Called holding the lock.  Failures while a refill is already waiting
+	// are covered by it.
+	if (refillTime != 0) {
+		return;
+	}
+
+	refillBackoff= (refillBackoff == 0) ? REFILL_BACKOFF_MINIMUM :
+		min((DWORD)REFILL_BACKOFF_MAXIMUM, refillBackoff * 2);
+	refillTime= GetTickCount64() + refillBackoff;
+
+	Log::log(LOG_DEBUG, _T("Replacing session listeners in %lu ms, %d listening"),
+		refillBackoff, listeningCnt);
+
+	// The workers could be waiting on the hourly report
+	::PostQueuedCompletionStatus(port, 0, REFILL_WAKE_KEY, NULL);
+}
+
+void SessionManager::checkRefill()
+{
+	ULONGLONG pending= refillTime;
+	if ((pending == 0) || (GetTickCount64() < pending)) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	// The other worker could have gotten here first
+	pending= refillTime;
+	if ((pending == 0) || (GetTickCount64() < pending)) {
+		return;
 	}
 
-	Log::log(LOG_DEBUG, _T("Session connection collection thread exiting"));
+	refillTime= 0;
+	fillListeners();
 }
 
 void SessionManager::start()
 {
-	collectRun= true;
-	collectThread= new std::thread(&SessionManager::collectLoop, this);
+	port= ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, WORKER_THREADS);
+	if (port == NULL) {
+		Log::log(LOG_ERROR,
+			_T("Failed to create session completion port: {w32err}"));
+		return;
+	}
 
-	while ((totalCnt - connectedCnt) < spareTarget) {
-		SessionConnection *conn= new SessionConnection(this, controller);
-		connectionList.push_back(conn);
-		conn->start(totalCnt == 0);
-		totalCnt++;
+	// Every instance gets the same descriptor, so there's no reason to go
+	// through the token and ACL again for each one.  Without it the pipe
+	// gets the default descriptor, which is what happened before anyway.
+	securityAttributes= buildSecurityAttributes();
+
+	sentReportTime= GetTickCount64() + SENT_REPORT_MILLISECONDS;
+
+	for (int i= 0; i < WORKER_THREADS; i++) {
+		workers.push_back(new std::thread(&SessionManager::workerLoop, this));
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		fillListeners();
 	}
 
 	Log::log(LOG_DEBUG, _T("Started pipe"));
@@ -106,19 +472,28 @@ void SessionManager::start()
 
 void SessionManager::stop()
 {
-	collectRun= false;
-	SetEvent(collectEvent);
-	collectThread->join();
-
-	delete collectThread;
-	collectThread = NULL;
+	if (port == NULL) {
+		return;
+	}
 
 	std::unique_lock<std::mutex> lock(mutex);
 
 	rundown= true;
 	for (auto conn : connectionList) {
-		Log::log(LOG_DEBUG, _T("Late stop - what happened to collect loop?"));
-		conn->stop();
-		delete conn;
+		conn->shutdown();
+	}
+
+	// Each one goes away when its cancelled I/O comes back to a worker
+	drained.wait(lock, [this] { return connectionList.empty(); });
+	lock.unlock();
+
+	for (size_t i= 0; i < workers.size(); i++) {
+		::PostQueuedCompletionStatus(port, 0, 0, NULL);
+	}
+
+	for (auto worker : workers) {
+		worker->join();
+		delete worker;
 	}
+	workers.clear();
 }
@@ -10,6 +10,14 @@
 class Controller;
 class SessionConnection;
 
+/*
+ * Serves every user session from one completion port and a few worker
+ * threads, instead of a thread per connection.  Several pipe instances
+ * always have an accept posted, and each time one of them gets a client
+ * another is created to take its place.  How many follows the recent
+ * connect rate, so a logon storm finds instances waiting instead of getting
+ * ERROR_PIPE_BUSY.
+ */
 class SessionManager
 {
 public:
@@ -19,28 +27,72 @@ public:
 	void start();
 	void stop();
 
-	void connectionStart(SessionConnection *);
-	void connectionStop(SessionConnection *);
+	// Called for every message written to a client, for the hourly totals
+	void countSent(DWORD bytes);
+
+	// For the counters query, neither takes the lock
+	int getSessionCount() const;
+	void getSentTotals(unsigned long long& messages, unsigned long long& bytes) const;
+
+	// Whether the logon session can have a recheck or diagnostics run now,
+	// and if so starts its wait for the next one.  Kept here rather than per
+	// connection so reconnecting doesn't get around it.  Only takes its own
+	// lock, so it's safe holding a connection's I/O lock.
+	bool allowCommand(ULONG sessionId, bool diagnostics);
 
 private:
-	mutex mutex;
+	std::mutex mutex;
 
 	Controller* controller;
 
 	bool rundown;
 
-	list<SessionConnection *> connectionList;
+	HANDLE port;
+	std::vector<std::thread *> workers;
+	void workerLoop();
 
-	int totalCnt;
-	int connectedCnt;
+	std::list<SessionConnection *> connectionList;
+	std::condition_variable drained;
 
-	void collectLoop();
+	int listeningCnt;
+	// Only changed holding the lock, but read without it
+	std::atomic<int> connectedCnt;
 
-	volatile bool collectRun;
-	std::thread *collectThread;
-	std::deque<SessionConnection *> collectList;
-	HANDLE collectEvent;
+	// Built once and shared by every pipe instance
+	LPSECURITY_ATTRIBUTES securityAttributes;
+	LPSECURITY_ATTRIBUTES buildSecurityAttributes();
+	void freeSecurityAttributes(LPSECURITY_ATTRIBUTES);
 
-	int spareTarget;
-};
+	// Tick counts of the connects inside the rate window
+	std::deque<ULONGLONG> recentConnects;
+	int listenTarget();
+
+	// Called from the workers, never holding a connection's I/O lock
+	void connectionStart();
+	void connectionDone(SessionConnection *);
+	void fillListeners();
 
+	// Listeners that failed are replaced after a delay that doubles each time
+	// another one fails, and goes back to nothing once a client gets through.
+	// Zero means no refill is waiting.
+	std::atomic<ULONGLONG> refillTime;
+	DWORD refillBackoff;
+	void scheduleRefill();
+	void checkRefill();
+
+	// When each logon session last got each command through
+	struct CommandTicks {
+		ULONGLONG recheck;
+		ULONGLONG diagnostics;
+	};
+	std::mutex commandLock;
+	std::map<ULONG, CommandTicks> commandTicks;
+
+	std::atomic<unsigned long> sentMessages;
+	std::atomic<unsigned long long> sentBytes;
+	std::atomic<ULONGLONG> sentReportTime;
+	std::atomic<unsigned long long> totalMessages;
+	std::atomic<unsigned long long> totalBytes;
+	DWORD timerWait();
+	void checkReport();
+};
@@ -32,7 +32,7 @@ Settings Settings::getSubKey(LPCTSTR name)
 	}
 	regStatus = RegOpenKeyEx(preferenceRoot, name, 0, GENERIC_READ, &subPreferenceRoot);
 	if (regStatus != ERROR_SUCCESS) {
-		subPolicyRoot = NULL;
+		subPreferenceRoot = NULL;
 	}
 
 	// Do in one line instead of creating an object or we get in a pickle
@@ -171,4 +171,120 @@ bool Settings::readInt(LPCTSTR name, int& value)
 		rval = readInt(preferenceRoot, name, value);
 	}
 	return rval;
-}
\ No newline at end of file
+}
+
+bool Settings::readStrings(HKEY root, LPCTSTR name, vector<CString>& values)
+{
+	bool rval = false;
+
+	// Size it first, since a list can easily go past MAX_VALUE
+	DWORD regType = 0;
+	DWORD bufferLen = 0;
+
+	if ((RegQueryValueEx(root, name, NULL, &regType, NULL, &bufferLen) == ERROR_SUCCESS) &&
+		((regType == REG_SZ) || (regType == REG_MULTI_SZ))) {
+		// Room for both terminators in case the value was stored without them
+		DWORD length = bufferLen / sizeof(TCHAR);
+		TCHAR *buffer = new TCHAR[length + 2];
+
+		if (RegQueryValueEx(root, name, NULL, &regType, (LPBYTE)buffer, &bufferLen) == ERROR_SUCCESS) {
+			length = bufferLen / sizeof(TCHAR);
+			buffer[length] = '\0';
+			buffer[length + 1] = '\0';
+
+			values.clear();
+
+			if (regType == REG_MULTI_SZ) {
+				for (LPCTSTR entry = buffer; *entry != '\0'; entry += _tcslen(entry) + 1) {
+					CString value(entry);
+					value.Trim();
+					if (!value.IsEmpty()) {
+						values.push_back(value);
+					}
+				}
+			} else {
+				CString text(buffer);
+				int position = 0;
+				for (CString token = text.Tokenize(_T(" \t\r\n"), position);
+					position >= 0; token = text.Tokenize(_T(" \t\r\n"), position)) {
+					values.push_back(token);
+				}
+			}
+			rval = true;
+		}
+
+		delete[] buffer;
+	}
+
+	return rval;
+}
+
+bool Settings::readStrings(LPCTSTR name, vector<CString>& values)
+{
+	bool rval = false;
+
+	if (policyRoot != NULL) {
+		rval = readStrings(policyRoot, name, values);
+	}
+	if (!rval && (preferenceRoot != NULL)) {
+		rval = readStrings(preferenceRoot, name, values);
+	}
+	return rval;
+}
+
+void Settings::readValues(HKEY root, LPCTSTR subKeyName, list<pair<CString, CString>>& values)
+{
+	if (root == NULL) {
+		return;
+	}
+
+	HKEY subKey;
+	DWORD regStatus = RegOpenKeyEx(root, subKeyName, 0, KEY_QUERY_VALUE, &subKey);
+
+	if (regStatus == ERROR_SUCCESS) {
+		// Size the buffers off the key itself - network lists in particular can
+		// get a lot longer than MAX_VALUE.
+		DWORD maxNameLen = 0;
+		DWORD maxValueLen = 0;
+		regStatus = RegQueryInfoKey(subKey, NULL, NULL, NULL, NULL, NULL, NULL,
+			NULL, &maxNameLen, &maxValueLen, NULL, NULL);
+
+		if (regStatus != ERROR_SUCCESS) {
+			Log::log(LOG_ERROR,
+				_T("Error %08X querying registry key %s"), regStatus, subKeyName);
+		} else {
+			TCHAR *name = new TCHAR[maxNameLen + 1];
+			TCHAR *value = new TCHAR[(maxValueLen / sizeof(TCHAR)) + 1];
+
+			for (DWORD index = 0; ; index++) {
+				DWORD nameLen = maxNameLen + 1;
+				DWORD valueLen = maxValueLen;
+				DWORD regType = 0;
+
+				regStatus = RegEnumValue(subKey, index,
+					name, &nameLen, NULL, &regType, (LPBYTE)value, &valueLen);
+
+				if (regStatus == ERROR_NO_MORE_ITEMS) {
+					break;
+				} else if (regStatus == ERROR_SUCCESS) {
+					if (regType == REG_SZ) {
+						value[valueLen / sizeof(TCHAR)] = '\0';
+						values.push_back(pair<CString, CString>(CString(name), CString(value)));
+					}
+				} else {
+					Log::log(LOG_ERROR,
+						_T("Error %08X enumerating registry key %s"), regStatus, subKeyName);
+					break;
+				}
+			}
+
+			delete[] name;
+			delete[] value;
+		}
+
+		RegCloseKey(subKey);
+	} else if (regStatus != ERROR_FILE_NOT_FOUND) {
+		Log::log(LOG_ERROR,
+			_T("Error %08X opening registry key %s"), regStatus, subKeyName);
+	}
+}
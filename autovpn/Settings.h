@@ -21,10 +21,15 @@ public:
 
 	static bool readString(HKEY, LPCTSTR, CString&);
 	static bool readInt(HKEY, LPCTSTR, int&);
+	static void readValues(HKEY, LPCTSTR, list<pair<CString, CString>>&);
+	static bool readStrings(HKEY, LPCTSTR, vector<CString>&);
 
 	bool readString(LPCTSTR, CString&);
 	bool readInt(LPCTSTR, int&);
 
+	// REG_MULTI_SZ, or REG_SZ with the entries separated by whitespace
+	bool readStrings(LPCTSTR, vector<CString>&);
+
 	Settings getSubKey(LPCTSTR name);
 
 private:
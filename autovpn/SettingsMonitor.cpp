@@ -0,0 +1,161 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "Settings.h"
+#include "SettingsSnapshot.h"
+#include "SettingsMonitor.h"
+#include "Controller.h"
+
+// A GPO refresh writes values one at a time, so wait for things to go quiet
+// before reloading or we'll pick up half an update.
+#define SETTLE_MILLISECONDS 1000
+
+#define NOTIFY_FILTER (REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET)
+
+SettingsMonitor::SettingsMonitor(Controller *controller)
+{
+	this->controller = controller;
+
+	generation = 0;
+	watchThread = NULL;
+	stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	reload();
+}
+
+SettingsMonitor::~SettingsMonitor()
+{
+	CloseHandle(stopEvent);
+}
+
+shared_ptr<const SettingsSnapshot> SettingsMonitor::get()
+{
+	return atomic_load(&current);
+}
+
+void SettingsMonitor::reload()
+{
+	// Only the constructor and the watch thread get here, and never at the same
+	// time, so generation doesn't need any protection.
+	shared_ptr<const SettingsSnapshot> snapshot = SettingsSnapshot::load(++generation);
+	atomic_store(&current, snapshot);
+}
+
+void SettingsMonitor::watchLoop()
+{
+	// We watch all of Software\Policies rather than our own key, because our key
+	// doesn't exist until the first time a GPO with our settings gets applied.
+	// The preference key gets created by Settings if it isn't there.
+	HKEY policies = NULL;
+	HKEY preferences = NULL;
+
+	DWORD rval = RegOpenKeyEx(HKEY_LOCAL_MACHINE,
+		_T("Software\\Policies"), 0, KEY_NOTIFY, &policies);
+	if (rval != ERROR_SUCCESS) {
+		Log::log(LOG_ERROR, _T("Error %08X opening policy key for notification"), rval);
+		policies = NULL;
+	}
+
+	rval = RegOpenKeyEx(HKEY_LOCAL_MACHINE,
+		_T("Software\\") REG_COMPANY _T("\\") REG_PRODUCT, 0, KEY_NOTIFY, &preferences);
+	if (rval != ERROR_SUCCESS) {
+		Log::log(LOG_ERROR, _T("Error %08X opening preference key for notification"), rval);
+		preferences = NULL;
+	}
+
+	HANDLE events[3];
+	events[0] = stopEvent;
+	events[1] = CreateEvent(NULL, FALSE, FALSE, NULL);
+	events[2] = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	// A notification is one-shot, so only re-arm the ones that have fired or
+	// we'd stack up registrations on the quiet key.
+	bool armPolicies = true;
+	bool armPreferences = true;
+
+	auto arm = [&]() {
+		if (armPolicies && (policies != NULL)) {
+			rval = RegNotifyChangeKeyValue(policies, TRUE, NOTIFY_FILTER, events[1], TRUE);
+			if (rval != ERROR_SUCCESS) {
+				Log::log(LOG_ERROR, _T("Error %08X watching policy key"), rval);
+			}
+		}
+		if (armPreferences && (preferences != NULL)) {
+			rval = RegNotifyChangeKeyValue(preferences, TRUE, NOTIFY_FILTER, events[2], TRUE);
+			if (rval != ERROR_SUCCESS) {
+				Log::log(LOG_ERROR, _T("Error %08X watching preference key"), rval);
+			}
+		}
+		armPolicies = false;
+		armPreferences = false;
+	};
+
+	arm();
+
+	for (bool run = true; run; ) {
+		DWORD waitValue = WaitForMultipleObjects(3, events, FALSE, INFINITE);
+		if (waitValue == WAIT_OBJECT_0) {
+			run = false;
+		} else if ((waitValue == (WAIT_OBJECT_0 + 1)) || (waitValue == (WAIT_OBJECT_0 + 2))) {
+			armPolicies = (waitValue == (WAIT_OBJECT_0 + 1));
+			armPreferences = (waitValue == (WAIT_OBJECT_0 + 2));
+
+			if (WaitForSingleObject(stopEvent, SETTLE_MILLISECONDS) == WAIT_OBJECT_0) {
+				run = false;
+			} else {
+				// The other key may have fired while we were settling
+				if (WaitForSingleObject(events[1], 0) == WAIT_OBJECT_0) {
+					armPolicies = true;
+				}
+				if (WaitForSingleObject(events[2], 0) == WAIT_OBJECT_0) {
+					armPreferences = true;
+				}
+
+				// Arm before we reload, so anything that changes while we're
+				// reading trips the notification again instead of getting lost.
+				arm();
+
+				Log::log(LOG_INFO, _T("Registry settings changed, reloading"));
+				reload();
+				controller->requestCycle();
+			}
+		} else {
+			Log::log(LOG_ERROR,
+				_T("SettingsMonitor: error in WaitForMultipleObjects: {w32err}"));
+			run = false;
+		}
+	}
+
+	CloseHandle(events[1]);
+	CloseHandle(events[2]);
+
+	if (policies != NULL) {
+		RegCloseKey(policies);
+	}
+	if (preferences != NULL) {
+		RegCloseKey(preferences);
+	}
+}
+
+void SettingsMonitor::start()
+{
+	ResetEvent(stopEvent);
+	watchThread = new thread(&SettingsMonitor::watchLoop, this);
+}
+
+void SettingsMonitor::stop()
+{
+	if (watchThread != NULL) {
+		SetEvent(stopEvent);
+		watchThread->join();
+
+		delete watchThread;
+		watchThread = NULL;
+	}
+}
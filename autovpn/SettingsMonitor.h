@@ -0,0 +1,40 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+class Controller;
+class SettingsSnapshot;
+
+/*
+ * Keeps the current SettingsSnapshot, and watches the policy and preference
+ * keys so a new snapshot gets swapped in as soon as a GPO update lands.
+ */
+class SettingsMonitor
+{
+public:
+	SettingsMonitor(Controller *);
+	virtual ~SettingsMonitor();
+
+	void start();
+	void stop();
+
+	shared_ptr<const SettingsSnapshot> get();
+
+private:
+	Controller *controller;
+
+	// Only touched through atomic_load / atomic_store
+	shared_ptr<const SettingsSnapshot> current;
+	unsigned long generation;
+
+	void reload();
+	void watchLoop();
+
+	HANDLE stopEvent;
+	thread *watchThread;
+};
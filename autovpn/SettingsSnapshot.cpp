@@ -0,0 +1,166 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "Settings.h"
+#include "SettingsSnapshot.h"
+#include "Ip4Network.h"
+
+// A DNS answer for the enable flag that takes longer than this isn't coming
+#define DEFAULT_ENABLE_HOSTNAME_TIMEOUT 2000
+
+// Long enough for a slow hotel network, short enough the user isn't left wondering
+#define DEFAULT_DIAGNOSTICS_TIMEOUT 15000
+
+// Per-step limits for a single probe, well under the whole run so one stuck
+// step doesn't use up the time for everything else.
+#define DEFAULT_PROBE_CONNECT_TIMEOUT 5000
+#define DEFAULT_PROBE_SEND_TIMEOUT 5000
+#define DEFAULT_PROBE_RECEIVE_TIMEOUT 10000
+
+SettingsSnapshot::SettingsSnapshot()
+{
+	generation = 0;
+
+	vpnServiceName = _T("OpenVPNService");
+
+	signalWarningLimit = 50;
+	rxRateWarningLimit = 10000;
+	txRateWarningLimit = 10000;
+
+	enableHostnameTimeout = DEFAULT_ENABLE_HOSTNAME_TIMEOUT;
+
+	// For the unencrypted there's no reason not to use the MS NCSI server
+	unencryptedInternetUrls.push_back(_T("http://www.msftncsi.com/ncsi.txt"));
+	unencryptedInternetContent = _T("Microsoft NCSI");
+
+	diagnosticsTimeout = DEFAULT_DIAGNOSTICS_TIMEOUT;
+	diagnosticsCacheSeconds = 60;
+	diagnosticsEngine = 1;
+
+	probeConnectTimeout = DEFAULT_PROBE_CONNECT_TIMEOUT;
+	probeSendTimeout = DEFAULT_PROBE_SEND_TIMEOUT;
+	probeReceiveTimeout = DEFAULT_PROBE_RECEIVE_TIMEOUT;
+}
+
+shared_ptr<const SettingsSnapshot> SettingsSnapshot::load(unsigned long generation)
+{
+	shared_ptr<SettingsSnapshot> snapshot = make_shared<SettingsSnapshot>();
+	snapshot->generation = generation;
+
+	Settings settings;
+	settings.readString(_T("VPNServiceName"), snapshot->vpnServiceName);
+
+	settings.readInt(_T("WifiSignalWarningLimit"), snapshot->signalWarningLimit);
+	settings.readInt(_T("WifiRxRateWarningLimit"), snapshot->rxRateWarningLimit);
+	settings.readInt(_T("WifiTxRateWarningLimit"), snapshot->txRateWarningLimit);
+
+	settings.readString(_T("EnableHostname"), snapshot->enableHostname);
+	settings.readInt(_T("EnableHostnameTimeout"), snapshot->enableHostnameTimeout);
+	if (snapshot->enableHostnameTimeout <= 0) {
+		// Zero gives up before the query goes out, and negative is INFINITE
+		snapshot->enableHostnameTimeout = DEFAULT_ENABLE_HOSTNAME_TIMEOUT;
+	}
+
+	settings.readStrings(_T("UnencryptedInternetUrl"), snapshot->unencryptedInternetUrls);
+	settings.readString(_T("UnencryptedInternetContent"), snapshot->unencryptedInternetContent);
+	settings.readStrings(_T("EncryptedInternetUrl"), snapshot->encryptedInternetUrls);
+	settings.readString(_T("EncryptedInternetContent"), snapshot->encryptedInternetContent);
+	settings.readStrings(_T("EncryptedInternetPins"), snapshot->encryptedInternetPins);
+
+	settings.readInt(_T("DiagnosticsTimeout"), snapshot->diagnosticsTimeout);
+	if (snapshot->diagnosticsTimeout <= 0) {
+		snapshot->diagnosticsTimeout = DEFAULT_DIAGNOSTICS_TIMEOUT;
+	}
+	settings.readInt(_T("DiagnosticsCacheSeconds"), snapshot->diagnosticsCacheSeconds);
+	settings.readInt(_T("DiagnosticsEngine"), snapshot->diagnosticsEngine);
+	settings.readString(_T("HeadendAddress"), snapshot->headendAddress);
+
+	// Zero is forever to WinHttp, which is never what anybody wants here
+	settings.readInt(_T("ProbeConnectTimeout"), snapshot->probeConnectTimeout);
+	if (snapshot->probeConnectTimeout <= 0) {
+		snapshot->probeConnectTimeout = DEFAULT_PROBE_CONNECT_TIMEOUT;
+	}
+	settings.readInt(_T("ProbeSendTimeout"), snapshot->probeSendTimeout);
+	if (snapshot->probeSendTimeout <= 0) {
+		snapshot->probeSendTimeout = DEFAULT_PROBE_SEND_TIMEOUT;
+	}
+	settings.readInt(_T("ProbeReceiveTimeout"), snapshot->probeReceiveTimeout);
+	if (snapshot->probeReceiveTimeout <= 0) {
+		snapshot->probeReceiveTimeout = DEFAULT_PROBE_RECEIVE_TIMEOUT;
+	}
+
+	// Networks are additive between policy and preferences, but for suggestions
+	// the policy wins.  Loading policy first takes care of that since map::insert
+	// doesn't overwrite.
+	snapshot->loadInternalNetworks(settings.getPolicyRoot());
+	snapshot->loadInternalNetworks(settings.getPreferenceRoot());
+
+	snapshot->loadSuggestions(settings.getPolicyRoot());
+	snapshot->loadSuggestions(settings.getPreferenceRoot());
+
+	Log::log(LOG_DEBUG, _T("Loaded settings generation %lu with %zu internal networks"),
+		generation, snapshot->internalNetworks.size());
+
+	return snapshot;
+}
+
+void SettingsSnapshot::loadInternalNetworks(HKEY root)
+{
+	list<pair<CString, CString>> values;
+	Settings::readValues(root, _T("InternalNetworks"), values);
+
+	for (pair<CString, CString>& value : values) {
+		// Walk the list in place instead of tokenizing into new strings
+		LPCTSTR text = value.second;
+		int length = value.second.GetLength();
+
+		for (int start = 0; start < length; ) {
+			int end = start;
+			while ((end < length) && (_tcschr(_T(" ,;"), text[end]) == NULL)) {
+				end++;
+			}
+
+			if (end > start) {
+				Ip4Network network;
+				if (Ip4Network::parse(text + start, (size_t)(end - start), network)) {
+					internalNetworks.add(network);
+				} else {
+					Log::log(LOG_DEBUG,
+						_T("Unable to understand network %s"),
+						(LPCTSTR)value.second.Mid(start, end - start));
+				}
+			}
+
+			start = end + 1;
+		}
+	}
+}
+
+void SettingsSnapshot::loadSuggestions(HKEY root)
+{
+	list<pair<CString, CString>> values;
+	Settings::readValues(root, _T("Suggestions"), values);
+
+	for (pair<CString, CString>& value : values) {
+		suggestions.insert(value);
+	}
+}
+
+bool SettingsSnapshot::lookupSuggestion(LPCTSTR tag, CString& text) const
+{
+	bool rval = false;
+
+	map<CString, CString, NoCaseLess>::const_iterator found = suggestions.find(CString(tag));
+	if (found != suggestions.end()) {
+		text = found->second;
+		rval = true;
+	}
+
+	return rval;
+}
@@ -0,0 +1,108 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include "NetworkTrie.h"
+
+/*
+ * An immutable copy of everything we use out of the registry.  One of these
+ * is loaded at startup and again whenever the registry changes, and anybody
+ * who needs settings holds onto the current one through a shared_ptr.  That
+ * way a reload never changes values out from under a cycle in progress.
+ */
+class SettingsSnapshot
+{
+public:
+	static shared_ptr<const SettingsSnapshot> load(unsigned long generation);
+
+	// This goes up by one every time the settings are reloaded
+	unsigned long getGeneration() const { return generation; }
+
+	const CString& getVpnServiceName() const { return vpnServiceName; }
+
+	int getSignalWarningLimit() const { return signalWarningLimit; }
+	int getRxRateWarningLimit() const { return rxRateWarningLimit; }
+	int getTxRateWarningLimit() const { return txRateWarningLimit; }
+
+	const CString& getEnableHostname() const { return enableHostname; }
+	int getEnableHostnameTimeout() const { return enableHostnameTimeout; }
+
+	// Each can list several endpoints serving the same content, which are raced
+	const vector<CString>& getUnencryptedInternetUrls() const { return unencryptedInternetUrls; }
+	const CString& getUnencryptedInternetContent() const { return unencryptedInternetContent; }
+	const vector<CString>& getEncryptedInternetUrls() const { return encryptedInternetUrls; }
+	const CString& getEncryptedInternetContent() const { return encryptedInternetContent; }
+
+	// Base64 SHA-256 of SubjectPublicKeyInfo - if set, the encrypted check only
+	// does a TLS handshake and compares the server's keys against these
+	const vector<CString>& getEncryptedInternetPins() const { return encryptedInternetPins; }
+
+	// Milliseconds a whole diagnostics run is allowed before it's cut off
+	int getDiagnosticsTimeout() const { return diagnosticsTimeout; }
+
+	// How long a probe result is reused on the same network, zero to not cache
+	int getDiagnosticsCacheSeconds() const { return diagnosticsCacheSeconds; }
+
+	// 1 for the original sequential checks, 2 for the concurrent ones
+	int getDiagnosticsEngine() const { return diagnosticsEngine; }
+
+	// host or host:port of something on the VPN headend that takes TCP connections
+	const CString& getHeadendAddress() const { return headendAddress; }
+
+	// Milliseconds for each step of a single probe - connect also covers the name lookup
+	int getProbeConnectTimeout() const { return probeConnectTimeout; }
+	int getProbeSendTimeout() const { return probeSendTimeout; }
+	int getProbeReceiveTimeout() const { return probeReceiveTimeout; }
+
+	// Built once here, so the controller doesn't re-parse the list every cycle
+	const NetworkTrie& getInternalNetworks() const { return internalNetworks; }
+
+	bool lookupSuggestion(LPCTSTR tag, CString& text) const;
+
+	SettingsSnapshot();
+
+private:
+	unsigned long generation;
+
+	CString vpnServiceName;
+
+	int signalWarningLimit;
+	int rxRateWarningLimit;
+	int txRateWarningLimit;
+
+	CString enableHostname;
+	int enableHostnameTimeout;
+
+	vector<CString> unencryptedInternetUrls;
+	CString unencryptedInternetContent;
+	vector<CString> encryptedInternetUrls;
+	CString encryptedInternetContent;
+	vector<CString> encryptedInternetPins;
+
+	int diagnosticsTimeout;
+	int diagnosticsCacheSeconds;
+	int diagnosticsEngine;
+	CString headendAddress;
+
+	int probeConnectTimeout;
+	int probeSendTimeout;
+	int probeReceiveTimeout;
+
+	NetworkTrie internalNetworks;
+
+	// Registry value names aren't case sensitive, so lookups shouldn't be either
+	struct NoCaseLess {
+		bool operator()(const CString& a, const CString& b) const {
+			return a.CompareNoCase(b) < 0;
+		}
+	};
+	map<CString, CString, NoCaseLess> suggestions;
+
+	void loadInternalNetworks(HKEY root);
+	void loadSuggestions(HKEY root);
+};
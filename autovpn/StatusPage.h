@@ -0,0 +1,182 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include "Message.h"
+
+/*
+ * The current status, published by the service into a named section that
+ * anyone logged on interactively can map read-only.  Reading it is just a
+ * copy out of memory - no pipe, and nothing the service does per reader.
+ *
+ * The section is guarded by a sequence lock.  The service bumps the sequence
+ * to odd before it writes and back to even after, so a reader copies the data
+ * between two reads of the sequence and tries again if they don't match or
+ * were odd.  Sequence / 2 is the number of completed updates.
+ *
+ * There are two manual-reset events, for even and odd update counts.  Before
+ * update N the service resets event (N + 1) % 2, and after it sets event
+ * N % 2, so a reader that saw N updates waits on event (N + 1) % 2.  A reader
+ * that was asleep through two updates could miss its wakeup, so waits should
+ * have a timeout and check the sequence again.
+ *
+ * Not every update is a status change.  The counters are rewritten once a
+ * cycle as an update of their own, with the generation left as it was, so a
+ * reader that only follows status compares generations rather than updates.
+ *
+ * Everything is in host order and packed the same as Message.h, since both
+ * ends are on the same machine.
+ */
+
+#pragma pack(push, autovpn, 16)
+
+#define AVSP_SECTION_NAME			_T("Global\\teaglu_autovpn_status")
+#define AVSP_EVENT_NAME_EVEN		_T("Global\\teaglu_autovpn_status_0")
+#define AVSP_EVENT_NAME_ODD			_T("Global\\teaglu_autovpn_status_1")
+
+#define AVSP_MAGIC					0x50535641	// "AVSP"
+#define AVSP_LAYOUT					2
+
+// Characters including the terminator - longer suggestions are cut off
+#define AVSP_SUGGESTION_SIZE		512
+
+// Attempts to get a clean copy before giving up on a busy writer
+#define AVSP_READ_ATTEMPTS			64
+
+typedef struct _AutoVPNStatusPageData {
+	unsigned long generation;			// Status generation, same as on the pipe
+	AutoVPNStatus status;
+	wchar_t suggestion[AVSP_SUGGESTION_SIZE];
+
+	// Rewritten every cycle, without changing the generation
+	unsigned long uptimeSeconds;
+	unsigned long cycles;
+	unsigned long transitions;
+	unsigned long diagnosticRuns;
+	unsigned long diagnosticTimeouts;
+	unsigned long enableLookups;
+	unsigned long enableFailures;
+	unsigned long enableTimeouts;
+	unsigned long enableLastLatency;		// Milliseconds
+	unsigned long enableMaxLatency;
+	unsigned long enableAverageLatency;
+} AutoVPNStatusPageData;
+
+typedef struct _AutoVPNStatusPage {
+	unsigned long magic;
+	unsigned long layout;
+	volatile LONG sequence;
+	AutoVPNStatusPageData data;
+} AutoVPNStatusPage;
+
+#pragma pack(pop, autovpn)
+
+// Maps the page read-only.  Anything that fails just means the service isn't
+// running or is too old, and the caller can try again later.
+class StatusPageReader {
+public:
+	StatusPageReader() {
+		section = NULL;
+		page = NULL;
+		events[0] = NULL;
+		events[1] = NULL;
+	}
+
+	~StatusPageReader() {
+		close();
+	}
+
+	bool open() {
+		close();
+
+		section = ::OpenFileMapping(FILE_MAP_READ, FALSE, AVSP_SECTION_NAME);
+		if (section != NULL) {
+			page = (const AutoVPNStatusPage *)::MapViewOfFile(section, FILE_MAP_READ, 0, 0, sizeof(AutoVPNStatusPage));
+		}
+		events[0] = ::OpenEvent(SYNCHRONIZE, FALSE, AVSP_EVENT_NAME_EVEN);
+		events[1] = ::OpenEvent(SYNCHRONIZE, FALSE, AVSP_EVENT_NAME_ODD);
+
+		if ((page == NULL) || (events[0] == NULL) || (events[1] == NULL) ||
+			(page->magic != AVSP_MAGIC) || (page->layout != AVSP_LAYOUT)) {
+			close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void close() {
+		if (page != NULL) {
+			::UnmapViewOfFile(page);
+			page = NULL;
+		}
+		if (section != NULL) {
+			::CloseHandle(section);
+			section = NULL;
+		}
+		for (int i = 0; i < 2; i++) {
+			if (events[i] != NULL) {
+				::CloseHandle(events[i]);
+				events[i] = NULL;
+			}
+		}
+	}
+
+	bool isOpen() const {
+		return page != NULL;
+	}
+
+	// Copies out a consistent view.  Updates is set to the count it came
+	// from, for wait().  False if the page isn't open, nothing has been
+	// published yet, or the writer stayed busy the whole time.
+	bool read(AutoVPNStatusPageData& data, LONG& updates) const {
+		if (page == NULL) {
+			return false;
+		}
+
+		for (int attempt = 0; attempt < AVSP_READ_ATTEMPTS; attempt++) {
+			LONG before = page->sequence;
+			MemoryBarrier();
+
+			if (before & 1) {
+				YieldProcessor();
+				continue;
+			}
+
+			memcpy(&data, (const void *)&page->data, sizeof(data));
+
+			MemoryBarrier();
+			if (page->sequence == before) {
+				updates = before / 2;
+				return updates > 0;
+			}
+		}
+
+		return false;
+	}
+
+	// Waits for the update after the one read() returned, true if it came.
+	// A timeout can also mean two updates went by before the wait started,
+	// so read() again either way.
+	bool wait(LONG updates, DWORD timeoutMs) const {
+		if (page == NULL) {
+			return false;
+		}
+		return ::WaitForSingleObject(getUpdateEvent(updates), timeoutMs) == WAIT_OBJECT_0;
+	}
+
+	// The event wait() uses, for waiting on it along with something else
+	HANDLE getUpdateEvent(LONG updates) const {
+		return events[(updates + 1) % 2];
+	}
+
+private:
+	HANDLE section;
+	const AutoVPNStatusPage *page;
+	HANDLE events[2];
+};
@@ -0,0 +1,242 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "StatusPageWriter.h"
+#include "Log.h"
+
+StatusPageWriter::StatusPageWriter(Controller *controller)
+{
+	this->controller = controller;
+
+	section = NULL;
+	page = NULL;
+	events[0] = NULL;
+	events[1] = NULL;
+	registered = false;
+	lastGeneration = 0;
+}
+
+StatusPageWriter::~StatusPageWriter()
+{
+	stop();
+}
+
+void StatusPageWriter::start()
+{
+	// Readers only get to map the section and wait on the events
+	LPSECURITY_ATTRIBUTES sectionAttributes = buildSecurityAttributes(SECTION_MAP_READ | SECTION_QUERY);
+	LPSECURITY_ATTRIBUTES eventAttributes = buildSecurityAttributes(SYNCHRONIZE);
+
+	do {
+		if ((sectionAttributes == NULL) || (eventAttributes == NULL)) {
+			break;
+		}
+
+		section = ::CreateFileMapping(INVALID_HANDLE_VALUE, sectionAttributes, PAGE_READWRITE,
+			0, sizeof(AutoVPNStatusPage), AVSP_SECTION_NAME);
+		if (section == NULL) {
+			Log::log(LOG_ERROR, _T("Failed to create status page section: {w32err}"));
+			break;
+		}
+
+		page = (AutoVPNStatusPage *)::MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, sizeof(AutoVPNStatusPage));
+		if (page == NULL) {
+			Log::log(LOG_ERROR, _T("Failed to map status page section: {w32err}"));
+			break;
+		}
+
+		events[0] = ::CreateEvent(eventAttributes, TRUE, FALSE, AVSP_EVENT_NAME_EVEN);
+		events[1] = ::CreateEvent(eventAttributes, TRUE, FALSE, AVSP_EVENT_NAME_ODD);
+		if ((events[0] == NULL) || (events[1] == NULL)) {
+			Log::log(LOG_ERROR, _T("Failed to create status page events: {w32err}"));
+			break;
+		}
+	} while (false);
+
+	if (sectionAttributes != NULL) {
+		freeSecurityAttributes(sectionAttributes);
+	}
+	if (eventAttributes != NULL) {
+		freeSecurityAttributes(eventAttributes);
+	}
+
+	if ((page == NULL) || (events[0] == NULL) || (events[1] == NULL)) {
+		stop();
+		return;
+	}
+
+	// A fresh section is zeroed, so the sequence starts at no updates.  But a
+	// reader can keep the section alive across a restart, and if the last
+	// service died in the middle of an update the sequence is left odd.
+	if (page->sequence & 1) {
+		InterlockedIncrement(&page->sequence);
+	}
+
+	// The magic goes in last so nobody trusts a page that isn't set up
+	page->layout = AVSP_LAYOUT;
+	MemoryBarrier();
+	page->magic = AVSP_MAGIC;
+
+	// This gets the current status written right away
+	registered = true;
+	controller->registerStatusListener(this);
+
+	Log::log(LOG_DEBUG, _T("Started status page"));
+}
+
+void StatusPageWriter::stop()
+{
+	if (registered) {
+		controller->unregisterStatusListener(this);
+		registered = false;
+	}
+
+	unique_lock<mutex> permit(lock);
+
+	if (page != NULL) {
+		::UnmapViewOfFile(page);
+		page = NULL;
+	}
+	if (section != NULL) {
+		::CloseHandle(section);
+		section = NULL;
+	}
+	for (int i = 0; i < 2; i++) {
+		if (events[i] != NULL) {
+			::CloseHandle(events[i]);
+			events[i] = NULL;
+		}
+	}
+}
+
+void StatusPageWriter::onStatusChanged(const AutoVPNStatus* status, LPCTSTR suggestion,
+	unsigned long generation)
+{
+	// Gathered before the page is marked busy, to keep readers spinning as
+	// short a time as possible.
+	ServiceCounters counters;
+	controller->getCounters(counters);
+	unsigned long transitions = controller->getSnapshot()->transitions;
+
+	unique_lock<mutex> permit(lock);
+
+	if ((page == NULL) || (generation < lastGeneration)) {
+		return;
+	}
+	lastGeneration = generation;
+
+	LONG updates = beginUpdate();
+
+	AutoVPNStatusPageData& data = page->data;
+	data.generation = generation;
+	data.status = *status;
+	wcsncpy_s(data.suggestion, _countof(data.suggestion), suggestion, _TRUNCATE);
+	copyCounters(data, counters, transitions);
+
+	endUpdate(updates);
+}
+
+void StatusPageWriter::refreshCounters()
+{
+	ServiceCounters counters;
+	controller->getCounters(counters);
+	unsigned long transitions = controller->getSnapshot()->transitions;
+
+	unique_lock<mutex> permit(lock);
+
+	// The status went on the page when we registered, so this never
+	// publishes counters next to a blank status.
+	if ((page == NULL) || sameCounters(page->data, counters, transitions)) {
+		return;
+	}
+
+	// Readers wake up for this like any other update.  Anyone who only cares
+	// about status can tell nothing changed by the generation.
+	LONG updates = beginUpdate();
+	copyCounters(page->data, counters, transitions);
+	endUpdate(updates);
+}
+
+LONG StatusPageWriter::beginUpdate()
+{
+	// Update N wakes whoever saw N - 1, so the event for N + 1 has to be
+	// cleared before anyone can see N.
+	LONG updates = (page->sequence / 2) + 1;
+	::ResetEvent(events[(updates + 1) % 2]);
+
+	InterlockedIncrement(&page->sequence);
+	return updates;
+}
+
+void StatusPageWriter::endUpdate(LONG updates)
+{
+	InterlockedIncrement(&page->sequence);
+
+	::SetEvent(events[updates % 2]);
+}
+
+bool StatusPageWriter::sameCounters(const AutoVPNStatusPageData& data,
+	const ServiceCounters& counters, unsigned long transitions)
+{
+	return (data.uptimeSeconds == (unsigned long)counters.uptimeSeconds) &&
+		(data.cycles == counters.cycles) &&
+		(data.transitions == transitions) &&
+		(data.diagnosticRuns == counters.diagnosticRuns) &&
+		(data.diagnosticTimeouts == counters.diagnosticTimeouts) &&
+		(data.enableLookups == counters.enableLookups) &&
+		(data.enableFailures == counters.enableFailures) &&
+		(data.enableTimeouts == counters.enableTimeouts) &&
+		(data.enableLastLatency == counters.enableLastLatency) &&
+		(data.enableMaxLatency == counters.enableMaxLatency) &&
+		(data.enableAverageLatency == counters.enableAverageLatency);
+}
+
+void StatusPageWriter::copyCounters(AutoVPNStatusPageData& data,
+	const ServiceCounters& counters, unsigned long transitions)
+{
+	data.uptimeSeconds = (unsigned long)counters.uptimeSeconds;
+	data.cycles = counters.cycles;
+	data.transitions = transitions;
+	data.diagnosticRuns = counters.diagnosticRuns;
+	data.diagnosticTimeouts = counters.diagnosticTimeouts;
+	data.enableLookups = counters.enableLookups;
+	data.enableFailures = counters.enableFailures;
+	data.enableTimeouts = counters.enableTimeouts;
+	data.enableLastLatency = counters.enableLastLatency;
+	data.enableMaxLatency = counters.enableMaxLatency;
+	data.enableAverageLatency = counters.enableAverageLatency;
+}
+
+LPSECURITY_ATTRIBUTES StatusPageWriter::buildSecurityAttributes(DWORD userAccess)
+{
+	// SYSTEM and administrators get everything, and interactive users only
+	// what they need to read.
+	CString sddl;
+	sddl.Format(_T("D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;0x%08x;;;IU)"), userAccess);
+
+	PSECURITY_DESCRIPTOR securityDescriptor = NULL;
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptor(sddl, SDDL_REVISION_1,
+		&securityDescriptor, NULL)) {
+		Log::log(LOG_ERROR, _T("Failed to build status page security descriptor: {w32err}"));
+		return NULL;
+	}
+
+	LPSECURITY_ATTRIBUTES sa = (LPSECURITY_ATTRIBUTES)
+		HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SECURITY_ATTRIBUTES));
+	sa->nLength = sizeof(SECURITY_ATTRIBUTES);
+	sa->bInheritHandle = FALSE;
+	sa->lpSecurityDescriptor = securityDescriptor;
+
+	return sa;
+}
+
+void StatusPageWriter::freeSecurityAttributes(LPSECURITY_ATTRIBUTES securityAttributes)
+{
+	LocalFree(securityAttributes->lpSecurityDescriptor);
+	HeapFree(GetProcessHeap(), 0, securityAttributes);
+}
@@ -0,0 +1,61 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include "Controller.h"
+#include "StatusPage.h"
+
+/*
+ * Owns the shared status page described in StatusPage.h and rewrites it on
+ * every status change.  The page is written from the controller's broadcast,
+ * so no matter how many sessions read it the cost here is one copy per change.
+ * The counters move every cycle whether or not the status does, so the
+ * controller also has them rewritten once a cycle.
+ */
+class StatusPageWriter : public Controller::StatusListener
+{
+public:
+	StatusPageWriter(Controller *);
+	virtual ~StatusPageWriter();
+
+	// Creates the section and events and registers for status.  If anything
+	// fails it's logged and the page just isn't there - the pipe still works.
+	void start();
+	void stop();
+
+	virtual void onStatusChanged(const AutoVPNStatus* status, LPCTSTR suggestion,
+		unsigned long generation);
+
+	// Rewrites just the counters, leaving the status and its generation alone.
+	// Skipped if a status change already wrote the same numbers.
+	void refreshCounters();
+
+private:
+	Controller *controller;
+
+	// The registration call and the broadcast can overlap
+	mutex lock;
+
+	HANDLE section;
+	AutoVPNStatusPage *page;
+	HANDLE events[2];
+	bool registered;
+	unsigned long lastGeneration;
+
+	// Both called with the lock held, around any change to the page data
+	LONG beginUpdate();
+	void endUpdate(LONG updates);
+
+	static bool sameCounters(const AutoVPNStatusPageData& data,
+		const ServiceCounters& counters, unsigned long transitions);
+	static void copyCounters(AutoVPNStatusPageData& data,
+		const ServiceCounters& counters, unsigned long transitions);
+
+	LPSECURITY_ATTRIBUTES buildSecurityAttributes(DWORD userAccess);
+	void freeSecurityAttributes(LPSECURITY_ATTRIBUTES);
+};
@@ -0,0 +1,464 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "TlsPinCheck.h"
+#include "Cancellation.h"
+
+#define READ_BUFFER_SIZE 4096
+
+// A server hello with a long chain is well under this.  Anything past it isn't
+// a handshake we want to keep reading.
+#define MAX_HANDSHAKE_SIZE 65536
+
+DWORD TlsPinCheck::limit(DWORD timeoutMs, Cancellation *cancellation)
+{
+	if (cancellation != NULL) {
+		timeoutMs = min(timeoutMs, cancellation->getRemaining());
+	}
+	return timeoutMs;
+}
+
+HttpProbe::Status TlsPinCheck::check(LPCTSTR urlIn, const vector<CString>& pins,
+	const HttpProbe::Timeouts& timeouts, Cancellation *cancellation)
+{
+	HttpProbe::Status rval = HttpProbe::Status::ERR_UNKNOWN;
+
+	CString url(urlIn);
+
+	URL_COMPONENTS urlParts;
+	ZeroMemory(&urlParts, sizeof(urlParts));
+	urlParts.dwStructSize = sizeof(urlParts);
+	urlParts.dwHostNameLength = -1;
+
+	if (!WinHttpCrackUrl(url.GetString(), url.GetLength(), 0, &urlParts)) {
+		Log::log(LOG_ERROR,
+			_T("Unable to parse URL with WinHttpCrackUrl: {w32err}"));
+		return HttpProbe::Status::ERR_UNKNOWN;
+	}
+	if (urlParts.nScheme != INTERNET_SCHEME_HTTPS) {
+		Log::log(LOG_ERROR,
+			_T("Certificate pins only make sense for HTTPS URLs: %s"), (LPCTSTR)url);
+		return HttpProbe::Status::ERR_UNKNOWN;
+	}
+
+	CString host(urlParts.lpszHostName, urlParts.dwHostNameLength);
+
+	SOCKADDR_STORAGE address;
+	int addressLen = 0;
+
+	rval = resolve(host, urlParts.nPort,
+		limit(timeouts.resolve, cancellation), cancellation, address, addressLen);
+
+	if (rval == HttpProbe::Status::SUCCESS) {
+		SOCKET probeSocket = socket(address.ss_family, SOCK_STREAM, IPPROTO_TCP);
+		if (probeSocket == INVALID_SOCKET) {
+			Log::log(LOG_ERROR, _T("Unable to create probe socket: %d"), WSAGetLastError());
+			rval = HttpProbe::Status::ERR_UNKNOWN;
+		} else {
+			// This also puts the socket in non-blocking mode, so every step can
+			// be waited on alongside the cancellation.
+			WSAEVENT socketEvent = WSACreateEvent();
+			if (WSAEventSelect(probeSocket, socketEvent,
+				FD_CONNECT | FD_READ | FD_WRITE | FD_CLOSE) != 0) {
+				Log::log(LOG_ERROR,
+					_T("Unable to select probe socket events: %d"), WSAGetLastError());
+				rval = HttpProbe::Status::ERR_UNKNOWN;
+			} else {
+				rval = connectTo(probeSocket, socketEvent, address, addressLen,
+					limit(timeouts.connect, cancellation), cancellation);
+
+				if (rval == HttpProbe::Status::SUCCESS) {
+					rval = handshake(probeSocket, socketEvent, host, pins, timeouts, cancellation);
+				}
+			}
+
+			closesocket(probeSocket);
+			WSACloseEvent(socketEvent);
+		}
+	}
+
+	if ((rval != HttpProbe::Status::SUCCESS) &&
+		(cancellation != NULL) && cancellation->isCancelled()) {
+		rval = HttpProbe::Status::CANCELLED;
+	}
+
+	return rval;
+}
+
+HttpProbe::Status TlsPinCheck::resolve(const CString& host, INTERNET_PORT port,
+	DWORD timeoutMs, Cancellation *cancellation, SOCKADDR_STORAGE& address, int& addressLen)
+{
+	if (timeoutMs == 0) {
+		return HttpProbe::Status::CANCELLED;
+	}
+
+	HttpProbe::Status rval = HttpProbe::Status::ERR_DNS_FAILED;
+
+	// Either family - whatever the resolver likes best is what a browser
+	// would end up talking to.
+	ADDRINFOEXW hints;
+	ZeroMemory(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	CString service;
+	service.Format(_T("%u"), (unsigned int)port);
+
+	OVERLAPPED overlapped;
+	ZeroMemory(&overlapped, sizeof(overlapped));
+	overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	PADDRINFOEXW results = NULL;
+	HANDLE cancelHandle = NULL;
+	bool cancelled = false;
+
+	INT error = GetAddrInfoExW(host, service, NS_DNS, NULL, &hints, &results,
+		NULL, &overlapped, NULL, &cancelHandle);
+
+	if (error == WSA_IO_PENDING) {
+		HANDLE events[2];
+		DWORD eventCount = 0;
+		events[eventCount++] = overlapped.hEvent;
+		if (cancellation != NULL) {
+			events[eventCount++] = cancellation->getEvent();
+		}
+
+		if (WaitForMultipleObjects(eventCount, events, FALSE, timeoutMs) != WAIT_OBJECT_0) {
+			cancelled = (cancellation != NULL) && cancellation->isCancelled();
+
+			// The lookup still completes once with the cancel status, and it
+			// references our stack, so we have to wait for it.
+			GetAddrInfoExCancel(&cancelHandle);
+			WaitForSingleObject(overlapped.hEvent, INFINITE);
+		}
+
+		error = GetAddrInfoExOverlappedResult(&overlapped);
+	}
+
+	if (cancelled) {
+		rval = HttpProbe::Status::CANCELLED;
+	} else if ((error == NO_ERROR) && (results != NULL) &&
+		(results->ai_addrlen <= sizeof(address))) {
+		ZeroMemory(&address, sizeof(address));
+		CopyMemory(&address, results->ai_addr, results->ai_addrlen);
+		addressLen = (int)results->ai_addrlen;
+
+		rval = HttpProbe::Status::SUCCESS;
+	}
+
+	if (results != NULL) {
+		FreeAddrInfoExW(results);
+	}
+
+	CloseHandle(overlapped.hEvent);
+
+	return rval;
+}
+
+bool TlsPinCheck::waitFor(SOCKET probeSocket, WSAEVENT socketEvent,
+	DWORD timeoutMs, Cancellation *cancellation, WSANETWORKEVENTS& networkEvents)
+{
+	HANDLE events[2];
+	DWORD eventCount = 0;
+	events[eventCount++] = socketEvent;
+	if (cancellation != NULL) {
+		events[eventCount++] = cancellation->getEvent();
+	}
+
+	if (WaitForMultipleObjects(eventCount, events, FALSE, limit(timeoutMs, cancellation)) != WAIT_OBJECT_0) {
+		return false;
+	}
+
+	return (WSAEnumNetworkEvents(probeSocket, socketEvent, &networkEvents) == 0);
+}
+
+HttpProbe::Status TlsPinCheck::connectTo(SOCKET probeSocket, WSAEVENT socketEvent,
+	const SOCKADDR_STORAGE& address, int addressLen, DWORD timeoutMs, Cancellation *cancellation)
+{
+	if (connect(probeSocket, (const SOCKADDR *)&address, addressLen) == 0) {
+		return HttpProbe::Status::SUCCESS;
+	} else if (WSAGetLastError() != WSAEWOULDBLOCK) {
+		return HttpProbe::Status::ERR_CONNECTION_FAILED;
+	}
+
+	for (;;) {
+		WSANETWORKEVENTS networkEvents;
+		if (!waitFor(probeSocket, socketEvent, timeoutMs, cancellation, networkEvents)) {
+			return HttpProbe::Status::ERR_CONNECTION_FAILED;
+		}
+
+		if ((networkEvents.lNetworkEvents & FD_CONNECT) != 0) {
+			return (networkEvents.iErrorCode[FD_CONNECT_BIT] == 0) ?
+				HttpProbe::Status::SUCCESS : HttpProbe::Status::ERR_CONNECTION_FAILED;
+		}
+	}
+}
+
+bool TlsPinCheck::sendAll(SOCKET probeSocket, WSAEVENT socketEvent,
+	const char *data, DWORD length, DWORD timeoutMs, Cancellation *cancellation)
+{
+	while (length > 0) {
+		int sent = send(probeSocket, data, (int)length, 0);
+
+		if (sent > 0) {
+			data += sent;
+			length -= (DWORD)sent;
+		} else if (WSAGetLastError() == WSAEWOULDBLOCK) {
+			WSANETWORKEVENTS networkEvents;
+			if (!waitFor(probeSocket, socketEvent, timeoutMs, cancellation, networkEvents)) {
+				return false;
+			}
+		} else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+HttpProbe::Status TlsPinCheck::handshake(SOCKET probeSocket, WSAEVENT socketEvent,
+	const CString& host, const vector<CString>& pins,
+	const HttpProbe::Timeouts& timeouts, Cancellation *cancellation)
+{
+	HttpProbe::Status rval = HttpProbe::Status::ERR_SECURITY_FAILED;
+
+	// We're only looking at what the server sends, not deciding whether to
+	// trust it, so Schannel shouldn't validate anything on its own.
+	SCHANNEL_CRED credentials;
+	ZeroMemory(&credentials, sizeof(credentials));
+	credentials.dwVersion = SCHANNEL_CRED_VERSION;
+	credentials.dwFlags = SCH_CRED_MANUAL_CRED_VALIDATION | SCH_CRED_NO_DEFAULT_CREDS;
+
+	CredHandle credHandle;
+	TimeStamp expiry;
+
+	SECURITY_STATUS secStatus = AcquireCredentialsHandle(NULL, (LPTSTR)UNISP_NAME,
+		SECPKG_CRED_OUTBOUND, NULL, &credentials, NULL, NULL, &credHandle, &expiry);
+
+	if (secStatus != SEC_E_OK) {
+		Log::log(LOG_ERROR, _T("Unable to acquire Schannel credentials: %08X"), secStatus);
+		return HttpProbe::Status::ERR_UNKNOWN;
+	}
+
+	DWORD requestFlags = ISC_REQ_SEQUENCE_DETECT | ISC_REQ_REPLAY_DETECT |
+		ISC_REQ_CONFIDENTIALITY | ISC_REQ_ALLOCATE_MEMORY | ISC_REQ_STREAM |
+		ISC_REQ_MANUAL_CRED_VALIDATION;
+
+	CtxtHandle context;
+	bool haveContext = false;
+
+	vector<char> incoming;
+	char readBuffer[READ_BUFFER_SIZE];
+
+	bool done = false;
+	bool failed = false;
+	bool needData = false;
+
+	while (!done && !failed) {
+		if (needData) {
+			int received = recv(probeSocket, readBuffer, sizeof(readBuffer), 0);
+
+			if (received > 0) {
+				incoming.insert(incoming.end(), readBuffer, readBuffer + received);
+				needData = false;
+
+				if (incoming.size() > MAX_HANDSHAKE_SIZE) {
+					failed = true;
+				}
+			} else if ((received == SOCKET_ERROR) && (WSAGetLastError() == WSAEWOULDBLOCK)) {
+				WSANETWORKEVENTS networkEvents;
+				if (!waitFor(probeSocket, socketEvent, timeouts.receive, cancellation, networkEvents)) {
+					rval = HttpProbe::Status::ERR_CONNECTION_FAILED;
+					failed = true;
+				}
+			} else {
+				// Closed or reset in the middle of the handshake, which some
+				// firewalls do instead of answering for the server.
+				rval = HttpProbe::Status::ERR_CONNECTION_FAILED;
+				failed = true;
+			}
+			continue;
+		}
+
+		SecBuffer inBuffers[2];
+		inBuffers[0].BufferType = SECBUFFER_TOKEN;
+		inBuffers[0].pvBuffer = incoming.data();
+		inBuffers[0].cbBuffer = (unsigned long)incoming.size();
+		inBuffers[1].BufferType = SECBUFFER_EMPTY;
+		inBuffers[1].pvBuffer = NULL;
+		inBuffers[1].cbBuffer = 0;
+
+		SecBufferDesc inDesc;
+		inDesc.ulVersion = SECBUFFER_VERSION;
+		inDesc.cBuffers = 2;
+		inDesc.pBuffers = inBuffers;
+
+		SecBuffer outBuffers[1];
+		outBuffers[0].BufferType = SECBUFFER_TOKEN;
+		outBuffers[0].pvBuffer = NULL;
+		outBuffers[0].cbBuffer = 0;
+
+		SecBufferDesc outDesc;
+		outDesc.ulVersion = SECBUFFER_VERSION;
+		outDesc.cBuffers = 1;
+		outDesc.pBuffers = outBuffers;
+
+		DWORD contextFlags = 0;
+
+		secStatus = InitializeSecurityContext(&credHandle,
+			haveContext ? &context : NULL,
+			(SEC_WCHAR *)host.GetString(),
+			requestFlags, 0, 0,
+			haveContext ? &inDesc : NULL,
+			0, &context, &outDesc, &contextFlags, &expiry);
+
+		if (!haveContext && !FAILED(secStatus)) {
+			haveContext = true;
+		}
+
+		if ((outBuffers[0].pvBuffer != NULL) && (outBuffers[0].cbBuffer > 0)) {
+			bool sent = sendAll(probeSocket, socketEvent, (const char *)outBuffers[0].pvBuffer,
+				outBuffers[0].cbBuffer, timeouts.send, cancellation);
+			FreeContextBuffer(outBuffers[0].pvBuffer);
+
+			if (!sent) {
+				rval = HttpProbe::Status::ERR_CONNECTION_FAILED;
+				failed = true;
+				continue;
+			}
+		}
+
+		if (secStatus == SEC_E_OK) {
+			done = true;
+		} else if (secStatus == SEC_E_INCOMPLETE_MESSAGE) {
+			needData = true;
+		} else if (secStatus == SEC_I_CONTINUE_NEEDED) {
+			// Keep anything past the message Schannel just ate
+			if (inBuffers[1].BufferType == SECBUFFER_EXTRA) {
+				incoming.erase(incoming.begin(), incoming.end() - inBuffers[1].cbBuffer);
+			} else {
+				incoming.clear();
+			}
+			needData = incoming.empty();
+		} else if (secStatus == SEC_I_INCOMPLETE_CREDENTIALS) {
+			// Server asked for a client certificate - go on without one
+		} else {
+			Log::log(LOG_DEBUG, _T("TLS handshake with %s failed: %08X"),
+				(LPCTSTR)host, secStatus);
+			failed = true;
+		}
+	}
+
+	if (done) {
+		PCCERT_CONTEXT serverCert = NULL;
+
+		secStatus = QueryContextAttributes(&context, SECPKG_ATTR_REMOTE_CERT_CONTEXT, &serverCert);
+		if (secStatus != SEC_E_OK) {
+			Log::log(LOG_ERROR,
+				_T("Unable to get server certificate from Schannel: %08X"), secStatus);
+			rval = HttpProbe::Status::ERR_UNKNOWN;
+		} else {
+			if (matchesPin(serverCert, pins)) {
+				rval = HttpProbe::Status::SUCCESS;
+			} else {
+				Log::log(LOG_WARNING,
+					_T("No pinned key in the certificates from %s, TLS is being intercepted"),
+					(LPCTSTR)host);
+				rval = HttpProbe::Status::ERR_SECURITY_FAILED;
+			}
+
+			CertFreeCertificateContext(serverCert);
+		}
+	}
+
+	if (haveContext) {
+		DeleteSecurityContext(&context);
+	}
+	FreeCredentialsHandle(&credHandle);
+
+	return rval;
+}
+
+bool TlsPinCheck::matchesPin(PCCERT_CONTEXT serverCert, const vector<CString>& pins)
+{
+	// The store Schannel hands back holds whatever the server chose to send,
+	// which can include certificates that have nothing to do with the leaf.
+	// Only the path from the leaf up counts, so build the chain with the
+	// server's certificates as extra candidates and check what ends up in it.
+	CERT_CHAIN_PARA chainPara;
+	ZeroMemory(&chainPara, sizeof(chainPara));
+	chainPara.cbSize = sizeof(chainPara);
+
+	PCCERT_CHAIN_CONTEXT chain = NULL;
+	if (!CertGetCertificateChain(NULL, serverCert, NULL, serverCert->hCertStore,
+		&chainPara, 0, NULL, &chain)) {
+		Log::log(LOG_ERROR, _T("Unable to build the server certificate chain: {w32err}"));
+		return false;
+	}
+
+	bool matched = false;
+
+	// The first simple chain starts at the leaf
+	if (chain->cChain > 0) {
+		PCERT_SIMPLE_CHAIN simpleChain = chain->rgpChain[0];
+		for (DWORD i = 0; !matched && (i < simpleChain->cElement); i++) {
+			CString hash;
+			if (hashPublicKey(simpleChain->rgpElement[i]->pCertContext, hash)) {
+				for (const CString& pin : pins) {
+					if (hash == pin) {
+						matched = true;
+					}
+				}
+			}
+		}
+	}
+
+	CertFreeCertificateChain(chain);
+
+	return matched;
+}
+
+bool TlsPinCheck::hashPublicKey(PCCERT_CONTEXT cert, CString& hash)
+{
+	bool rval = false;
+
+	BYTE *encoded = NULL;
+	DWORD encodedLen = 0;
+
+	if (!CryptEncodeObjectEx(X509_ASN_ENCODING, X509_PUBLIC_KEY_INFO,
+		&cert->pCertInfo->SubjectPublicKeyInfo, CRYPT_ENCODE_ALLOC_FLAG, NULL,
+		&encoded, &encodedLen)) {
+		Log::log(LOG_ERROR, _T("Unable to encode certificate public key: {w32err}"));
+		return false;
+	}
+
+	BYTE digest[32];
+	DWORD digestLen = sizeof(digest);
+
+	if (!CryptHashCertificate2(BCRYPT_SHA256_ALGORITHM, 0, NULL,
+		encoded, encodedLen, digest, &digestLen)) {
+		Log::log(LOG_ERROR, _T("Unable to hash certificate public key: {w32err}"));
+	} else {
+		DWORD textLen = 0;
+		if (CryptBinaryToString(digest, digestLen,
+			CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF, NULL, &textLen)) {
+			LPTSTR text = hash.GetBuffer(textLen);
+			if (CryptBinaryToString(digest, digestLen,
+				CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF, text, &textLen)) {
+				rval = true;
+			}
+			hash.ReleaseBuffer(rval ? textLen : 0);
+		}
+	}
+
+	LocalFree(encoded);
+
+	return rval;
+}
@@ -0,0 +1,55 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include "HttpProbe.h"
+
+class Cancellation;
+
+/*
+ * Does just the TLS handshake with the host from a URL and looks at the
+ * certificates the server sent, without ever sending a request.  If none of
+ * their public keys match a pin, something in the middle answered for the
+ * server - which catches inspection boxes whose root the machine trusts, and
+ * that an HTTP check can't see.
+ *
+ * Pins are the base64 SHA-256 of the DER SubjectPublicKeyInfo, the same as the
+ * pin-sha256 values from HPKP, so they can be the leaf or any intermediate.
+ */
+class TlsPinCheck {
+public:
+	// SUCCESS if a pin matched, ERR_SECURITY_FAILED if none did or the
+	// handshake itself failed, or the usual DNS and connection errors.
+	static HttpProbe::Status check(LPCTSTR url, const vector<CString>& pins,
+		const HttpProbe::Timeouts& timeouts, Cancellation *cancellation = NULL);
+
+private:
+	static HttpProbe::Status resolve(const CString& host, INTERNET_PORT port,
+		DWORD timeoutMs, Cancellation *cancellation,
+		SOCKADDR_STORAGE& address, int& addressLen);
+
+	static HttpProbe::Status connectTo(SOCKET probeSocket, WSAEVENT socketEvent,
+		const SOCKADDR_STORAGE& address, int addressLen,
+		DWORD timeoutMs, Cancellation *cancellation);
+
+	static HttpProbe::Status handshake(SOCKET probeSocket, WSAEVENT socketEvent,
+		const CString& host, const vector<CString>& pins,
+		const HttpProbe::Timeouts& timeouts, Cancellation *cancellation);
+
+	static bool sendAll(SOCKET probeSocket, WSAEVENT socketEvent,
+		const char *data, DWORD length, DWORD timeoutMs, Cancellation *cancellation);
+
+	// Waits for any socket event, false on timeout or cancellation
+	static bool waitFor(SOCKET probeSocket, WSAEVENT socketEvent,
+		DWORD timeoutMs, Cancellation *cancellation, WSANETWORKEVENTS& networkEvents);
+
+	static DWORD limit(DWORD timeoutMs, Cancellation *cancellation);
+
+	static bool matchesPin(PCCERT_CONTEXT serverCert, const vector<CString>& pins);
+	static bool hashPublicKey(PCCERT_CONTEXT cert, CString& hash);
+};
@@ -8,13 +8,221 @@
 #include "pch.h"
 #include "Log.h"
 #include "VerifyUrl.h"
+#include "Cancellation.h"
 
-#define READ_BUFFER_SIZE 128 // FIXME longer in prod
+// We stop reading as soon as we know whether the content matches, so this
+// only needs to be big enough to not make a lot of calls.
+#define READ_BUFFER_SIZE 1024
 
-VerifyUrl::Status VerifyUrl::verifyUrl(LPCTSTR urlIn, LPCTSTR expectedIn)
+// Once the answer is known, read up to this much more to get to the end of the
+// body.  If we finish the body the connection goes back in the pool for next
+// time - past this it's cheaper to throw the connection away.
+#define DRAIN_LIMIT 4096
+
+LONGLONG VerifyUrl::now()
+{
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+}
+
+long VerifyUrl::elapsed(LONGLONG from, LONGLONG to)
+{
+	if ((from == 0) || (to == 0) || (to < from)) {
+		return -1;
+	}
+
+	static LONGLONG frequency = 0;
+	if (frequency == 0) {
+		LARGE_INTEGER value;
+		QueryPerformanceFrequency(&value);
+		frequency = value.QuadPart;
+	}
+
+	return (long)(((to - from) * 1000000) / frequency);
+}
+
+void CALLBACK VerifyUrl::statusCallback(HINTERNET, DWORD_PTR context,
+	DWORD status, LPVOID info, DWORD infoLength)
+{
+	// The session is asynchronous, so these come in on WinHttp's threads.
+	// Completions wake the probe thread, which is the only one that ever
+	// makes a call on the handle or closes it.
+	Request *request = (Request *)context;
+	if (request == NULL) {
+		return;
+	}
+
+	LONGLONG time = now();
+	Marks *marks = &request->marks;
+
+	switch (status) {
+	case WINHTTP_CALLBACK_STATUS_RESOLVING_NAME:
+		marks->resolving = time;
+		break;
+	case WINHTTP_CALLBACK_STATUS_NAME_RESOLVED:
+		marks->resolved = time;
+		break;
+	case WINHTTP_CALLBACK_STATUS_CONNECTING_TO_SERVER:
+		marks->connecting = time;
+		break;
+	case WINHTTP_CALLBACK_STATUS_CONNECTED_TO_SERVER:
+		marks->connected = time;
+		break;
+	case WINHTTP_CALLBACK_STATUS_SENDING_REQUEST:
+		// The TLS handshake happens between connecting and this
+		if (marks->sending == 0) {
+			marks->sending = time;
+		}
+		break;
+	case WINHTTP_CALLBACK_STATUS_REQUEST_SENT:
+		marks->sent = time;
+		break;
+	case WINHTTP_CALLBACK_STATUS_RESPONSE_RECEIVED:
+		if (marks->received == 0) {
+			marks->received = time;
+		}
+		break;
+
+	case WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE:
+	case WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE:
+		SetEvent(request->completed);
+		break;
+	case WINHTTP_CALLBACK_STATUS_DATA_AVAILABLE:
+		request->bytes = *(DWORD *)info;
+		SetEvent(request->completed);
+		break;
+	case WINHTTP_CALLBACK_STATUS_READ_COMPLETE:
+		request->bytes = infoLength;
+		SetEvent(request->completed);
+		break;
+	case WINHTTP_CALLBACK_STATUS_REQUEST_ERROR:
+		request->error = ((WINHTTP_ASYNC_RESULT *)info)->dwError;
+		SetEvent(request->completed);
+		break;
+
+	case WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING:
+		// Last callback for the handle, after which the request can go
+		SetEvent(request->closed);
+		break;
+	}
+}
+
+bool VerifyUrl::finish(BOOL started, Request& request, Cancellation *cancellation, DWORD& error)
+{
+	if (!started) {
+		// Failed before anything went out, so there's no callback coming
+		error = GetLastError();
+		return false;
+	}
+
+	HANDLE events[2];
+	DWORD eventCount = 0;
+	events[eventCount++] = request.completed;
+	if (cancellation != NULL) {
+		events[eventCount++] = cancellation->getEvent();
+	}
+
+	// WinHttp's own timeouts still apply, and they're never past the deadline
+	DWORD waitValue = WaitForMultipleObjects(eventCount, events, FALSE, INFINITE);
+	if (waitValue != WAIT_OBJECT_0) {
+		error = ERROR_WINHTTP_OPERATION_CANCELLED;
+		return false;
+	}
+
+	if (request.error != ERROR_SUCCESS) {
+		error = request.error;
+		return false;
+	}
+
+	return true;
+}
+
+VerifyUrl::VerifyUrl()
+{
+}
+
+VerifyUrl::~VerifyUrl()
+{
+}
+
+void VerifyUrl::reset()
+{
+	// Requests in flight hold their own reference, so the handle really
+	// closes when the last of them finishes.
+	unique_lock<mutex> permit(lock);
+	session.reset();
+}
+
+shared_ptr<void> VerifyUrl::getSession()
+{
+	unique_lock<mutex> permit(lock);
+
+	if (!session) {
+		HINTERNET handle = WinHttpOpen(
+			_T("Teaglu AutoVPN Verifier"),
+			WINHTTP_ACCESS_TYPE_NO_PROXY, NULL, NULL, WINHTTP_FLAG_ASYNC);
+
+		if (handle == NULL) {
+			Log::log(LOG_ERROR,
+				_T("Unable to initialize WinHttp session: {w32err}"));
+		} else {
+			static unsigned long trySecurityProtocols[] = {
+				WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_3 | WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_2,
+				WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_2
+			};
+			static int trySecurityProtocolsCnt = sizeof(trySecurityProtocols) / sizeof(trySecurityProtocols[0]);
+
+			bool securityProtocolWorked = false;
+			for (int i = 0; !securityProtocolWorked && (i < trySecurityProtocolsCnt); i++) {
+				unsigned long secureProtocols = trySecurityProtocols[i];
+
+				if (WinHttpSetOption(handle,
+					WINHTTP_OPTION_SECURE_PROTOCOLS,
+					&secureProtocols, sizeof(secureProtocols))) {
+					securityProtocolWorked = true;
+				} else {
+					Log::log(LOG_DEBUG,
+						_T("Unable to set WINHTTP_OPTION_SECURE_PROTOCOLS: {w32err}"));
+				}
+			}
+
+			if (!securityProtocolWorked) {
+				Log::log(LOG_ERROR,
+					_T("Unable to set TLS compatibility to an acceptable value"));
+			}
+
+#ifdef WINHTTP_OPTION_IPV6_FAST_FALLBACK
+			// Try both address families at once instead of waiting for one to
+			// time out.  Older builds of Windows don't have this, which is fine.
+			BOOL fastFallback = TRUE;
+			if (!WinHttpSetOption(handle, WINHTTP_OPTION_IPV6_FAST_FALLBACK,
+				&fastFallback, sizeof(fastFallback))) {
+				Log::log(LOG_DEBUG,
+					_T("Unable to set WINHTTP_OPTION_IPV6_FAST_FALLBACK: {w32err}"));
+			}
+#endif
+
+			session = shared_ptr<void>(handle, [](void *handle) {
+				WinHttpCloseHandle(handle);
+			});
+		}
+	}
+
+	return session;
+}
+
+HttpProbe::Status VerifyUrl::probe(LPCTSTR urlIn, LPCTSTR expectedIn,
+	const Timeouts& timeouts, Cancellation *cancellation, Timing *timing)
 {
 	Status rval = Status::ERR_UNKNOWN;
 
+	Marks marks;
+	ZeroMemory(&marks, sizeof(marks));
+
+	LONGLONG startTime = now();
+	bool isSecure = false;
+
 	CString url(urlIn);
 
 	CT2A expected(expectedIn);
@@ -22,14 +230,9 @@ VerifyUrl::Status VerifyUrl::verifyUrl(LPCTSTR urlIn, LPCTSTR expectedIn)
 
 	DWORD winhttpError = 0;
 
-	HINTERNET session = WinHttpOpen(
-		_T("Teaglu AutoVPN Verifier"),
-		WINHTTP_ACCESS_TYPE_NO_PROXY, NULL, NULL, 0);
-
-	if (session == NULL) {
-		Log::log(LOG_ERROR,
-			_T("Unable to initialize WinHttp session: {w32err}"));
+	shared_ptr<void> session = getSession();
 
+	if (!session) {
 		winhttpError = GetLastError();
 	} else {
 		URL_COMPONENTS urlParts;
@@ -43,45 +246,15 @@ VerifyUrl::Status VerifyUrl::verifyUrl(LPCTSTR urlIn, LPCTSTR expectedIn)
 			Log::log(LOG_ERROR,
 				_T("Unable to parse URL with WinHttpCrackUrl: {w32err}"));
 		} else {
-			bool isSecure = (urlParts.nScheme == INTERNET_SCHEME_HTTPS);
-
-			if (isSecure) {
-				static unsigned long trySecurityProtocols[] = {
-					WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_3 | WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_2,
-					WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_2
-				};
-				static int trySecurityProtocolsCnt = sizeof(trySecurityProtocols) / sizeof(trySecurityProtocols[0]);
-
-				bool securityProtocolWorked = false;
-				for (int i = 0; !securityProtocolWorked && (i < trySecurityProtocolsCnt); i++) {
-					unsigned long secureProtocols = trySecurityProtocols[i];
-
-					if (WinHttpSetOption(session,
-						WINHTTP_OPTION_SECURE_PROTOCOLS,
-						&secureProtocols, sizeof(secureProtocols))) {
-						securityProtocolWorked = true;
-					} else {
-						Log::log(LOG_DEBUG,
-							_T("Unable to set WINHTTP_OPTION_SECURE_PROTOCOLS: {w32err}"));
-					}
-				}
+			isSecure = (urlParts.nScheme == INTERNET_SCHEME_HTTPS);
 
-				if (!securityProtocolWorked) {
-					Log::log(LOG_ERROR,
-						_T("Unable to set TLS compatibility to an acceptable value"));
-				}
-			}
-
-			LPWSTR hostname = new WCHAR[urlParts.dwHostNameLength + 1];
-			StrCpyNW(hostname, urlParts.lpszHostName, urlParts.dwHostNameLength + 1);
-			hostname[urlParts.dwHostNameLength] = '\0';
-
-			LPWSTR urlPath = new WCHAR[urlParts.dwUrlPathLength + 1];
-			StrCpyNW(urlPath, urlParts.lpszUrlPath, urlParts.dwUrlPathLength + 1);
-			urlPath[urlParts.dwUrlPathLength] = '\0';
+			CString hostname(urlParts.lpszHostName, urlParts.dwHostNameLength);
+			CString urlPath(urlParts.lpszUrlPath, urlParts.dwUrlPathLength);
 
+			// This doesn't touch the network - WinHttp keeps the actual
+			// connections pooled on the session.
 			HINTERNET connection = WinHttpConnect(
-				session,
+				session.get(),
 				hostname,
 				urlParts.nPort,
 				0);
@@ -90,16 +263,25 @@ VerifyUrl::Status VerifyUrl::verifyUrl(LPCTSTR urlIn, LPCTSTR expectedIn)
 				Log::log(LOG_ERROR,
 					_T("Unable to create WinHttp connection: {w32err}"));
 			} else {
-				CA2W wideVerb("GET");
-
 				DWORD requestFlags = WINHTTP_FLAG_BYPASS_PROXY_CACHE | WINHTTP_FLAG_REFRESH;
 				if (isSecure) {
 					requestFlags |= WINHTTP_FLAG_SECURE;
 				}
 
+				// Lives until WinHttp says the handle is closing, since its
+				// callbacks can still be on the way after we give up.
+				Request request;
+				ZeroMemory(&request, sizeof(request));
+				request.completed = CreateEvent(NULL, FALSE, FALSE, NULL);
+				request.closed = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+				// A read in flight writes here, so it can't go out of scope
+				// before the handle is closed.
+				CHAR buffer[READ_BUFFER_SIZE];
+
 				HINTERNET httpRequest = WinHttpOpenRequest(
 					connection,
-					wideVerb.m_psz,
+					L"GET",
 					urlPath,
 					NULL,
 					WINHTTP_NO_REFERER,
@@ -111,19 +293,76 @@ VerifyUrl::Status VerifyUrl::verifyUrl(LPCTSTR urlIn, LPCTSTR expectedIn)
 					Log::log(LOG_ERROR,
 						_T("Unable to open WinHttp request: %d"), winhttpError);
 				} else {
-					if (!WinHttpSendRequest(httpRequest,
-						WINHTTP_NO_ADDITIONAL_HEADERS, 0, NULL, 0, 0, NULL)) {
-						winhttpError = GetLastError();
+					// Without the callback we'd never hear about completions, so
+					// this one isn't optional.
+					bool proceed = true;
+					bool callbackSet = false;
+
+					DWORD_PTR context = (DWORD_PTR)&request;
+					if ((request.completed == NULL) || (request.closed == NULL)) {
+						Log::log(LOG_ERROR,
+							_T("Unable to create WinHttp request events: {w32err}"));
+						proceed = false;
+					} else if (!WinHttpSetOption(httpRequest, WINHTTP_OPTION_CONTEXT_VALUE,
+						&context, sizeof(context))) {
+						Log::log(LOG_ERROR,
+							_T("Unable to set WinHttp context: {w32err}"));
+						proceed = false;
+					} else if (WinHttpSetStatusCallback(httpRequest, statusCallback,
+						WINHTTP_CALLBACK_FLAG_ALL_COMPLETIONS |
+						WINHTTP_CALLBACK_FLAG_HANDLES |
+						WINHTTP_CALLBACK_FLAG_RESOLVE_NAME |
+						WINHTTP_CALLBACK_FLAG_CONNECT_TO_SERVER |
+						WINHTTP_CALLBACK_FLAG_SEND_REQUEST |
+						WINHTTP_CALLBACK_FLAG_RECEIVE_RESPONSE,
+						0) == WINHTTP_INVALID_STATUS_CALLBACK) {
+						Log::log(LOG_ERROR,
+							_T("Unable to set WinHttp status callback: {w32err}"));
+						proceed = false;
+					} else {
+						callbackSet = true;
+					}
+
+					// Policy timeouts, but never past the deadline.  A timeout of zero
+					// means forever to WinHttp, so zero left has to be treated as
+					// already cancelled.
+					int resolveTimeout = timeouts.resolve;
+					int connectTimeout = timeouts.connect;
+					int sendTimeout = timeouts.send;
+					int receiveTimeout = timeouts.receive;
+
+					if (proceed && (cancellation != NULL)) {
+						int remaining = (int)cancellation->getRemaining();
+						if (remaining > 0) {
+							resolveTimeout = min(resolveTimeout, remaining);
+							connectTimeout = min(connectTimeout, remaining);
+							sendTimeout = min(sendTimeout, remaining);
+							receiveTimeout = min(receiveTimeout, remaining);
+						} else {
+							winhttpError = ERROR_WINHTTP_OPERATION_CANCELLED;
+							proceed = false;
+						}
+					}
+
+					if (proceed && !WinHttpSetTimeouts(httpRequest,
+						resolveTimeout, connectTimeout, sendTimeout, receiveTimeout)) {
+						Log::log(LOG_WARNING,
+							_T("Unable to set WinHttp timeouts: {w32err}"));
+					}
+
+					if (!proceed) {
+						// Already cancelled or no way to hear back, don't bother
+					} else if (!finish(WinHttpSendRequest(httpRequest,
+						WINHTTP_NO_ADDITIONAL_HEADERS, 0, NULL, 0, 0, 0),
+						request, cancellation, winhttpError)) {
 						Log::log(LOG_ERROR,
 							_T("Error sending HTTP request: %d"), winhttpError);
 					} else {
-						if (!WinHttpReceiveResponse(httpRequest, NULL)) {
-							winhttpError = GetLastError();
+						if (!finish(WinHttpReceiveResponse(httpRequest, NULL),
+							request, cancellation, winhttpError)) {
 							Log::log(LOG_ERROR,
 								_T("Error in WinHttpReceiveResponse: %d"), winhttpError);
 						} else {
-							std::string response;
-
 							DWORD status;
 							DWORD statusSize = sizeof(status);
 							if (!WinHttpQueryHeaders(
@@ -141,52 +380,104 @@ VerifyUrl::Status VerifyUrl::verifyUrl(LPCTSTR urlIn, LPCTSTR expectedIn)
 							}
 
 							if ((status >= 200) && (status <= 299)) {
-								DWORD bufferLen;
-								CHAR buffer[READ_BUFFER_SIZE];
+								// Compare as the data comes in instead of collecting
+								// the whole body.  A mismatch anywhere in the prefix
+								// decides it right away.
+								size_t matched = 0;
+								size_t drained = 0;
+
+								bool decided = (expectedLen == 0);
+								if (decided) {
+									rval = Status::SUCCESS;
+								}
 
 								for (bool readRun = true; readRun; ) {
-									if (!WinHttpQueryDataAvailable(httpRequest, &bufferLen)) {
+									DWORD readError = 0;
+
+									if (!finish(WinHttpQueryDataAvailable(httpRequest, NULL),
+										request, cancellation, readError)) {
+										winhttpError = readError;
 										Log::log(LOG_ERROR,
-											_T("Error in WinHttpQueryDataAvailable: {w32err}"));
+											_T("Error in WinHttpQueryDataAvailable: %d"), readError);
 										readRun = false;
-									} else if (bufferLen == 0) {
+									} else if (request.bytes == 0) {
+										// End of the body, which also means the
+										// connection can be reused.
 										readRun = false;
 
-										rval = Status::ERR_WRONG_CONTENT;
-										if (response.size() >= expectedLen) {
-											if (strncmp(response.c_str(), expected.m_psz, expectedLen) == 0) {
-												rval = Status::SUCCESS;
-											}
+										if (!decided) {
+											rval = Status::ERR_WRONG_CONTENT;
 										}
-									} else {
-										bufferLen = READ_BUFFER_SIZE;
-										if (!WinHttpReadData(httpRequest, buffer, READ_BUFFER_SIZE, &bufferLen)) {
-											Log::log(LOG_ERROR,
-												_T("Error reading from WinHttp: {w32err}"));
-											readRun = false;
+									} else if (!finish(WinHttpReadData(httpRequest, buffer,
+										min(request.bytes, (DWORD)READ_BUFFER_SIZE), NULL),
+										request, cancellation, readError)) {
+										winhttpError = readError;
+										Log::log(LOG_ERROR,
+											_T("Error reading from WinHttp: %d"), readError);
+										readRun = false;
+									} else if (!decided) {
+										DWORD bufferLen = request.bytes;
+										size_t compareLen = min((size_t)bufferLen, expectedLen - matched);
+
+										if (memcmp(buffer, expected.m_psz + matched, compareLen) != 0) {
+											decided = true;
+											rval = Status::ERR_WRONG_CONTENT;
 										} else {
-											// If we don't have enough to compare add this chunk
-											if (response.size() < expectedLen) {
-												response.append(buffer, bufferLen);
+											matched += compareLen;
+											if (matched == expectedLen) {
+												decided = true;
+												rval = Status::SUCCESS;
 											}
 										}
+
+										drained += bufferLen - compareLen;
+									} else {
+										drained += request.bytes;
+									}
+
+									if (decided && (drained > DRAIN_LIMIT)) {
+										readRun = false;
 									}
 								}
 							}
 						}
 					}
+
+					// Anything still in flight is cancelled by the close, and its
+					// callbacks are done once the handle says it's closing.  If
+					// the callback never went on there's nothing to wait for.
 					WinHttpCloseHandle(httpRequest);
+					if (callbackSet) {
+						WaitForSingleObject(request.closed, INFINITE);
+					}
+
+					marks = request.marks;
+				}
+
+				if (request.completed != NULL) {
+					CloseHandle(request.completed);
+				}
+				if (request.closed != NULL) {
+					CloseHandle(request.closed);
 				}
+
 				WinHttpCloseHandle(connection);
 			}
-			WinHttpCloseHandle(session);
-
-			delete[] hostname;
-			delete[] urlPath;
 		}
 	}
 
-	if ((rval == Status::ERR_UNKNOWN) && (winhttpError > 0)) {
+	if (timing != NULL) {
+		timing->dns = elapsed(marks.resolving, marks.resolved);
+		timing->connect = elapsed(marks.connecting, marks.connected);
+		timing->tls = isSecure ? elapsed(marks.connected, marks.sending) : -1;
+		timing->firstByte = elapsed(marks.sent, marks.received);
+		timing->total = elapsed(startTime, now());
+	}
+
+	if ((rval != Status::SUCCESS) && (cancellation != NULL) && cancellation->isCancelled()) {
+		// Whatever went wrong was most likely us giving up on it
+		rval = Status::CANCELLED;
+	} else if ((rval == Status::ERR_UNKNOWN) && (winhttpError > 0)) {
 		// Try to decode normal errors to something more useful
 		switch (winhttpError) {
 		case ERROR_WINHTTP_NAME_NOT_RESOLVED:
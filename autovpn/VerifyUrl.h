@@ -6,18 +6,59 @@
  ******************************************************************************/
 
 #pragma once
-class VerifyUrl {
+
+#include "HttpProbe.h"
+
+// The WinHttp implementation
+class VerifyUrl : public HttpProbe {
 public:
-	enum class Status {
-		UNKNOWN = 0,
-		SUCCESS = 1,
-		ERR_UNKNOWN = 2,
-		ERR_DNS_FAILED = 3,
-		ERR_CONNECTION_FAILED = 4,
-		ERR_SECURITY_FAILED = 5,
-		ERR_WRONG_CONTENT = 6
+	VerifyUrl();
+	virtual ~VerifyUrl();
+
+	virtual Status probe(LPCTSTR url, LPCTSTR expected, const Timeouts& timeouts,
+		Cancellation *cancellation = NULL, Timing *timing = NULL);
+
+	// Drops the session and its pooled connections
+	virtual void reset();
+
+private:
+	// One session for all probes so WinHttp can keep connections alive
+	// between runs.  It's created on first use.
+	mutex lock;
+	shared_ptr<void> session;
+
+	shared_ptr<void> getSession();
+
+	// Times for each WinHttp status notification, from the status callback
+	struct Marks {
+		LONGLONG resolving;
+		LONGLONG resolved;
+		LONGLONG connecting;
+		LONGLONG connected;
+		LONGLONG sending;
+		LONGLONG sent;
+		LONGLONG received;
+	};
+
+	// One request, shared with the status callback.  Completions set the
+	// event with the byte count or error, and closed is set once WinHttp is
+	// done with the handle and the callback can't come in again.
+	struct Request {
+		HANDLE completed;
+		HANDLE closed;
+		DWORD error;
+		DWORD bytes;
+		Marks marks;
 	};
 
-	static Status verifyUrl(LPCTSTR url, LPCTSTR expected);
+	// Waits out an asynchronous call that started, or picks up the error if
+	// it didn't.  False on an error or if the cancellation fires first.
+	static bool finish(BOOL started, Request& request, Cancellation *cancellation, DWORD& error);
+
+	static void CALLBACK statusCallback(HINTERNET handle, DWORD_PTR context,
+		DWORD status, LPVOID info, DWORD infoLength);
+
+	static LONGLONG now();
+	static long elapsed(LONGLONG from, LONGLONG to);
 };
 
@@ -0,0 +1,307 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "Controller.h"
+#include "VpnServiceController.h"
+
+// How often to try again if we can't open the service
+#define RETRY_MILLISECONDS 30000
+
+// How long start() waits for the first attempt to open the service
+#define STARTUP_MILLISECONDS 5000
+
+#define NOTIFY_ALL_STATES ( \
+	SERVICE_NOTIFY_STOPPED | SERVICE_NOTIFY_START_PENDING | SERVICE_NOTIFY_STOP_PENDING | \
+	SERVICE_NOTIFY_RUNNING | SERVICE_NOTIFY_CONTINUE_PENDING | SERVICE_NOTIFY_PAUSE_PENDING | \
+	SERVICE_NOTIFY_PAUSED | SERVICE_NOTIFY_DELETE_PENDING)
+
+VpnServiceController::VpnServiceController(Controller *controller)
+{
+	this->controller = controller;
+
+	initialized = false;
+
+	serviceManager = NULL;
+	service = NULL;
+
+	haveStatus = false;
+	ZeroMemory(&lastStatus, sizeof(lastStatus));
+
+	ZeroMemory(&notify, sizeof(notify));
+	notifyPending = false;
+
+	stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	changeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	watchThread = NULL;
+}
+
+VpnServiceController::~VpnServiceController()
+{
+	CloseHandle(stopEvent);
+	CloseHandle(changeEvent);
+}
+
+void VpnServiceController::setServiceName(LPCTSTR name)
+{
+	unique_lock<mutex> permit(lock);
+	if (serviceName.Compare(name) != 0) {
+		serviceName = name;
+
+		// Nothing we know about the old service applies to the new one, so
+		// don't report, start or stop anything until the watch thread has the
+		// new one open.
+		close();
+		SetEvent(changeEvent);
+	}
+}
+
+bool VpnServiceController::getState(DWORD& state)
+{
+	unique_lock<mutex> permit(lock);
+	if (haveStatus) {
+		state = lastStatus.dwCurrentState;
+	}
+	return haveStatus;
+}
+
+bool VpnServiceController::startService()
+{
+	bool rval = false;
+
+	unique_lock<mutex> permit(lock);
+	if (service != NULL) {
+		if (!StartService(service, 0, NULL)) {
+			Log::log(LOG_ERROR,
+				_T("Failed to start VPN service: {w32err}"));
+		} else {
+			// Don't wait for the notification to tell us, or we'll try again
+			// if a cycle comes through first.
+			lastStatus.dwCurrentState = SERVICE_START_PENDING;
+			rval = true;
+		}
+	}
+
+	return rval;
+}
+
+bool VpnServiceController::stopService()
+{
+	bool rval = false;
+
+	unique_lock<mutex> permit(lock);
+	if (service != NULL) {
+		SERVICE_STATUS status;
+		if (!ControlService(service, SERVICE_CONTROL_STOP, &status)) {
+			Log::log(LOG_ERROR,
+				_T("Unable to stop VPN service: {w32err}"));
+		} else {
+			lastStatus.dwCurrentState = status.dwCurrentState;
+			rval = true;
+		}
+	}
+
+	return rval;
+}
+
+bool VpnServiceController::open(const CString& name)
+{
+	// Called on the watch thread with the lock held
+	bool rval = false;
+
+	if (serviceManager == NULL) {
+		serviceManager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT);
+		if (serviceManager == NULL) {
+			Log::log(LOG_ERROR, _T("can't open service control manager: {w32err}"));
+		}
+	}
+
+	if (serviceManager != NULL) {
+		service = OpenService(serviceManager, name,
+			SERVICE_QUERY_STATUS | SERVICE_START | SERVICE_STOP);
+
+		if (service == NULL) {
+			Log::log(LOG_ERROR, _T("Unable to open VPN service: {w32err}"));
+		} else {
+			// We need the starting point so we know which change to ask for
+			DWORD needed = 0;
+			if (!QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO,
+				(LPBYTE)&lastStatus, sizeof(lastStatus), &needed)) {
+				Log::log(LOG_ERROR,
+					_T("Unable to query status of VPN service: {w32err}"));
+
+				CloseServiceHandle(service);
+				service = NULL;
+			} else {
+				haveStatus = true;
+				rval = true;
+			}
+		}
+	}
+
+	return rval;
+}
+
+void VpnServiceController::close()
+{
+	// Called with the lock held, on the watch thread or when the name
+	// changes.  Closing the handle cancels any notification that's still
+	// outstanding.
+	if (service != NULL) {
+		CloseServiceHandle(service);
+		service = NULL;
+	}
+	if (serviceManager != NULL) {
+		CloseServiceHandle(serviceManager);
+		serviceManager = NULL;
+	}
+
+	haveStatus = false;
+	notifyPending = false;
+}
+
+VOID CALLBACK VpnServiceController::notifyCallback(PVOID parameter)
+{
+	PSERVICE_NOTIFY serviceNotify = (PSERVICE_NOTIFY)parameter;
+	((VpnServiceController *)serviceNotify->pContext)->onNotify();
+}
+
+void VpnServiceController::onNotify()
+{
+	// This is an APC, so it runs on the watch thread during its alertable wait
+	bool changed = false;
+
+	{
+		unique_lock<mutex> permit(lock);
+		notifyPending = false;
+
+		if (notify.dwNotificationStatus != ERROR_SUCCESS) {
+			Log::log(LOG_WARNING,
+				_T("VPN service notification failed: %d"), notify.dwNotificationStatus);
+			close();
+		} else if ((notify.dwNotificationTriggered & SERVICE_NOTIFY_DELETE_PENDING) != 0) {
+			Log::log(LOG_WARNING, _T("VPN service is being deleted"));
+			close();
+			changed = true;
+		} else {
+			DWORD oldState = lastStatus.dwCurrentState;
+			lastStatus = notify.ServiceStatus;
+			changed = (oldState != lastStatus.dwCurrentState);
+		}
+	}
+
+	if (changed) {
+		Log::log(LOG_DEBUG, _T("VPN service state changed to %d"), notify.ServiceStatus.dwCurrentState);
+		controller->requestCycle();
+	}
+}
+
+void VpnServiceController::watchLoop()
+{
+	CString openName;
+
+	for (bool run = true; run; ) {
+		DWORD waitTime = INFINITE;
+
+		{
+			unique_lock<mutex> permit(lock);
+
+			if ((service != NULL) && (openName.Compare(serviceName) != 0)) {
+				close();
+			}
+
+			if (service == NULL) {
+				openName = serviceName;
+				if (!openName.IsEmpty() && open(openName)) {
+					controller->requestCycle();
+				}
+			}
+
+			if (!initialized) {
+				initialized = true;
+				ready.notify_all();
+			}
+
+			if (service == NULL) {
+				waitTime = RETRY_MILLISECONDS;
+			} else if (!notifyPending) {
+				// If the service is already in a state we ask about, the callback
+				// fires immediately.  So ask about every state except this one.
+				DWORD currentMask = 1 << (lastStatus.dwCurrentState - 1);
+
+				ZeroMemory(&notify, sizeof(notify));
+				notify.dwVersion = SERVICE_NOTIFY_STATUS_CHANGE;
+				notify.pfnNotifyCallback = notifyCallback;
+				notify.pContext = this;
+
+				DWORD notifyStatus = NotifyServiceStatusChange(service,
+					NOTIFY_ALL_STATES & ~currentMask, &notify);
+
+				if (notifyStatus == ERROR_SUCCESS) {
+					notifyPending = true;
+				} else {
+					// Lagging means we have to close and reopen the handle, and
+					// marked for delete means there's nothing to watch.
+					Log::log(LOG_WARNING,
+						_T("Unable to watch VPN service status: %d"), notifyStatus);
+					close();
+					waitTime = RETRY_MILLISECONDS;
+				}
+			}
+		}
+
+		HANDLE events[2];
+		events[0] = stopEvent;
+		events[1] = changeEvent;
+
+		DWORD waitValue = WaitForMultipleObjectsEx(2, events, FALSE, waitTime, TRUE);
+		if (waitValue == WAIT_OBJECT_0) {
+			run = false;
+		} else if ((waitValue == (WAIT_OBJECT_0 + 1)) ||
+			(waitValue == WAIT_IO_COMPLETION) ||
+			(waitValue == WAIT_TIMEOUT)) {
+			// Name change, notification, or time to retry - go around again
+		} else {
+			Log::log(LOG_ERROR,
+				_T("VpnServiceController: error in WaitForMultipleObjectsEx: {w32err}"));
+			run = false;
+		}
+	}
+
+	unique_lock<mutex> permit(lock);
+	close();
+}
+
+void VpnServiceController::start(LPCTSTR name)
+{
+	{
+		unique_lock<mutex> permit(lock);
+		serviceName = name;
+		initialized = false;
+	}
+
+	ResetEvent(stopEvent);
+	watchThread = new thread(&VpnServiceController::watchLoop, this);
+
+	// Give the first open a chance to happen, so the first cycle knows what
+	// state the service is in.
+	unique_lock<mutex> permit(lock);
+	ready.wait_for(permit, chrono::milliseconds(STARTUP_MILLISECONDS),
+		[this] { return initialized; });
+}
+
+void VpnServiceController::stop()
+{
+	if (watchThread != NULL) {
+		SetEvent(stopEvent);
+		watchThread->join();
+
+		delete watchThread;
+		watchThread = NULL;
+	}
+}
@@ -0,0 +1,67 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+class Controller;
+
+/*
+ * Keeps the VPN service open and subscribes to its status changes, so the
+ * controller knows the current state without asking the service manager every
+ * cycle, and gets woken up as soon as the tunnel service changes state.
+ */
+class VpnServiceController
+{
+public:
+	VpnServiceController(Controller *);
+	virtual ~VpnServiceController();
+
+	void start(LPCTSTR serviceName);
+	void stop();
+
+	// Switch to a different service if policy changed the name.  The old one
+	// is dropped right away, so getState is false until the new one is open.
+	void setServiceName(LPCTSTR serviceName);
+
+	// Last state we heard about, or false if we don't have the service open
+	bool getState(DWORD& state);
+
+	bool startService();
+	bool stopService();
+
+private:
+	Controller *controller;
+
+	mutex lock;
+	condition_variable ready;
+	bool initialized;
+
+	CString serviceName;
+
+	SC_HANDLE serviceManager;
+	SC_HANDLE service;
+
+	bool haveStatus;
+	SERVICE_STATUS_PROCESS lastStatus;
+
+	// This is only touched by the watch thread, since that's the thread the
+	// notification APC gets delivered to.
+	SERVICE_NOTIFY notify;
+	bool notifyPending;
+
+	bool open(const CString& name);
+	void close();
+
+	void onNotify();
+	static VOID CALLBACK notifyCallback(PVOID parameter);
+
+	void watchLoop();
+
+	HANDLE stopEvent;
+	HANDLE changeEvent;
+	thread *watchThread;
+};
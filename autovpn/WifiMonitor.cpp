@@ -0,0 +1,242 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "Controller.h"
+#include "WifiMonitor.h"
+
+// If the WLAN service isn't there yet (or went away), how often to try again
+#define REOPEN_MILLISECONDS 60000
+
+// Signal quality bounces around constantly - only wake up the controller if it
+// moves at least this much.  The cached value is always current either way.
+#define QUALITY_HYSTERESIS 5
+
+WifiMonitor::WifiMonitor(Controller *controller)
+{
+	this->controller = controller;
+
+	wifiHandle = INVALID_HANDLE_VALUE;
+	lastOpenAttempt = 0;
+	reopen = false;
+}
+
+WifiMonitor::~WifiMonitor()
+{
+}
+
+void WifiMonitor::start()
+{
+	open();
+}
+
+void WifiMonitor::stop()
+{
+	close();
+}
+
+bool WifiMonitor::open()
+{
+	lastOpenAttempt = GetTickCount64();
+	reopen = false;
+
+	DWORD negotiatedVersion = 0;
+	DWORD errorStatus = WlanOpenHandle(2, NULL, &negotiatedVersion, &wifiHandle);
+	if (errorStatus != ERROR_SUCCESS) {
+		Log::log(LOG_ERROR,
+			_T("Error from WlanOpenHandle: %08X"), errorStatus);
+
+		wifiHandle = INVALID_HANDLE_VALUE;
+		return false;
+	}
+
+	errorStatus = WlanRegisterNotification(wifiHandle,
+		WLAN_NOTIFICATION_SOURCE_ACM | WLAN_NOTIFICATION_SOURCE_MSM,
+		TRUE, notificationCallback, this, NULL, NULL);
+
+	if (errorStatus != ERROR_SUCCESS) {
+		Log::log(LOG_ERROR,
+			_T("Error from WlanRegisterNotification: %08X"), errorStatus);
+
+		WlanCloseHandle(wifiHandle, NULL);
+		wifiHandle = INVALID_HANDLE_VALUE;
+		return false;
+	}
+
+	// Load whatever is there now, after which notifications keep it current
+	PWLAN_INTERFACE_INFO_LIST wifiList = NULL;
+
+	errorStatus = WlanEnumInterfaces(wifiHandle, NULL, &wifiList);
+	if (errorStatus != ERROR_SUCCESS) {
+		Log::log(LOG_ERROR,
+			_T("Error in WlanEnumInterfaces: %08X"), errorStatus);
+	} else {
+		for (DWORD i = 0; i < wifiList->dwNumberOfItems; i++) {
+			refresh(wifiList->InterfaceInfo[i].InterfaceGuid);
+		}
+
+		WlanFreeMemory(wifiList);
+	}
+
+	return true;
+}
+
+void WifiMonitor::close()
+{
+	if (wifiHandle != INVALID_HANDLE_VALUE) {
+		// Unregistering waits for any callback in progress, so this can't be
+		// done from inside the callback.
+		WlanRegisterNotification(wifiHandle, WLAN_NOTIFICATION_SOURCE_NONE,
+			TRUE, NULL, NULL, NULL, NULL);
+
+		WlanCloseHandle(wifiHandle, NULL);
+		wifiHandle = INVALID_HANDLE_VALUE;
+	}
+
+	unique_lock<mutex> permit(lock);
+	interfaces.clear();
+}
+
+bool WifiMonitor::refresh(const GUID& interfaceGuid)
+{
+	Metrics metrics;
+	ZeroMemory(&metrics, sizeof(metrics));
+	metrics.interfaceGuid = interfaceGuid;
+
+	PVOID data;
+	DWORD dataSize = 0;
+
+	DWORD errorStatus = WlanQueryInterface(wifiHandle,
+		&interfaceGuid, wlan_intf_opcode_current_connection,
+		NULL, &dataSize, &data, NULL);
+
+	if (errorStatus == ERROR_SUCCESS) {
+		WLAN_CONNECTION_ATTRIBUTES* attr = (WLAN_CONNECTION_ATTRIBUTES*)data;
+
+		if (attr->isState == wlan_interface_state_connected) {
+			metrics.connected = true;
+
+			size_t ssidLength = attr->wlanAssociationAttributes.dot11Ssid.uSSIDLength;
+			if (ssidLength > (sizeof(metrics.ssid) - 1)) {
+				ssidLength = sizeof(metrics.ssid) - 1;
+			}
+			memcpy(metrics.ssid,
+				attr->wlanAssociationAttributes.dot11Ssid.ucSSID, ssidLength);
+			metrics.ssid[ssidLength] = '\0';
+
+			// This is a 0-100 thing - 0 = -100dbm, 100 = -50dbm
+			metrics.signalQuality = (short)attr->wlanAssociationAttributes.wlanSignalQuality;
+
+			metrics.rxRate = attr->wlanAssociationAttributes.ulRxRate;
+			metrics.txRate = attr->wlanAssociationAttributes.ulTxRate;
+		}
+
+		WlanFreeMemory(data);
+	} else if (errorStatus == ERROR_INVALID_STATE) {
+		// Not connected, which is what we already have
+	} else if ((errorStatus == ERROR_INVALID_HANDLE) || (errorStatus == RPC_S_SERVER_UNAVAILABLE)) {
+		// The WLAN service restarted out from under us.  We can't close the
+		// handle from a callback, so let the next read take care of it.
+		reopen = true;
+	}
+
+	bool changed = false;
+
+	unique_lock<mutex> permit(lock);
+	bool found = false;
+	for (Metrics& existing : interfaces) {
+		if (IsEqualGUID(existing.interfaceGuid, interfaceGuid)) {
+			changed =
+				(existing.connected != metrics.connected) ||
+				(strcmp(existing.ssid, metrics.ssid) != 0) ||
+				(abs(existing.signalQuality - metrics.signalQuality) >= QUALITY_HYSTERESIS);
+
+			existing = metrics;
+			found = true;
+			break;
+		}
+	}
+	if (!found) {
+		interfaces.push_back(metrics);
+		changed = metrics.connected;
+	}
+
+	return changed;
+}
+
+void WifiMonitor::remove(const GUID& interfaceGuid)
+{
+	unique_lock<mutex> permit(lock);
+	interfaces.remove_if([&interfaceGuid](const Metrics& existing) {
+		return IsEqualGUID(existing.interfaceGuid, interfaceGuid) != FALSE;
+	});
+}
+
+VOID WINAPI WifiMonitor::notificationCallback(PWLAN_NOTIFICATION_DATA data, PVOID context)
+{
+	((WifiMonitor *)context)->onNotification(data);
+}
+
+void WifiMonitor::onNotification(PWLAN_NOTIFICATION_DATA data)
+{
+	bool changed = false;
+
+	if (data->NotificationSource == WLAN_NOTIFICATION_SOURCE_ACM) {
+		switch (data->NotificationCode) {
+		case wlan_notification_acm_interface_arrival:
+		case wlan_notification_acm_connection_complete:
+		case wlan_notification_acm_disconnected:
+			changed = refresh(data->InterfaceGuid);
+			break;
+
+		case wlan_notification_acm_interface_removal:
+			remove(data->InterfaceGuid);
+			changed = true;
+			break;
+		}
+	} else if (data->NotificationSource == WLAN_NOTIFICATION_SOURCE_MSM) {
+		switch (data->NotificationCode) {
+		case wlan_notification_msm_connected:
+		case wlan_notification_msm_disconnected:
+		case wlan_notification_msm_roaming_end:
+		case wlan_notification_msm_signal_quality_change:
+			// The signal quality notification only carries the quality, but the
+			// rates tend to move with it so take the whole set.
+			changed = refresh(data->InterfaceGuid);
+			break;
+		}
+	}
+
+	if (changed) {
+		controller->requestCycle();
+	}
+}
+
+void WifiMonitor::getWifiInfo(AutoVPNStatus &status)
+{
+	// Only called from the controller thread, so this is the only place the
+	// handle gets opened or closed after start().
+	if (reopen || (wifiHandle == INVALID_HANDLE_VALUE)) {
+		if ((GetTickCount64() - lastOpenAttempt) >= REOPEN_MILLISECONDS) {
+			close();
+			open();
+		}
+	}
+
+	unique_lock<mutex> permit(lock);
+	for (const Metrics& metrics : interfaces) {
+		if (metrics.connected) {
+			static_assert(sizeof(status.ssid) == sizeof(metrics.ssid), "SSID size mismatch");
+			memcpy(status.ssid, metrics.ssid, sizeof(status.ssid));
+
+			status.signalQuality = metrics.signalQuality;
+			status.rxRate = metrics.rxRate;
+			status.txRate = metrics.txRate;
+		}
+	}
+}
@@ -0,0 +1,58 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+#include "Message.h"
+
+class Controller;
+
+/*
+ * Keeps one WLAN client session open and listens for connection and signal
+ * quality notifications, so cycle() can read the current Wi-Fi metrics without
+ * opening the WLAN client every time.
+ */
+class WifiMonitor
+{
+public:
+	WifiMonitor(Controller *);
+	virtual ~WifiMonitor();
+
+	void start();
+	void stop();
+
+	// Fill in ssid, signal quality and rates from a connected interface
+	void getWifiInfo(AutoVPNStatus& status);
+
+private:
+	struct Metrics {
+		GUID interfaceGuid;
+		bool connected;
+		char ssid[sizeof(((AutoVPNStatus *)0)->ssid)];
+		short signalQuality;
+		unsigned long rxRate;
+		unsigned long txRate;
+	};
+
+	Controller *controller;
+
+	mutex lock;
+	list<Metrics> interfaces;
+
+	HANDLE wifiHandle;
+	ULONGLONG lastOpenAttempt;
+	volatile bool reopen;
+
+	bool open();
+	void close();
+
+	bool refresh(const GUID& interfaceGuid);
+	void remove(const GUID& interfaceGuid);
+
+	void onNotification(PWLAN_NOTIFICATION_DATA data);
+	static VOID WINAPI notificationCallback(PWLAN_NOTIFICATION_DATA data, PVOID context);
+};
@@ -0,0 +1,92 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "pch.h"
+#include "Log.h"
+#include "WorkPool.h"
+
+WorkPool::WorkPool(int threadCount)
+{
+	this->threadCount = threadCount;
+	run = false;
+}
+
+WorkPool::~WorkPool()
+{
+	stop();
+}
+
+void WorkPool::start()
+{
+	unique_lock<mutex> permit(lock);
+	if (!run) {
+		run = true;
+		for (int i = 0; i < threadCount; i++) {
+			threads.push_back(new thread(&WorkPool::workLoop, this));
+		}
+	}
+}
+
+void WorkPool::stop()
+{
+	{
+		unique_lock<mutex> permit(lock);
+		run = false;
+		wake.notify_all();
+	}
+
+	// Anything still queued just gets dropped - whoever submitted it has to
+	// be able to cope with that at shutdown anyway.
+	for (thread *worker : threads) {
+		worker->join();
+		delete worker;
+	}
+	threads.clear();
+
+	unique_lock<mutex> permit(lock);
+	queue.clear();
+}
+
+void WorkPool::grow(int threadCount)
+{
+	unique_lock<mutex> permit(lock);
+	if (threadCount <= this->threadCount) {
+		return;
+	}
+
+	if (run) {
+		for (int i = this->threadCount; i < threadCount; i++) {
+			threads.push_back(new thread(&WorkPool::workLoop, this));
+		}
+	}
+	this->threadCount = threadCount;
+}
+
+void WorkPool::submit(function<void()> task)
+{
+	unique_lock<mutex> permit(lock);
+	queue.push_back(move(task));
+	wake.notify_one();
+}
+
+void WorkPool::workLoop()
+{
+	unique_lock<mutex> permit(lock);
+
+	while (run) {
+		if (queue.empty()) {
+			wake.wait(permit);
+		} else {
+			function<void()> task = move(queue.front());
+			queue.pop_front();
+
+			permit.unlock();
+			task();
+			permit.lock();
+		}
+	}
+}
@@ -0,0 +1,40 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+/*
+ * A fixed number of threads pulling work off a queue.  This is meant for a
+ * handful of short blocking jobs at a time, like network probes, so the thread
+ * count is kept small and there's no attempt at being clever.
+ */
+class WorkPool
+{
+public:
+	WorkPool(int threadCount);
+	virtual ~WorkPool();
+
+	void start();
+	void stop();
+
+	// Adds threads until there are at least this many.  It never shrinks, so
+	// the pool ends up sized for the biggest job it has seen.
+	void grow(int threadCount);
+
+	void submit(function<void()> task);
+
+private:
+	int threadCount;
+
+	mutex lock;
+	condition_variable wake;
+	bool run;
+	deque<function<void()>> queue;
+
+	void workLoop();
+	vector<thread *> threads;
+};
@@ -238,6 +238,7 @@ int wmain(int argc, wchar_t **argv)
 			unregisterService();
 		} else {
 			Log::log(LOG_ERROR, _T("Unknown flag: %s"), argv[1]);
+			Log::shutdown();
 			::ExitProcess(1);
 		}
 	} else {
@@ -253,4 +254,6 @@ int wmain(int argc, wchar_t **argv)
 	}
 
 	WSACleanup();
+
+	Log::shutdown();
 }
@@ -0,0 +1,12 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#pragma once
+
+// Each returns zero if everything checked out, and prints its own results
+int runTrieBenchmark();
+int runLogQueueBenchmark();
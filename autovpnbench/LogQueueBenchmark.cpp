@@ -0,0 +1,146 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "../autovpn/pch.h"
+#include "../autovpn/LogQueue.h"
+#include "Benchmarks.h"
+
+/*
+ * Pushes log lines into a LogQueue from several threads at once, as fast as
+ * they'll go, and reports how many lines a second got in and out and how many
+ * the ring dropped.  Nobody logs this hard for real, so this is the ceiling -
+ * what matters is that pushing stays cheap and the drop count is honest.  The
+ * lines go to a temporary file that's deleted afterwards.
+ */
+
+// Producer thread counts to try, one run each
+static const int PRODUCER_COUNTS[] = { 1, 2, 4, 8, 16 };
+
+// Lines each producer pushes per run
+#define LINES_PER_PRODUCER 100000
+
+// About what a typical log line from the service comes to
+#define LINE_LENGTH 96
+
+static HANDLE openScratchFile()
+{
+	TCHAR directory[MAX_PATH];
+	TCHAR path[MAX_PATH];
+
+	if ((GetTempPath(MAX_PATH, directory) == 0) ||
+		(GetTempFileName(directory, _T("avb"), 0, path) == 0)) {
+		return INVALID_HANDLE_VALUE;
+	}
+
+	return CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+}
+
+static void produce(LogQueue *queue, int producer, atomic<uint64_t> *accepted)
+{
+	char line[LINE_LENGTH + 1];
+	uint64_t ticket;
+	uint64_t count = 0;
+
+	for (int i = 0; i < LINES_PER_PRODUCER; i++) {
+		int length = sprintf_s(line, sizeof(line),
+			"2021-12-01 12:00:00 [DEBUG] Producer %3d line %7d ", producer, i);
+
+		// Padded out to the usual length, with the CRLF the log adds
+		while (length < (LINE_LENGTH - 2)) {
+			line[length++] = '.';
+		}
+		line[length++] = '\r';
+		line[length++] = '\n';
+
+		if (queue->push(line, length, ticket)) {
+			count++;
+		}
+	}
+
+	accepted->fetch_add(count);
+}
+
+static int runProducers(int producers)
+{
+	HANDLE file = openScratchFile();
+	if (file == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "Unable to create a scratch file: %lu\n", GetLastError());
+		return 1;
+	}
+
+	LogQueue *queue = new LogQueue();
+	if (!queue->start(file)) {
+		fprintf(stderr, "Unable to start the log writer: %lu\n", GetLastError());
+		delete queue;
+		CloseHandle(file);
+		return 1;
+	}
+
+	atomic<uint64_t> accepted(0);
+	vector<thread> threads;
+
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < producers; i++) {
+		threads.emplace_back(produce, queue, i, &accepted);
+	}
+	for (thread& producer : threads) {
+		producer.join();
+	}
+	auto pushed = chrono::steady_clock::now();
+
+	// Stopping writes out whatever is still in the ring
+	queue->stop();
+	auto drained = chrono::steady_clock::now();
+
+	uint64_t offered = (uint64_t)producers * LINES_PER_PRODUCER;
+	uint64_t dropped = queue->getDropped();
+
+	LARGE_INTEGER fileSize;
+	fileSize.QuadPart = 0;
+	GetFileSizeEx(file, &fileSize);
+
+	delete queue;
+	CloseHandle(file);
+
+	double pushSeconds = chrono::duration<double>(pushed - start).count();
+	double totalSeconds = chrono::duration<double>(drained - start).count();
+
+	printf("%3d producers: pushed %.0f lines/s, written %.0f lines/s, %llu/%llu dropped, %.1f MB written\n",
+		producers,
+		offered / pushSeconds,
+		accepted.load() / totalSeconds,
+		(unsigned long long)dropped, (unsigned long long)offered,
+		fileSize.QuadPart / (1024.0 * 1024.0));
+
+	// Every line is either in the file or counted as dropped, never both
+	if ((accepted.load() + dropped) != offered) {
+		fprintf(stderr, "  %llu accepted plus %llu dropped doesn't add up to %llu\n",
+			(unsigned long long)accepted.load(), (unsigned long long)dropped,
+			(unsigned long long)offered);
+		return 1;
+	}
+	if ((uint64_t)fileSize.QuadPart < (accepted.load() * LINE_LENGTH)) {
+		fprintf(stderr, "  Only %lld bytes written for %llu lines\n",
+			fileSize.QuadPart, (unsigned long long)accepted.load());
+		return 1;
+	}
+
+	return 0;
+}
+
+int runLogQueueBenchmark()
+{
+	printf("Log queue, %d records of %d bytes\n", LOG_QUEUE_RECORDS, LOG_RECORD_SIZE);
+
+	int failures = 0;
+	for (int producers : PRODUCER_COUNTS) {
+		failures += runProducers(producers);
+	}
+
+	return failures;
+}
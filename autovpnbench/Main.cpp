@@ -0,0 +1,42 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "../autovpn/pch.h"
+#include "Benchmarks.h"
+
+/*
+ * Runs whichever benchmarks are named on the command line, or all of them.
+ * The exit code is non-zero if any of them found something wrong.
+ */
+
+static int run(const char *name)
+{
+	if (strcmp(name, "trie") == 0) {
+		return runTrieBenchmark();
+	} else if (strcmp(name, "log") == 0) {
+		return runLogQueueBenchmark();
+	}
+
+	fprintf(stderr, "Unknown benchmark %s - use trie or log\n", name);
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	int failures = 0;
+
+	if (argc < 2) {
+		failures += runTrieBenchmark();
+		failures += runLogQueueBenchmark();
+	} else {
+		for (int i = 1; i < argc; i++) {
+			failures += run(argv[i]);
+		}
+	}
+
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "../autovpn/pch.h"
+#include "../autovpn/Ip4Network.h"
+#include "../autovpn/NetworkTrie.h"
+#include "Benchmarks.h"
+
+#include <random>
+
+/*
+ * Times NetworkTrie against the nested loop it replaced, for 10k and 100k
+ * internal prefixes, and checks that both give the same answer for every
+ * query.  Run the Release build - Debug mostly measures the checked iterators.
+ */
+
+// Attached networks looked up against each prefix set
+#define QUERY_COUNT 10000
+
+// Fixed so runs can be compared
+#define RANDOM_SEED 20211201
+
+static void buildPrefixes(mt19937& random, size_t count, vector<Ip4Network>& prefixes)
+{
+	uniform_int_distribution<uint32_t> addresses;
+	uniform_int_distribution<int> lengths(16, 28);
+
+	prefixes.clear();
+	prefixes.reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		prefixes.push_back(Ip4Network::fromPrefix(addresses(random), lengths(random)));
+	}
+}
+
+static void buildQueries(mt19937& random, const vector<Ip4Network>& prefixes, vector<Ip4Network>& queries)
+{
+	uniform_int_distribution<uint32_t> addresses;
+	uniform_int_distribution<size_t> picks(0, prefixes.size() - 1);
+
+	// Half fall inside a known prefix and half are random, so both the hit
+	// and the miss paths get exercised.
+	queries.clear();
+	queries.reserve(QUERY_COUNT);
+	for (int i = 0; i < QUERY_COUNT; i++) {
+		uint32_t address = addresses(random);
+		if ((i & 1) == 0) {
+			const Ip4Network& inside = prefixes[picks(random)];
+			address = inside.getAddress() | (address & ~inside.getMask());
+		}
+		queries.push_back(Ip4Network::fromPrefix(address, 24 + (i % 9)));
+	}
+}
+
+static bool linearIncludes(const vector<Ip4Network>& prefixes, const Ip4Network& network)
+{
+	for (const Ip4Network& prefix : prefixes) {
+		if (prefix.includes(network)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static int runSize(mt19937& random, size_t count)
+{
+	vector<Ip4Network> prefixes;
+	vector<Ip4Network> queries;
+	buildPrefixes(random, count, prefixes);
+	buildQueries(random, prefixes, queries);
+
+	auto buildStart = chrono::steady_clock::now();
+	NetworkTrie trie;
+	for (const Ip4Network& prefix : prefixes) {
+		trie.add(prefix);
+	}
+	auto buildEnd = chrono::steady_clock::now();
+
+	vector<bool> trieAnswers(queries.size());
+	auto trieStart = chrono::steady_clock::now();
+	for (size_t i = 0; i < queries.size(); i++) {
+		trieAnswers[i] = trie.includes(queries[i]);
+	}
+	auto trieEnd = chrono::steady_clock::now();
+
+	vector<bool> linearAnswers(queries.size());
+	auto linearStart = chrono::steady_clock::now();
+	for (size_t i = 0; i < queries.size(); i++) {
+		linearAnswers[i] = linearIncludes(prefixes, queries[i]);
+	}
+	auto linearEnd = chrono::steady_clock::now();
+
+	int mismatches = 0;
+	size_t hits = 0;
+	for (size_t i = 0; i < queries.size(); i++) {
+		if (trieAnswers[i] != linearAnswers[i]) {
+			mismatches++;
+		}
+		if (trieAnswers[i]) {
+			hits++;
+		}
+	}
+
+	double buildMs = chrono::duration<double, milli>(buildEnd - buildStart).count();
+	double trieNs = chrono::duration<double, nano>(trieEnd - trieStart).count() / queries.size();
+	double linearNs = chrono::duration<double, nano>(linearEnd - linearStart).count() / queries.size();
+
+	printf("%7zu prefixes: build %.2f ms, trie %.1f ns/lookup, loop %.1f ns/lookup, %zu/%zu hits, %d mismatches\n",
+		count, buildMs, trieNs, linearNs, hits, queries.size(), mismatches);
+
+	return mismatches;
+}
+
+int runTrieBenchmark()
+{
+	printf("Internal network trie\n");
+
+	mt19937 random(RANDOM_SEED);
+
+	int mismatches = 0;
+	mismatches += runSize(random, 10000);
+	mismatches += runSize(random, 100000);
+
+	return (mismatches == 0) ? 0 : 1;
+}
@@ -0,0 +1,421 @@
+/******************************************************************************
+ * This file, along with all other files and components of this project, is   *
+ * subject to the Apache 2.0 license included at the root of the project.     *
+ *                                                                            *
+ * (c) 2021 Teaglu, LLC                                                       *
+ ******************************************************************************/
+
+#include "../autovpn/pch.h"
+#include <tlhelp32.h>
+#include <psapi.h>
+#include "../autovpn/Protocol.h"
+
+/*
+ * Opens a pile of pipe clients against the running service, each doing the
+ * same extended hello the user interface does, and holds them all open.  It
+ * reports how long each took to be accepted - from the first connect attempt
+ * to the HELLO record coming back - and what the service's working set and
+ * thread count did along the way.
+ *
+ * By default the clients go one after another.  A burst starts them all at
+ * once from their own threads, the way a terminal server sees a logon storm,
+ * which is what the listener count in SessionManager has to keep up with.
+ *
+ * The service has to be running.  Reading its working set needs an elevated
+ * console, since it runs as a different user; the thread count doesn't.
+ */
+
+// Clients to open when the command line doesn't say
+#define DEFAULT_CLIENTS 32
+
+// Clients in a burst when the command line doesn't say, about a logon storm
+#define DEFAULT_BURST_CLIENTS 150
+
+// How long one client gets to be answered before it counts as failed
+#define ACCEPT_TIMEOUT_MS 10000
+
+// Time for the service to settle before it's sampled
+#define SETTLE_MS 2000
+
+// The service answers the hello with a frame of its own, which is small
+#define READ_BUFFER_SIZE 4096
+
+#define SERVICE_IMAGE_NAME _T("autovpn.exe")
+
+static LPCTSTR pipeName = _T("\\\\.\\pipe\\teaglu_autovpn");
+
+struct ServiceSample {
+	bool running;
+	bool haveWorkingSet;
+	SIZE_T workingSet;
+	DWORD threads;
+};
+
+static ServiceSample sampleService()
+{
+	ServiceSample sample = {};
+
+	HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+	if (snapshot == INVALID_HANDLE_VALUE) {
+		return sample;
+	}
+
+	PROCESSENTRY32 entry;
+	entry.dwSize = sizeof(entry);
+
+	for (BOOL more = Process32First(snapshot, &entry); more; more = Process32Next(snapshot, &entry)) {
+		if (_tcsicmp(entry.szExeFile, SERVICE_IMAGE_NAME) != 0) {
+			continue;
+		}
+
+		sample.running = true;
+		sample.threads = entry.cntThreads;
+
+		HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, entry.th32ProcessID);
+		if (process != NULL) {
+			PROCESS_MEMORY_COUNTERS counters;
+			if (GetProcessMemoryInfo(process, &counters, sizeof(counters))) {
+				sample.haveWorkingSet = true;
+				sample.workingSet = counters.WorkingSetSize;
+			}
+			CloseHandle(process);
+		}
+		break;
+	}
+
+	CloseHandle(snapshot);
+	return sample;
+}
+
+static void printSample(const char *label, const ServiceSample& sample)
+{
+	if (!sample.running) {
+		printf("  %-8s service is not running\n", label);
+	} else if (!sample.haveWorkingSet) {
+		printf("  %-8s %lu threads, working set not readable - run elevated\n",
+			label, sample.threads);
+	} else {
+		printf("  %-8s %lu threads, working set %.1f MB\n",
+			label, sample.threads, sample.workingSet / (1024.0 * 1024.0));
+	}
+}
+
+static double elapsedMs(const LARGE_INTEGER& start, const LARGE_INTEGER& frequency)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	return (double)(now.QuadPart - start.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+}
+
+// Waits out one overlapped operation, giving up at the deadline
+static bool waitIo(HANDLE pipe, OVERLAPPED& overlapped, ULONGLONG deadline, DWORD& bytes)
+{
+	ULONGLONG now = GetTickCount64();
+	DWORD waitMs = (now < deadline) ? (DWORD)(deadline - now) : 0;
+
+	if (WaitForSingleObject(overlapped.hEvent, waitMs) != WAIT_OBJECT_0) {
+		CancelIoEx(pipe, &overlapped);
+		GetOverlappedResult(pipe, &overlapped, &bytes, TRUE);
+		return false;
+	}
+
+	return GetOverlappedResult(pipe, &overlapped, &bytes, FALSE) != FALSE;
+}
+
+static bool handshake(HANDLE pipe, ULONGLONG deadline)
+{
+	DWORD mode = PIPE_READMODE_MESSAGE;
+	if (!SetNamedPipeHandleState(pipe, &mode, NULL, NULL)) {
+		return false;
+	}
+
+	// Same hello the user interface sends when it follows the status page
+	uint16_t helloFlags = AVP_HELLO_FLAG_PAGE_STATUS;
+
+	BYTE helloMessage[AVP_EXTENDED_HELLO_SIZE] = AVP_HELLO_BYTES;
+	helloMessage[AVP_HELLO_SIZE] = (BYTE)(AVP_VERSION & 0xFF);
+	helloMessage[AVP_HELLO_SIZE + 1] = (BYTE)(AVP_VERSION >> 8);
+	helloMessage[AVP_HELLO_SIZE + 2] = (BYTE)(helloFlags & 0xFF);
+	helloMessage[AVP_HELLO_SIZE + 3] = (BYTE)(helloFlags >> 8);
+
+	OVERLAPPED overlapped = {};
+	overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (overlapped.hEvent == NULL) {
+		return false;
+	}
+
+	bool ok = false;
+	DWORD bytes = 0;
+
+	if ((WriteFile(pipe, helloMessage, sizeof(helloMessage), NULL, &overlapped) ||
+		(GetLastError() == ERROR_IO_PENDING)) &&
+		waitIo(pipe, overlapped, deadline, bytes) && (bytes == sizeof(helloMessage))) {
+
+		uint8_t buffer[READ_BUFFER_SIZE];
+
+		ResetEvent(overlapped.hEvent);
+		if ((ReadFile(pipe, buffer, sizeof(buffer), NULL, &overlapped) ||
+			(GetLastError() == ERROR_IO_PENDING)) &&
+			waitIo(pipe, overlapped, deadline, bytes)) {
+
+			ProtocolReader reader;
+			ProtocolRecord record;
+
+			if (ProtocolReader::openFrame(buffer, bytes, reader)) {
+				while (!ok && reader.next(record)) {
+					ok = (record.type == AVP_RECORD_HELLO);
+				}
+			}
+		}
+	}
+
+	CloseHandle(overlapped.hEvent);
+	return ok;
+}
+
+// Connects and handshakes, waiting for a listener if they're all taken.
+// Returns the open pipe or INVALID_HANDLE_VALUE.
+static HANDLE openClient(const LARGE_INTEGER& frequency, double& acceptMs, bool& busy)
+{
+	LARGE_INTEGER start;
+	QueryPerformanceCounter(&start);
+
+	ULONGLONG deadline = GetTickCount64() + ACCEPT_TIMEOUT_MS;
+	HANDLE pipe = INVALID_HANDLE_VALUE;
+
+	busy = false;
+	while (pipe == INVALID_HANDLE_VALUE) {
+		pipe = CreateFile(pipeName, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+			OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+
+		if (pipe == INVALID_HANDLE_VALUE) {
+			ULONGLONG now = GetTickCount64();
+			if ((GetLastError() != ERROR_PIPE_BUSY) || (now >= deadline)) {
+				return INVALID_HANDLE_VALUE;
+			}
+
+			busy = true;
+			WaitNamedPipe(pipeName, (DWORD)(deadline - now));
+		}
+	}
+
+	if (!handshake(pipe, deadline)) {
+		CloseHandle(pipe);
+		return INVALID_HANDLE_VALUE;
+	}
+
+	acceptMs = elapsedMs(start, frequency);
+	return pipe;
+}
+
+static double percentile(const vector<double>& sorted, double fraction)
+{
+	size_t index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+	return sorted[index];
+}
+
+static void printLatency(vector<double>& latencies, int busyCount, int failures)
+{
+	printf("  %zu accepted, %d found every listener taken, %d failed\n",
+		latencies.size(), busyCount, failures);
+
+	if (latencies.empty()) {
+		return;
+	}
+
+	sort(latencies.begin(), latencies.end());
+	printf("  Accept latency min %.2f ms, median %.2f ms, p95 %.2f ms, max %.2f ms\n",
+		latencies.front(), percentile(latencies, 0.5), percentile(latencies, 0.95),
+		latencies.back());
+}
+
+static void closeAll(vector<HANDLE>& pipes)
+{
+	for (HANDLE pipe : pipes) {
+		CloseHandle(pipe);
+	}
+	pipes.clear();
+}
+
+static int runSequential(int clients)
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+
+	printf("Opening %d clients one after another\n", clients);
+
+	ServiceSample before = sampleService();
+	if (!before.running) {
+		printSample("Before", before);
+		return 1;
+	}
+
+	vector<HANDLE> pipes;
+	vector<double> latencies;
+	int busyCount = 0;
+	int failures = 0;
+
+	for (int i = 0; i < clients; i++) {
+		double acceptMs = 0.0;
+		bool busy = false;
+
+		HANDLE pipe = openClient(frequency, acceptMs, busy);
+		if (pipe == INVALID_HANDLE_VALUE) {
+			failures++;
+		} else {
+			pipes.push_back(pipe);
+			latencies.push_back(acceptMs);
+		}
+		if (busy) {
+			busyCount++;
+		}
+	}
+
+	Sleep(SETTLE_MS);
+	ServiceSample held = sampleService();
+
+	closeAll(pipes);
+	Sleep(SETTLE_MS);
+	ServiceSample after = sampleService();
+
+	printLatency(latencies, busyCount, failures);
+	printSample("Before", before);
+	printSample("Held", held);
+	printSample("After", after);
+
+	return (failures == 0) ? 0 : 1;
+}
+
+struct BurstClient {
+	HANDLE start;
+	const LARGE_INTEGER *frequency;
+	HANDLE pipe;
+	double acceptMs;
+	bool busy;
+};
+
+static DWORD WINAPI burstThread(LPVOID param)
+{
+	BurstClient *client = (BurstClient *)param;
+
+	WaitForSingleObject(client->start, INFINITE);
+	client->pipe = openClient(*client->frequency, client->acceptMs, client->busy);
+
+	return 0;
+}
+
+static int runBurst(int clients)
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+
+	printf("Opening %d clients all at once\n", clients);
+
+	ServiceSample before = sampleService();
+	if (!before.running) {
+		printSample("Before", before);
+		return 1;
+	}
+
+	// Every thread is up and waiting before any of them connects
+	HANDLE start = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (start == NULL) {
+		fprintf(stderr, "Unable to create start event\n");
+		return 1;
+	}
+
+	vector<BurstClient> burst(clients);
+	vector<HANDLE> threads;
+
+	for (BurstClient& client : burst) {
+		client.start = start;
+		client.frequency = &frequency;
+		client.pipe = INVALID_HANDLE_VALUE;
+		client.acceptMs = 0.0;
+		client.busy = false;
+
+		HANDLE thread = CreateThread(NULL, 0, burstThread, &client, 0, NULL);
+		if (thread == NULL) {
+			fprintf(stderr, "Unable to start client thread\n");
+			break;
+		}
+		threads.push_back(thread);
+	}
+
+	LARGE_INTEGER released;
+	QueryPerformanceCounter(&released);
+	SetEvent(start);
+
+	for (HANDLE thread : threads) {
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
+	}
+	double burstMs = elapsedMs(released, frequency);
+	CloseHandle(start);
+
+	vector<HANDLE> pipes;
+	vector<double> latencies;
+	int busyCount = 0;
+	int failures = clients - (int)threads.size();
+
+	for (size_t i = 0; i < threads.size(); i++) {
+		if (burst[i].pipe == INVALID_HANDLE_VALUE) {
+			failures++;
+		} else {
+			pipes.push_back(burst[i].pipe);
+			latencies.push_back(burst[i].acceptMs);
+		}
+		if (burst[i].busy) {
+			busyCount++;
+		}
+	}
+
+	Sleep(SETTLE_MS);
+	ServiceSample held = sampleService();
+
+	closeAll(pipes);
+	Sleep(SETTLE_MS);
+	ServiceSample after = sampleService();
+
+	printLatency(latencies, busyCount, failures);
+	printf("  Whole burst done in %.2f ms\n", burstMs);
+	printSample("Before", before);
+	printSample("Held", held);
+	printSample("After", after);
+
+	return (failures == 0) ? 0 : 1;
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: autovpnstress [clients]\n");
+	fprintf(stderr, "       autovpnstress burst [clients]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	bool burst = false;
+	int argument = 1;
+
+	if ((argc > argument) && (strcmp(argv[argument], "burst") == 0)) {
+		burst = true;
+		argument++;
+	}
+
+	int clients = burst ? DEFAULT_BURST_CLIENTS : DEFAULT_CLIENTS;
+
+	if (argc > argument) {
+		clients = atoi(argv[argument++]);
+		if (clients <= 0) {
+			usage();
+			return 1;
+		}
+	}
+	if (argc > argument) {
+		usage();
+		return 1;
+	}
+
+	return burst ? runBurst(clients) : runSequential(clients);
+}
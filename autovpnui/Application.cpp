@@ -142,6 +142,8 @@ int Application::ExitInstance()
 		dialog->DestroyWindow();
 	}
 
+	Log::shutdown();
+
 	return CWinApp::ExitInstance();
 }
 
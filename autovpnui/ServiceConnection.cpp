@@ -6,6 +6,8 @@
 #include "pch.h"
 #include "Log.h"
 #include "ServiceConnection.h"
+#include "../autovpn/Protocol.h"
+#include "../autovpn/StatusPage.h"
 
 DWORD ServiceConnection::CDS_CONN_DATA=			0x52f871B0;
 DWORD ServiceConnection::CDS_CONN_ONLINE=		0xa5587b34;
@@ -14,15 +16,21 @@ DWORD ServiceConnection::CDS_CONN_OFFLINE=		0x1893baff;
 ServiceConnection::ServiceConnection()
 {
 	thread= NULL;
+	pageThread= NULL;
 	pipe= INVALID_HANDLE_VALUE;
 	copyDataDest= NULL;
 
+	pageOpen= false;
+	pipeSubscribed= false;
+
 	stopEvent= ::CreateEvent(NULL, TRUE, FALSE, NULL);
+	refreshEvent= ::CreateEvent(NULL, FALSE, FALSE, NULL);
 }
 
 ServiceConnection::~ServiceConnection()
 {
 	::CloseHandle(stopEvent);
+	::CloseHandle(refreshEvent);
 }
 
 void ServiceConnection::setCopyDataDest(HWND copyDataDest)
@@ -34,6 +42,7 @@ void ServiceConnection::setCopyDataDest(HWND copyDataDest)
 void ServiceConnection::start()
 {
 	::ResetEvent(stopEvent);
+	pageThread= new std::thread(&ServiceConnection::pageLoop, this);
 	thread= new std::thread(&ServiceConnection::mainLoop, this);
 }
 
@@ -41,16 +50,32 @@ void ServiceConnection::stop()
 {
 	::SetEvent(stopEvent);
 	thread->join();
+	pageThread->join();
 }
 
 #define READ_BUFFER_SIZE 2047
 
+// How long to wait for a free instance when they're all taken
+#define PIPE_BUSY_WAIT_MS 2000
+
+// How long a write can take before we give up on it.  The service reads
+// everything right away, so this only happens if it's wedged.
+#define WRITE_WAIT_MS 5000
+
+// How often to look for the status page when it isn't there
+#define PAGE_RETRY_MS 5000
+
+// A reader asleep through two updates can miss its wakeup, so the page gets
+// read again this often even if nothing woke us.
+#define PAGE_WAIT_MS 5000
+
 void ServiceConnection::mainLoop()
 {
 	static LPTSTR pipeName= _T("\\\\.\\pipe\\teaglu_autovpn");
 
 	for (bool run= true; run; ) {
 		bool readRun= false;
+		bool busy= false;
 		{
 			std::unique_lock<std::mutex> lock(mutex);
 
@@ -66,19 +91,41 @@ void ServiceConnection::mainLoop()
 				if (!SetNamedPipeHandleState(pipe, &mode, NULL, NULL)) {
 					Log::log(LOG_ERROR, _T("Error setting PIPE_READMODE_MESSAGE: {w32err}"));
 				}
+			} else if (GetLastError() == ERROR_PIPE_BUSY) {
+				// The service is up but every instance is taken, which happens
+				// when a lot of people log on at once.  It adds more as they
+				// get used, so wait for one rather than sleeping the full retry.
+				busy= true;
 			} else {
 				Log::log(LOG_ERROR,
 					_T("Error connecting to %s: {w32err}"), pipeName);
 			}
 		}
 
+		bool retryNow= false;
+		if (busy) {
+			Log::log(LOG_INFO, _T("Host service is busy, waiting for an instance"));
+			retryNow= (::WaitNamedPipe(pipeName, PIPE_BUSY_WAIT_MS) != FALSE);
+		}
+
 		if (readRun && run) {
 			Log::log(LOG_INFO, _T("Handshaking to server"));
 
-			BYTE helloMessage[8]={ 0x43, 0x81, 0xa9, 0x17, 0xee, 0xf2, 0x01, 0x92 };
+			// Decided once per connection, so status never comes from both
+			bool pageStatus= pageOpen;
+			pipeSubscribed= !pageStatus;
+			uint16_t helloFlags= pageStatus ? AVP_HELLO_FLAG_PAGE_STATUS : 0;
+
+			// The usual hello, plus the protocol version we want and flags
+			BYTE helloMessage[AVP_EXTENDED_HELLO_SIZE]= AVP_HELLO_BYTES;
+			helloMessage[AVP_HELLO_SIZE]= (BYTE)(AVP_VERSION & 0xFF);
+			helloMessage[AVP_HELLO_SIZE + 1]= (BYTE)(AVP_VERSION >> 8);
+			helloMessage[AVP_HELLO_SIZE + 2]= (BYTE)(helloFlags & 0xFF);
+			helloMessage[AVP_HELLO_SIZE + 3]= (BYTE)(helloFlags >> 8);
+
 			DWORD bytesWritten= 0;
 
-			if (!WriteFile(pipe, helloMessage, sizeof(helloMessage), &bytesWritten, NULL)) {
+			if (!writePipe(helloMessage, sizeof(helloMessage), bytesWritten)) {
 				Log::log(LOG_ERROR,
 					_T("Failed to write hello message on host socket: {w32err}"));
 				readRun= false;
@@ -87,8 +134,7 @@ void ServiceConnection::mainLoop()
 					_T("Unexpected write count on hello message to host socket: {w32err}"));
 				readRun = false;
 			} else {
-				// While we have the mutex, if there is a listener then notify them that
-				// the connection is invalid.
+				// If there is a listener then notify them that the connection is up
 				if (copyDataDest != NULL) {
 					COPYDATASTRUCT cds;
 					cds.dwData= CDS_CONN_ONLINE;
@@ -97,11 +143,19 @@ void ServiceConnection::mainLoop()
 
 					::SendMessage(copyDataDest, WM_COPYDATA, (WPARAM)copyDataDest, (LPARAM)&cds);
 				}
+
+				// Going offline greyed everything out, so show the page again
+				if (pageStatus) {
+					::SetEvent(refreshEvent);
+				}
 			}
 		}
 
 		HANDLE pipeEvent= CreateEvent(NULL, FALSE, FALSE, NULL);
 
+		// Frames bigger than the buffer come in pieces, collected here
+		std::vector<char> message;
+
 		while (readRun && run) {
 			char buffer[READ_BUFFER_SIZE + 1];
 			DWORD bufferLen= 0;
@@ -110,9 +164,13 @@ void ServiceConnection::mainLoop()
 			overlapped.hEvent= pipeEvent;
 
 			bool processData= false;
+			bool moreData= false;
 
 			if (::ReadFile(pipe, buffer, READ_BUFFER_SIZE, &bufferLen, &overlapped)) {
 				processData= true;
+			} else if (GetLastError() == ERROR_MORE_DATA) {
+				GetOverlappedResult(pipe, &overlapped, &bufferLen, FALSE);
+				moreData= true;
 			} else if (GetLastError() == ERROR_IO_PENDING) {
 				HANDLE events[2];
 				events[0]= pipeEvent;
@@ -122,6 +180,8 @@ void ServiceConnection::mainLoop()
 				if (waitVal == WAIT_OBJECT_0) {
 					if (GetOverlappedResult(pipe, &overlapped, &bufferLen, FALSE)) {
 						processData= true;
+					} else if (GetLastError() == ERROR_MORE_DATA) {
+						moreData= true;
 					} else {
 						Log::log(LOG_ERROR, _T("Error in host connection overlapped result: {w32err}"));
 						readRun= false;
@@ -139,14 +199,30 @@ void ServiceConnection::mainLoop()
 					_T("Error reading pipe connection to host service: {w32err}"));
 			}
 
-			if (processData) {
+			if (moreData) {
+				message.insert(message.end(), buffer, buffer + bufferLen);
+
+				if (message.size() > AVP_MAX_FRAME_SIZE) {
+					Log::log(LOG_ERROR, _T("Message from host service is too large"));
+					readRun= false;
+				}
+			} else if (processData) {
 				COPYDATASTRUCT cds;
 				cds.dwData= CDS_CONN_DATA;
-				cds.cbData= bufferLen;
-				cds.lpData= buffer;
+
+				if (message.empty()) {
+					cds.cbData= bufferLen;
+					cds.lpData= buffer;
+				} else {
+					message.insert(message.end(), buffer, buffer + bufferLen);
+					cds.cbData= (DWORD)message.size();
+					cds.lpData= message.data();
+				}
 
 				// Throw the message safely over to the message loop
 				::SendMessage(copyDataDest, WM_COPYDATA, (WPARAM)copyDataDest, (LPARAM)&cds);
+
+				message.clear();
 			}
 		}
 
@@ -156,20 +232,21 @@ void ServiceConnection::mainLoop()
 			std::unique_lock<std::mutex> lock(mutex);
 			::CloseHandle(pipe);
 			pipe= INVALID_HANDLE_VALUE;
+		}
 
-			// While we have the mutex, if there is a listener then notify them that
-			// the connection is invalid.
-			if (copyDataDest != NULL) {
-				COPYDATASTRUCT cds;
-				cds.dwData= CDS_CONN_OFFLINE;
-				cds.cbData= 0;
-				cds.lpData= NULL;
+		// Not holding the mutex - the window could be in send() waiting on it,
+		// and then neither of us would ever get anywhere.
+		if (copyDataDest != NULL) {
+			COPYDATASTRUCT cds;
+			cds.dwData= CDS_CONN_OFFLINE;
+			cds.cbData= 0;
+			cds.lpData= NULL;
 
-				::SendMessage(copyDataDest, WM_COPYDATA, (WPARAM)copyDataDest, (LPARAM)&cds);
-			}
+			::SendMessage(copyDataDest, WM_COPYDATA, (WPARAM)copyDataDest, (LPARAM)&cds);
 		}
+		pipeSubscribed= false;
 
-		if (run) {
+		if (run && !retryNow) {
 			// Sleep to retry
 			DWORD waitVal= ::WaitForSingleObject(stopEvent, 5000);
 			if (waitVal == WAIT_OBJECT_0) {
@@ -190,7 +267,7 @@ bool ServiceConnection::send(char *data, int dataLen)
 	if (pipe != INVALID_HANDLE_VALUE) {
 		DWORD bytesWritten= 0;
 
-		if (::WriteFile(pipe, data, dataLen, &bytesWritten, NULL)) {
+		if (writePipe(data, dataLen, bytesWritten)) {
 			if (bytesWritten == dataLen) {
 				rval= true;
 			}
@@ -202,3 +279,145 @@ bool ServiceConnection::send(char *data, int dataLen)
 
 	return rval;
 }
+
+bool ServiceConnection::writePipe(const void *data, DWORD dataLen, DWORD& bytesWritten)
+{
+	// The handle is overlapped, so every write needs its own OVERLAPPED - the
+	// read in mainLoop() has one outstanding the whole time.
+	HANDLE writeEvent= ::CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (writeEvent == NULL) {
+		return false;
+	}
+
+	OVERLAPPED overlapped= { 0 };
+	overlapped.hEvent= writeEvent;
+
+	bool rval= false;
+	bytesWritten= 0;
+
+	if (::WriteFile(pipe, data, dataLen, NULL, &overlapped) || (GetLastError() == ERROR_IO_PENDING)) {
+		bool timedOut= false;
+		if (::WaitForSingleObject(writeEvent, WRITE_WAIT_MS) != WAIT_OBJECT_0) {
+			// The OVERLAPPED is on our stack, so the write has to be finished
+			// one way or the other before we go anywhere.
+			::CancelIoEx(pipe, &overlapped);
+			timedOut= true;
+		}
+
+		rval= (::GetOverlappedResult(pipe, &overlapped, &bytesWritten, TRUE) != FALSE);
+		if (!rval && timedOut) {
+			SetLastError(ERROR_TIMEOUT);
+		}
+	}
+
+	DWORD error= GetLastError();
+	::CloseHandle(writeEvent);
+	SetLastError(error);
+
+	return rval;
+}
+
+void ServiceConnection::pageLoop()
+{
+	StatusPageReader reader;
+
+	// The last status generation we saw, sent on or not.  Counter refreshes
+	// are updates too, but they leave the generation alone and there's
+	// nothing in them for the window.
+	unsigned long seenGeneration= 0;
+	bool haveSeen= false;
+
+	for (bool run= true; run; ) {
+		bool refresh= false;
+
+		if (!reader.isOpen()) {
+			// Old service, or it isn't running yet
+			if (reader.open()) {
+				Log::log(LOG_INFO, _T("Following the host service status page"));
+				pageOpen= true;
+				refresh= true;
+			}
+		}
+
+		LONG updates= -1;
+		HANDLE events[3];
+		DWORD eventCount= 0;
+		events[eventCount++]= stopEvent;
+		events[eventCount++]= refreshEvent;
+
+		do {
+			if (!reader.isOpen()) {
+				break;
+			}
+
+			AutoVPNStatusPageData data;
+			bool haveData= reader.read(data, updates);
+
+			// Updates is only good if the read got a clean look, or found
+			// nothing published yet.
+			if (haveData || (updates == 0)) {
+				events[eventCount++]= reader.getUpdateEvent(updates);
+			}
+			if (!haveData) {
+				break;
+			}
+
+			bool changed= !haveSeen || (data.generation != seenGeneration);
+			seenGeneration= data.generation;
+			haveSeen= true;
+
+			// While the pipe is sending status it's the one the window follows
+			if ((changed || refresh) && !pipeSubscribed) {
+				forwardPage(data);
+			}
+		} while (false);
+
+		DWORD waitVal= ::WaitForMultipleObjects(eventCount, events, FALSE,
+			reader.isOpen() ? PAGE_WAIT_MS : PAGE_RETRY_MS);
+
+		if (waitVal == WAIT_OBJECT_0) {
+			run= false;
+		} else if (waitVal == (WAIT_OBJECT_0 + 1)) {
+			// Whatever is on the page goes again, changed or not
+			haveSeen= false;
+		} else if (waitVal == WAIT_FAILED) {
+			Log::log(LOG_ERROR,
+				_T("Error in WaitForMultipleObjects on the status page: {w32err}"));
+			::WaitForSingleObject(stopEvent, PAGE_RETRY_MS);
+		}
+	}
+
+	pageOpen= false;
+}
+
+void ServiceConnection::forwardPage(const AutoVPNStatusPageData& data)
+{
+	if (copyDataDest == NULL) {
+		return;
+	}
+
+	// Made into the same frame the pipe would send, so the window only has
+	// one way to take status in.
+	ProtocolWriter writer;
+	writer.begin(AVP_RECORD_STATUS);
+	writer.addU16(AVP_FIELD_STATE, (uint16_t)data.status.state);
+	writer.addBytes(AVP_FIELD_SSID, data.status.ssid, strnlen(data.status.ssid, sizeof(data.status.ssid)));
+	writer.addU16(AVP_FIELD_WIFI_PROBLEM, (uint16_t)data.status.wifiProblem);
+	writer.addU16(AVP_FIELD_SIGNAL_QUALITY, (uint16_t)data.status.signalQuality);
+	writer.addU32(AVP_FIELD_RX_RATE, data.status.rxRate);
+	writer.addU32(AVP_FIELD_TX_RATE, data.status.txRate);
+	writer.addU32(AVP_FIELD_GENERATION, data.generation);
+	writer.end();
+
+	writer.addText(AVP_RECORD_SUGGESTION, data.suggestion,
+		wcsnlen(data.suggestion, AVSP_SUGGESTION_SIZE));
+
+	std::vector<uint8_t> frame= writer.take();
+
+	COPYDATASTRUCT cds;
+	cds.dwData= CDS_CONN_DATA;
+	cds.cbData= (DWORD)frame.size();
+	cds.lpData= frame.data();
+
+	::SendMessage(copyDataDest, WM_COPYDATA, (WPARAM)copyDataDest, (LPARAM)&cds);
+}
@@ -5,6 +5,14 @@
 
 #pragma once
 
+struct _AutoVPNStatusPageData;
+
+/*
+ * Status comes from the service's shared status page whenever it's there,
+ * and the pipe is left for commands and queries.  If the page can't be opened
+ * when the pipe connects, the pipe carries status like it always did.  Both
+ * hand what they get to the window as CDS_CONN_DATA frames.
+ */
 class ServiceConnection {
 public:
 	ServiceConnection();
@@ -30,8 +38,24 @@ private:
 
 	void mainLoop();
 
+	// Follows the status page on its own thread
+	void pageLoop();
+	void forwardPage(const _AutoVPNStatusPageData& data);
+
+	// Set while the page is open, so the pipe can tell the service not to
+	// send status.  While the pipe is sending it anyway the page stays quiet.
+	std::atomic<bool> pageOpen;
+	std::atomic<bool> pipeSubscribed;
+
+	// Set when the pipe comes back, so the page gets sent over again
+	HANDLE refreshEvent;
+
+	// Writes on the pipe and waits for it to finish, with a timeout
+	bool writePipe(const void *data, DWORD dataLen, DWORD& bytesWritten);
+
 	HANDLE pipe;
 	HANDLE stopEvent;
 	std::thread *thread;
+	std::thread *pageThread;
 };
 
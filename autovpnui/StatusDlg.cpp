@@ -7,10 +7,12 @@
 #include "Application.h"
 #include "StatusDlg.h"
 #include "ServiceConnection.h"
+#include "Log.h"
 
 // The auto-detect of changes in VS doesn't work here, so if you change this
 // in autovpn project be sure to run a "clean".  -DAW 201120
 #include "../autovpn/Message.h"
+#include "../autovpn/Protocol.h"
 
 // StatusDlg dialog
 
@@ -32,6 +34,9 @@ StatusDlg::StatusDlg(CWnd* pParent /*=nullptr*/)
 	wifiProblem = false;
 	visible = false;
 
+	ZeroMemory(&received, sizeof(received));
+	receivedGeneration = 0;
+
 	bringToFrontTimer = 0;
 	hideOnSuccessTimer = 0;
 }
@@ -52,6 +57,7 @@ BEGIN_MESSAGE_MAP(StatusDlg, CDialogEx)
 	ON_WM_COPYDATA()
 	ON_WM_ERASEBKGND()
 	ON_WM_TIMER()
+	ON_WM_SYSCOMMAND()
 END_MESSAGE_MAP()
 
 void StatusDlg::OnDialogOk()
@@ -385,55 +391,139 @@ BOOL StatusDlg::OnCopyData(CWnd* pWnd, COPYDATASTRUCT* cds)
 	bool hideOnSuccess = false;
 
 	if (cds->dwData == ServiceConnection::CDS_CONN_DATA) {
-		if (cds->cbData >= sizeof(AutoVPNHeader)) {
-			AutoVPNHeader* header = (AutoVPNHeader*)cds->lpData;
-			if (header->version == AV_VERSION) {
-				switch (header->opcode) {
-				case AV_MESSAGE_STATUS:
-					if (header->length == sizeof(AutoVPNStatus)) {
-						if (cds->cbData >= (sizeof(AutoVPNHeader) + sizeof(AutoVPNStatus))) {
-							AutoVPNStatus* data =
-								(AutoVPNStatus*)((LPBYTE)cds->lpData + sizeof(AutoVPNHeader));
-
-							bool newWifiProblem = (data->wifiProblem > 0);
-
-							attention = false;
-							if ((state != data->state) || (newWifiProblem != wifiProblem)) {
-								attention = true;
+		// One frame can hold several records, which are handled in order
+		ProtocolReader reader;
+		if (ProtocolReader::openFrame(cds->lpData, cds->cbData, reader)) {
+			ProtocolRecord record;
+			while (reader.next(record)) {
+				switch (record.type) {
+				case AVP_RECORD_STATUS:
+				case AVP_RECORD_STATUS_DELTA:
+					{
+						// A full status starts from zero, and a delta from what we
+						// already have.
+						bool delta = (record.type == AVP_RECORD_STATUS_DELTA);
+
+						AutoVPNStatus parsed;
+						if (delta) {
+							parsed = received;
+						} else {
+							ZeroMemory(&parsed, sizeof(parsed));
+						}
+
+						unsigned long generation = 0;
+						unsigned long baseGeneration = 0;
+
+						ProtocolReader fields = record.getFields();
+						ProtocolRecord field;
+						while (fields.next(field)) {
+							switch (field.type) {
+							case AVP_FIELD_STATE:
+								parsed.state = (short)field.getU16();
+								break;
+							case AVP_FIELD_SSID:
+								ZeroMemory(parsed.ssid, sizeof(parsed.ssid));
+								CopyMemory(parsed.ssid, field.value,
+									min(field.length, (uint32_t)sizeof(parsed.ssid) - 1));
+								break;
+							case AVP_FIELD_WIFI_PROBLEM:
+								parsed.wifiProblem = (short)field.getU16();
+								break;
+							case AVP_FIELD_SIGNAL_QUALITY:
+								parsed.signalQuality = (short)field.getU16();
+								break;
+							case AVP_FIELD_RX_RATE:
+								parsed.rxRate = field.getU32();
+								break;
+							case AVP_FIELD_TX_RATE:
+								parsed.txRate = field.getU32();
+								break;
+							case AVP_FIELD_GENERATION:
+								generation = field.getU32();
+								break;
+							case AVP_FIELD_BASE_GENERATION:
+								baseGeneration = field.getU32();
+								break;
 							}
+						}
+
+						// A delta on top of something we don't have would leave us
+						// showing a mix, so ask for everything again instead.
+						if (delta && ((receivedGeneration == 0) || (baseGeneration != receivedGeneration))) {
+							requestResync();
+							break;
+						}
+
+						received = parsed;
+						receivedGeneration = generation;
+
+						AutoVPNStatus* data = &parsed;
+
+						bool newWifiProblem = (data->wifiProblem > 0);
+
+						attention = false;
+						if ((state != data->state) || (newWifiProblem != wifiProblem)) {
+							attention = true;
+						}
 
-							if (visible) {
-								// If we're currently visible, AND we're going from NOT in one of our
-								// "final target" states TO one of our "final target" states, then
-								// "everything is fine" and we should automatically get out of the
-								// user's face.
-								if ((state != AVS_VPN_CONNECTED) && (state != AVS_INTRANET)) {
-									if ((data->state == AVS_VPN_CONNECTED) || (data->state == AVS_INTRANET)) {
-										hideOnSuccess = true;
-									}
+						if (visible) {
+							// If we're currently visible, AND we're going from NOT in one of our
+							// "final target" states TO one of our "final target" states, then
+							// "everything is fine" and we should automatically get out of the
+							// user's face.
+							if ((state != AVS_VPN_CONNECTED) && (state != AVS_INTRANET)) {
+								if ((data->state == AVS_VPN_CONNECTED) || (data->state == AVS_INTRANET)) {
+									hideOnSuccess = true;
 								}
 							}
+						}
 
-							state = data->state;
-							signalQuality = data->signalQuality;
-							txRate = data->txRate;
-							rxRate = data->rxRate;
-							ssid = data->ssid;
-							wifiProblem = newWifiProblem;
+						state = data->state;
+						signalQuality = data->signalQuality;
+						txRate = data->txRate;
+						rxRate = data->rxRate;
+						ssid = data->ssid;
+						wifiProblem = newWifiProblem;
 
-							refreshScreen = true;
+						refreshScreen = true;
+					}
+					break;
+
+				case AVP_RECORD_COMMAND_RESULT:
+					{
+						// Nothing to show if it worked - the status update says it all
+						uint16_t command = 0;
+						uint16_t result = AVP_RESULT_OK;
+
+						ProtocolReader fields = record.getFields();
+						ProtocolRecord field;
+						while (fields.next(field)) {
+							switch (field.type) {
+							case AVP_FIELD_COMMAND:
+								command = field.getU16();
+								break;
+							case AVP_FIELD_RESULT:
+								result = field.getU16();
+								break;
+							}
+						}
+
+						if (result == AVP_RESULT_RATE_LIMITED) {
+							Log::log(LOG_INFO, _T("Service says command %d was asked for too soon"), command);
+						} else if (result != AVP_RESULT_OK) {
+							Log::log(LOG_WARNING, _T("Service returned %d for command %d"), result, command);
 						}
 					}
 					break;
 
-				case AV_MESSAGE_SUGGESTION:
-					// Well this is quite a dance.
-					LPCTSTR stringData = (LPCTSTR)&((char *)cds->lpData)[sizeof(AutoVPNHeader)];
-					size_t stringLen = header->length / sizeof(TCHAR);
+				case AVP_RECORD_SUGGESTION:
+					{
+						// The text isn't terminated or aligned, so it gets copied out
+						uint32_t stringLen = record.getTextLength();
 
-					// Make sure it's null terminated
-					if (stringData[stringLen] == '\0') {
-						CString newSuggestion(stringData);
+						CString newSuggestion;
+						record.getText(newSuggestion.GetBuffer(stringLen), stringLen);
+						newSuggestion.ReleaseBuffer(stringLen);
 
 						if (newSuggestion.Compare(suggestion) != 0) {
 							suggestion = newSuggestion;
@@ -444,7 +534,6 @@ BOOL StatusDlg::OnCopyData(CWnd* pWnd, COPYDATASTRUCT* cds)
 							}
 						}
 					}
-
 					break;
 				}
 			}
@@ -459,6 +548,9 @@ BOOL StatusDlg::OnCopyData(CWnd* pWnd, COPYDATASTRUCT* cds)
 		ssid.Empty();
 		suggestion.Empty();
 
+		ZeroMemory(&received, sizeof(received));
+		receivedGeneration = 0;
+
 		refreshScreen = true;
 	} else if (cds->dwData == CDS_RELAUNCH) {
 		// This is the user kicking us by trying to start a second copy.
@@ -604,7 +696,16 @@ BOOL StatusDlg::OnInitDialog()
 		DEFAULT_PITCH,
 		_T("Arial"));
 
-	// Start the connection to the service.
+	// Let the user ask for a fresh look instead of waiting for the service
+	CMenu* systemMenu = GetSystemMenu(FALSE);
+	if (systemMenu != NULL) {
+		systemMenu->AppendMenu(MF_SEPARATOR);
+		systemMenu->AppendMenu(MF_STRING, IDM_RECHECK, _T("Check again now"));
+		systemMenu->AppendMenu(MF_STRING, IDM_RUN_DIAGNOSTICS, _T("Run diagnostics now"));
+	}
+
+	// Start the connection to the service.  Status from the shared page
+	// comes in right away, before the pipe has even connected.
 	service = new ServiceConnection();
 	service->setCopyDataDest(m_hWnd);
 	service->start();
@@ -612,6 +713,47 @@ BOOL StatusDlg::OnInitDialog()
 	return TRUE;
 }
 
+void StatusDlg::requestResync()
+{
+	ProtocolWriter writer;
+	writer.addEmpty(AVP_RECORD_RESYNC);
+
+	const std::vector<uint8_t>& frame = writer.finish();
+	if (!service->send((char *)frame.data(), (int)frame.size())) {
+		// We'll be back to a full status when the connection comes back
+		Log::log(LOG_WARNING, _T("Failed to ask the service for a full status"));
+	}
+}
+
+void StatusDlg::sendCommand(unsigned short command)
+{
+	ProtocolWriter writer;
+	writer.addEmpty(command);
+
+	const std::vector<uint8_t>& frame = writer.finish();
+	if (!service->send((char *)frame.data(), (int)frame.size())) {
+		Log::log(LOG_WARNING, _T("Failed to send command %d to the service"), command);
+	}
+}
+
+void StatusDlg::OnSysCommand(UINT nID, LPARAM lParam)
+{
+	// The low four bits are used by the system
+	switch (nID & 0xFFF0) {
+	case IDM_RECHECK:
+		sendCommand(AVP_RECORD_RECHECK);
+		break;
+
+	case IDM_RUN_DIAGNOSTICS:
+		sendCommand(AVP_RECORD_RUN_DIAGNOSTICS);
+		break;
+
+	default:
+		CDialogEx::OnSysCommand(nID, lParam);
+		break;
+	}
+}
+
 void StatusDlg::OnTimer(UINT_PTR timerId)
 {
 	switch (timerId) {
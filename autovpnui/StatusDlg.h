@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include "../autovpn/Message.h"
 
 class ServiceConnection;
 
@@ -43,6 +44,16 @@ protected:
 
 	CString suggestion;
 
+	// The last status from the service as it came in, which deltas are
+	// applied on top of.  Zero generation means we don't have one yet.
+	AutoVPNStatus received;
+	unsigned long receivedGeneration;
+	void requestResync();
+
+	// Send a command record to the service, which answers with a
+	// COMMAND_RESULT and then whatever status changes.
+	void sendCommand(unsigned short command);
+
 	UINT_PTR bringToFrontTimer;
 	UINT_PTR hideOnSuccessTimer;
 
@@ -56,4 +67,5 @@ public:
 	afx_msg BOOL OnEraseBkgnd(CDC* pDC);
 	virtual BOOL OnInitDialog();
 	afx_msg void OnTimer(UINT_PTR nIDEvent);
+	afx_msg void OnSysCommand(UINT nID, LPARAM lParam);
 };
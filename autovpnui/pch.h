@@ -56,6 +56,7 @@
 #include <deque>
 #include <mutex>
 #include <thread>
+#include <atomic>
 #include <afxcontrolbars.h>
 
 
@@ -8,6 +8,10 @@
 #define IDP_SOCKETS_INIT_FAILED         104
 #define IDI_DIALOG                      312
 
+// System menu commands, which have to be multiples of 16 below 0xF000
+#define IDM_RECHECK                     0x0010
+#define IDM_RUN_DIAGNOSTICS             0x0020
+
 // Next default values for new objects
 // 
 #ifdef APSTUDIO_INVOKED